@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "chat_stats.hpp"
+
+// objects carved out of each slab
+#define SLAB_OBJECTS 256
+
+namespace chat
+{
+
+    /**
+     * @brief Fixed size object pool carved out of slabs of SLAB_OBJECTS objects.
+     *
+     * Freed objects go onto a free list and slabs are never returned to the heap, so once a
+     * pool has grown to its working set create() and destroy() do not call malloc.
+     * Thread safe.
+     */
+    template <typename T>
+    class slab_pool
+    {
+    public:
+        /**
+         * @param name prefix of the pool's counters
+         */
+        explicit slab_pool(const std::string &name)
+            : live_{name + ".live"}, peak_{name + ".peak"}, slabs_{name + ".slabs"} {}
+
+        ~slab_pool()
+        {
+            for (auto slab : slab_list_)
+            {
+                ::operator delete(slab);
+            }
+        }
+
+        slab_pool(const slab_pool &) = delete;
+        slab_pool &operator=(const slab_pool &) = delete;
+
+        /**
+         * @brief uninitialised storage for one T
+         */
+        void *allocate()
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (free_ == nullptr)
+            {
+                grow();
+            }
+            slot *s = free_;
+            free_ = s->next_;
+            live_.add();
+            peak_.max(live_.value());
+            return s;
+        }
+
+        /**
+         * @brief return storage obtained from allocate()
+         */
+        void deallocate(void *ptr)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            slot *s = static_cast<slot *>(ptr);
+            s->next_ = free_;
+            free_ = s;
+            live_.sub();
+        }
+
+        /**
+         * @brief allocate and construct a T
+         */
+        template <typename... Args>
+        T *create(Args &&...args)
+        {
+            return new (allocate()) T(std::forward<Args>(args)...);
+        }
+
+        /**
+         * @brief destroy and free a T obtained from create()
+         */
+        void destroy(T *ptr)
+        {
+            if (ptr != nullptr)
+            {
+                ptr->~T();
+                deallocate(ptr);
+            }
+        }
+
+    private:
+        union slot
+        {
+            slot *next_;
+            alignas(T) unsigned char storage_[sizeof(T)];
+        };
+
+        void grow()
+        {
+            slot *slab = static_cast<slot *>(::operator new(sizeof(slot) * SLAB_OBJECTS));
+            slab_list_.push_back(slab);
+            slabs_.add();
+            for (size_t i = 0; i < SLAB_OBJECTS; i++)
+            {
+                slab[i].next_ = free_;
+                free_ = &slab[i];
+            }
+        }
+
+        std::mutex mutex_;
+        slot *free_ = nullptr;
+        std::vector<slot *> slab_list_;
+        counter live_;
+        counter peak_;
+        counter slabs_;
+    };
+
+    /**
+     * @brief Standard allocator handing out single objects from a shared slab_pool.
+     *
+     * Intended for node based containers such as std::map, whose nodes are always allocated
+     * one at a time. Requests for more than one object fall back to operator new.
+     */
+    template <typename T>
+    struct slab_allocator
+    {
+        typedef T value_type;
+
+        slab_allocator() = default;
+
+        template <typename U>
+        slab_allocator(const slab_allocator<U> &) {}
+
+        T *allocate(size_t n)
+        {
+            if (n == 1)
+            {
+                return static_cast<T *>(pool().allocate());
+            }
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *ptr, size_t n)
+        {
+            if (n == 1)
+            {
+                pool().deallocate(ptr);
+            }
+            else
+            {
+                ::operator delete(ptr);
+            }
+        }
+
+        static slab_pool<T> &pool()
+        {
+            static slab_pool<T> pool{"alloc.node" + std::to_string(sizeof(T))};
+            return pool;
+        }
+
+        template <typename U>
+        bool operator==(const slab_allocator<U> &) const { return true; }
+
+        template <typename U>
+        bool operator!=(const slab_allocator<U> &) const { return false; }
+    };
+
+}; // namespace chat
@@ -0,0 +1,613 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "chat_new.hpp"
+#include "chat_log.hpp"
+#include "chat_stats.hpp"
+
+// TCP port bulk transfers are made on, next to the chat port
+#define BLOB_PORT (SERVER_PORT + 1)
+// directory blobs stored on the server are kept in
+#define BLOB_DIR "blobs"
+// bytes moved by one splice or sendfile call
+#define BLOB_CHUNK (1024 * 1024)
+// how long an accepted transfer waits for its peers to connect
+#define BLOB_CONNECT_TIMEOUT std::chrono::seconds(60)
+
+namespace chat
+{
+
+    /**
+     * @brief What a bulk transfer moves bytes between
+     * @var blob_kind::BLOB_RELAY
+     * From one client to another, the server splices one connection into the other
+     * @var blob_kind::BLOB_STORE
+     * From a client into a blob stored on the server
+     * @var blob_kind::BLOB_FETCH
+     * From a blob stored on the server to a client
+     */
+    enum blob_kind
+    {
+        BLOB_RELAY,
+        BLOB_STORE,
+        BLOB_FETCH,
+    };
+
+    /**
+     * @brief check a blob name can be used as a file name in BLOB_DIR
+     */
+    inline bool is_valid_blob_name(std::string_view name)
+    {
+        return !name.empty() && name.size() < 256 && name.front() != '.' &&
+               name.find('/') == std::string_view::npos && name.find(':') == std::string_view::npos;
+    }
+
+    /**
+     * @brief parse a decimal field of an OFFER or ACCEPT message
+     * @return false unless the whole of text is a number
+     */
+    inline bool parse_number(std::string_view text, uint64_t &value)
+    {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return ec == std::errc{} && end == text.data() + text.size() && !text.empty();
+    }
+
+    /**
+     * @brief move up to length bytes from in to out through a pipe, so they never enter user space
+     *
+     * @param in descriptor to read from, a socket
+     * @param out descriptor to write to, a socket or a file
+     * @param out_offset file offset to write at, nullptr for a socket
+     * @param length bytes to move
+     * @return bytes moved, less than length if in reached end of file or an error occured
+     */
+    inline uint64_t splice_all(int in, int out, loff_t *out_offset, uint64_t length)
+    {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+        {
+            return 0;
+        }
+        uint64_t moved = 0;
+        while (moved < length)
+        {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(length - moved, BLOB_CHUNK));
+            ssize_t filled = splice(in, nullptr, pipe_fds[1], nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (filled <= 0)
+            {
+                break;
+            }
+            while (filled > 0)
+            {
+                ssize_t drained = splice(pipe_fds[0], nullptr, out, out_offset, static_cast<size_t>(filled), SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (drained <= 0)
+                {
+                    close(pipe_fds[0]);
+                    close(pipe_fds[1]);
+                    return moved;
+                }
+                filled -= drained;
+                moved += static_cast<uint64_t>(drained);
+            }
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return moved;
+    }
+
+    /**
+     * @brief send length bytes of a file from offset with sendfile
+     * @return bytes sent
+     */
+    inline uint64_t sendfile_all(int out, int file, uint64_t offset, uint64_t length)
+    {
+        off_t pos = static_cast<off_t>(offset);
+        uint64_t sent = 0;
+        while (sent < length)
+        {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(length - sent, BLOB_CHUNK));
+            ssize_t n = sendfile(out, file, &pos, chunk);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += static_cast<uint64_t>(n);
+        }
+        return sent;
+    }
+
+    /**
+     * @brief Bulk transfer side channel of the chat server.
+     *
+     * Transfers are negotiated over the chat protocol with OFFER and ACCEPT. Accepting an offer
+     * gives each side a token, which it sends as the first 8 bytes on a TCP connection to
+     * BLOB_PORT. The payload is then moved with splice or sendfile, never copied through user
+     * space. Every transfer starts at an offset agreed in ACCEPT, so an interrupted one is
+     * resumed by offering it again and accepting from the bytes already received.
+     *
+     * Each connection is served by its own thread, as transfers are long and few.
+     */
+    class blob_server
+    {
+    public:
+        /**
+         * @brief a transfer as agreed over the chat protocol
+         */
+        struct transfer
+        {
+            uint32_t id_;
+            blob_kind kind_;
+            std::string name_;
+            uint64_t size_;
+            uint64_t offset_ = 0;
+            std::string sender_;    // user sending the blob, empty when fetching from the store
+            std::string recipient_; // user receiving it, empty when storing on the server
+            uint64_t upload_token_ = 0;
+            uint64_t download_token_ = 0;
+            bool accepted_ = false;
+            int parked_fd_ = -1; // first side of a relay to connect waits here for the other
+            std::chrono::steady_clock::time_point created_;
+        };
+
+        blob_server()
+            : started_{"blob.transfers_started"}, completed_{"blob.transfers_completed"},
+              bytes_{"blob.bytes"}, active_{"blob.active"}, throughput_{"blob.throughput_kib_s"},
+              random_{std::random_device{}()} {}
+
+        ~blob_server()
+        {
+            stop();
+        }
+
+        blob_server(const blob_server &) = delete;
+        blob_server &operator=(const blob_server &) = delete;
+
+        /**
+         * @brief listen for transfer connections on address:BLOB_PORT
+         * @return false if the port could not be opened
+         */
+        bool start(const sockaddr_in &address)
+        {
+            mkdir(BLOB_DIR, 0755);
+            listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listen_fd_ < 0)
+            {
+                return false;
+            }
+            int on = 1;
+            setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            sockaddr_in bind_address = address;
+            bind_address.sin_port = htons(BLOB_PORT);
+            if (bind(listen_fd_, (sockaddr *)&bind_address, sizeof(bind_address)) != 0 || listen(listen_fd_, 16) != 0)
+            {
+                close(listen_fd_);
+                listen_fd_ = -1;
+                return false;
+            }
+            acceptor_ = std::thread{[this]()
+                                    { accept_loop(); }};
+            return true;
+        }
+
+        /**
+         * @brief stop accepting, abort transfers in progress and join their threads
+         */
+        void stop()
+        {
+            if (listen_fd_ < 0)
+            {
+                return;
+            }
+            stopping_ = true;
+            shutdown(listen_fd_, SHUT_RDWR);
+            acceptor_.join();
+            close(listen_fd_);
+            listen_fd_ = -1;
+
+            std::vector<std::thread> connections;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                for (int fd : open_fds_)
+                {
+                    shutdown(fd, SHUT_RDWR);
+                }
+                connections.swap(connections_);
+            }
+            for (auto &t : connections)
+            {
+                t.join();
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            for (auto &[id, t] : transfers_)
+            {
+                if (t->parked_fd_ >= 0)
+                {
+                    close(t->parked_fd_);
+                }
+            }
+            transfers_.clear();
+            tokens_.clear();
+        }
+
+        /**
+         * @brief record an offer of a blob to a user, or to the store if recipient is empty
+         * @return id of the transfer
+         */
+        uint32_t offer(std::string_view sender, std::string_view recipient, std::string_view name, uint64_t size)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            expire();
+            auto t = std::make_shared<transfer>();
+            t->id_ = next_id_++;
+            t->kind_ = recipient.empty() ? BLOB_STORE : BLOB_RELAY;
+            t->name_ = name;
+            t->size_ = size;
+            t->sender_ = sender;
+            t->recipient_ = recipient;
+            t->created_ = std::chrono::steady_clock::now();
+            transfers_[t->id_] = t;
+            return t->id_;
+        }
+
+        /**
+         * @brief accept an offered transfer, or the fetch of a stored blob, starting at offset
+         *
+         * For a store the offset is ignored and the transfer resumes from the size of the
+         * partly stored blob instead.
+         *
+         * @param id transfer to accept
+         * @param user user accepting, must be the recipient (or the sender, for a store)
+         * @param offset bytes the receiving side already has
+         * @param out filled in with the agreed transfer on success
+         * @return false if there is no such offer for user
+         */
+        bool accept(uint32_t id, std::string_view user, uint64_t offset, transfer &out)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto it = transfers_.find(id);
+            if (it == transfers_.end() || it->second->accepted_)
+            {
+                return false;
+            }
+            transfer &t = *it->second;
+            if ((t.kind_ == BLOB_RELAY && t.recipient_ != user) || (t.kind_ == BLOB_STORE && t.sender_ != user))
+            {
+                return false;
+            }
+            if (t.kind_ == BLOB_STORE)
+            {
+                struct stat st;
+                offset = stat(path(t.name_).c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+            }
+            t.offset_ = std::min(offset, t.size_);
+            t.accepted_ = true;
+            issue_tokens(it->second);
+            out = t;
+            return true;
+        }
+
+        /**
+         * @brief start fetching a stored blob from offset
+         * @return false if no blob of that name is stored
+         */
+        bool fetch(std::string_view user, std::string_view name, uint64_t offset, transfer &out)
+        {
+            if (!is_valid_blob_name(name))
+            {
+                return false;
+            }
+            struct stat st;
+            if (stat(path(name).c_str(), &st) != 0)
+            {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            expire();
+            auto t = std::make_shared<transfer>();
+            t->id_ = next_id_++;
+            t->kind_ = BLOB_FETCH;
+            t->name_ = name;
+            t->size_ = static_cast<uint64_t>(st.st_size);
+            t->offset_ = std::min(offset, t->size_);
+            t->recipient_ = user;
+            t->accepted_ = true;
+            t->created_ = std::chrono::steady_clock::now();
+            transfers_[t->id_] = t;
+            issue_tokens(t);
+            out = *t;
+            return true;
+        }
+
+    private:
+        static std::string path(std::string_view name)
+        {
+            return std::string{BLOB_DIR} + "/" + std::string{name};
+        }
+
+        /**
+         * @brief give the transfer a token for each side that connects to us, mutex_ held
+         */
+        void issue_tokens(const std::shared_ptr<transfer> &t)
+        {
+            if (t->kind_ != BLOB_FETCH)
+            {
+                t->upload_token_ = random_();
+                tokens_[t->upload_token_] = t;
+            }
+            if (t->kind_ != BLOB_STORE)
+            {
+                t->download_token_ = random_();
+                tokens_[t->download_token_] = t;
+            }
+        }
+
+        /**
+         * @brief forget transfers nobody connected to in time, mutex_ held
+         */
+        void expire()
+        {
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = transfers_.begin(); it != transfers_.end();)
+            {
+                transfer &t = *it->second;
+                if (now - t.created_ > BLOB_CONNECT_TIMEOUT)
+                {
+                    if (t.parked_fd_ >= 0)
+                    {
+                        close(t.parked_fd_);
+                        forget_fd(t.parked_fd_);
+                    }
+                    tokens_.erase(t.upload_token_);
+                    tokens_.erase(t.download_token_);
+                    it = transfers_.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        void forget_fd(int fd)
+        {
+            open_fds_.erase(std::remove(open_fds_.begin(), open_fds_.end(), fd), open_fds_.end());
+        }
+
+        void accept_loop()
+        {
+            while (!stopping_)
+            {
+                int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                    {
+                        continue;
+                    }
+                    return;
+                }
+                std::lock_guard<std::mutex> lock{mutex_};
+                open_fds_.push_back(fd);
+                connections_.emplace_back([this, fd]()
+                                          { serve(fd); });
+            }
+        }
+
+        /**
+         * @brief run one connection: read its token, then move the transfer's bytes
+         */
+        void serve(int fd)
+        {
+            uint64_t token = 0;
+            if (recv(fd, &token, sizeof(token), MSG_WAITALL) != sizeof(token))
+            {
+                finish(fd, -1);
+                return;
+            }
+
+            std::shared_ptr<transfer> t;
+            bool uploading = false;
+            int peer = -1;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                auto it = tokens_.find(token);
+                if (it == tokens_.end())
+                {
+                    LOG_WARN("Bulk transfer connection with unknown token\n");
+                }
+                else
+                {
+                    t = it->second;
+                    uploading = token == t->upload_token_;
+                    // each token is good for one connection
+                    tokens_.erase(it);
+                    if (t->kind_ == BLOB_RELAY && t->parked_fd_ < 0)
+                    {
+                        // first side of a relay, wait for the other one to connect
+                        t->parked_fd_ = fd;
+                        return;
+                    }
+                    if (t->kind_ == BLOB_RELAY)
+                    {
+                        peer = t->parked_fd_;
+                        t->parked_fd_ = -1;
+                    }
+                    transfers_.erase(t->id_);
+                }
+            }
+            if (!t)
+            {
+                finish(fd, -1);
+                return;
+            }
+
+            started_.add();
+            active_.add();
+            auto begin = std::chrono::steady_clock::now();
+            uint64_t length = t->size_ - t->offset_;
+            uint64_t moved = 0;
+            switch (t->kind_)
+            {
+            case BLOB_RELAY:
+            {
+                int from = uploading ? fd : peer;
+                int to = uploading ? peer : fd;
+                moved = splice_all(from, to, nullptr, length);
+                break;
+            }
+            case BLOB_STORE:
+            {
+                int file = open(path(t->name_).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+                if (file >= 0)
+                {
+                    loff_t offset = static_cast<loff_t>(t->offset_);
+                    moved = splice_all(fd, file, &offset, length);
+                    close(file);
+                }
+                break;
+            }
+            case BLOB_FETCH:
+            {
+                int file = open(path(t->name_).c_str(), O_RDONLY | O_CLOEXEC);
+                if (file >= 0)
+                {
+                    moved = sendfile_all(fd, file, t->offset_, length);
+                    close(file);
+                }
+                break;
+            }
+            }
+            active_.sub();
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            bytes_.add(moved);
+            if (moved == length)
+            {
+                completed_.add();
+            }
+            uint64_t kib_per_second = seconds > 0 ? static_cast<uint64_t>(moved / 1024.0 / seconds) : 0;
+            throughput_.record(kib_per_second);
+            LOG_INFO("Transfer %u of %s: %llu of %llu bytes from offset %llu in %.3fs, %llu KiB/s\n",
+                     t->id_, t->name_, static_cast<unsigned long long>(moved), static_cast<unsigned long long>(length),
+                     static_cast<unsigned long long>(t->offset_), seconds, static_cast<unsigned long long>(kib_per_second));
+            finish(fd, peer);
+        }
+
+        void finish(int fd, int peer)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            for (int f : {fd, peer})
+            {
+                if (f >= 0)
+                {
+                    close(f);
+                    forget_fd(f);
+                }
+            }
+        }
+
+        int listen_fd_ = -1;
+        std::atomic<bool> stopping_{false};
+        std::thread acceptor_;
+
+        std::mutex mutex_;
+        std::vector<std::thread> connections_;
+        std::vector<int> open_fds_;
+        std::map<uint32_t, std::shared_ptr<transfer>> transfers_;
+        std::map<uint64_t, std::shared_ptr<transfer>> tokens_;
+        uint32_t next_id_ = 1;
+
+        counter started_;
+        counter completed_;
+        counter bytes_;
+        counter active_;
+        histogram throughput_;
+        std::mt19937_64 random_;
+    };
+
+    /**
+     * @brief connect to the server's bulk transfer port and present a token from ACCEPT
+     * @return connected descriptor, or -1
+     */
+    inline int blob_connect(const sockaddr_in &server_address, uint64_t token)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        sockaddr_in address = server_address;
+        address.sin_port = htons(BLOB_PORT);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0 ||
+            send(fd, &token, sizeof(token), MSG_NOSIGNAL) != sizeof(token))
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /**
+     * @brief upload a file from offset over a transfer connection with sendfile
+     * @return bytes sent
+     */
+    inline uint64_t blob_upload(int fd, const char *file_path, uint64_t offset)
+    {
+        int file = open(file_path, O_RDONLY | O_CLOEXEC);
+        if (file < 0)
+        {
+            return 0;
+        }
+        struct stat st;
+        uint64_t sent = 0;
+        if (fstat(file, &st) == 0 && static_cast<uint64_t>(st.st_size) > offset)
+        {
+            sent = sendfile_all(fd, file, offset, static_cast<uint64_t>(st.st_size) - offset);
+        }
+        close(file);
+        shutdown(fd, SHUT_WR);
+        return sent;
+    }
+
+    /**
+     * @brief download into a file at offset until the transfer connection closes
+     * @return bytes received
+     */
+    inline uint64_t blob_download(int fd, const char *file_path, uint64_t offset)
+    {
+        int file = open(file_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (file < 0)
+        {
+            return 0;
+        }
+        loff_t pos = static_cast<loff_t>(offset);
+        uint64_t received = splice_all(fd, file, &pos, UINT64_MAX);
+        close(file);
+        return received;
+    }
+
+}; // namespace chat
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+
+// first byte of a bundle, neither a chat_type nor a fragment
+#define BUNDLE_MARKER 0x7c
+// destination tables of a fanout_bundler, each with its own lock
+#define BUNDLE_SHARDS 16
+// whole messages a segmented bundle holds, what the kernel segments in one send
+#define BUNDLE_SEGMENTS 64
+
+namespace chat
+{
+
+    // largest bundle, never more than one unbundled message so it fits every transport
+    constexpr size_t BUNDLE_MAX = sizeof(chat_message);
+    // largest segmented bundle
+    constexpr size_t BUNDLE_SEGMENTED_MAX = BUNDLE_SEGMENTS * sizeof(chat_message);
+
+    /**
+     * @brief start of a bundle, followed by count messages
+     */
+    struct bundle_header
+    {
+        uint8_t marker_;
+        uint8_t count_;
+    };
+
+    /**
+     * @brief start of a message in a bundle, followed by its fields without their zero padding
+     */
+    struct bundle_entry
+    {
+        uint8_t type_;
+        uint8_t username_length_;
+        uint8_t groupname_length_;
+        uint8_t reserved_;
+        uint16_t message_length_;
+    };
+
+    static_assert(sizeof(bundle_entry) == 6, "bundle_entry must be packed");
+
+    /**
+     * @brief bytes of a zero padded field up to its last non-zero byte
+     */
+    inline size_t unpadded_length(const int8_t *field, size_t size)
+    {
+        while (size > 0 && field[size - 1] == 0)
+        {
+            size--;
+        }
+        return size;
+    }
+
+    /**
+     * @brief bytes msg takes in a bundle
+     */
+    inline size_t bundled_size(const chat_message &msg)
+    {
+        return sizeof(bundle_entry) + unpadded_length(msg.username_, MAX_USERNAME_LENGTH) +
+               unpadded_length(msg.groupname_, MAX_GROUPNAME_LENGTH) + unpadded_length(msg.message_, MAX_MESSAGE_LENGTH);
+    }
+
+    /**
+     * @brief append msg to a bundle at out, which must have room for bundled_size(msg)
+     * @return bytes written
+     */
+    inline size_t write_bundled(char *out, const chat_message &msg)
+    {
+        bundle_entry entry{msg.type_,
+                           static_cast<uint8_t>(unpadded_length(msg.username_, MAX_USERNAME_LENGTH)),
+                           static_cast<uint8_t>(unpadded_length(msg.groupname_, MAX_GROUPNAME_LENGTH)),
+                           0,
+                           static_cast<uint16_t>(unpadded_length(msg.message_, MAX_MESSAGE_LENGTH))};
+        char *p = out;
+        memcpy(p, &entry, sizeof(entry));
+        p += sizeof(entry);
+        memcpy(p, msg.username_, entry.username_length_);
+        p += entry.username_length_;
+        memcpy(p, msg.groupname_, entry.groupname_length_);
+        p += entry.groupname_length_;
+        memcpy(p, msg.message_, entry.message_length_);
+        p += entry.message_length_;
+        return static_cast<size_t>(p - out);
+    }
+
+    /**
+     * @brief true if a received datagram is a bundle
+     */
+    inline bool is_bundle(const char *data, ssize_t length)
+    {
+        return length >= static_cast<ssize_t>(sizeof(bundle_header)) && static_cast<uint8_t>(data[0]) == BUNDLE_MARKER;
+    }
+
+    /**
+     * @brief call f with each message of a bundle, restored to a whole chat_message
+     * @return false if the bundle is malformed, f is then not called for what follows the fault
+     */
+    template <typename F>
+    bool for_each_bundled(const char *data, size_t length, F &&f)
+    {
+        bundle_header header;
+        memcpy(&header, data, sizeof(header));
+        size_t at = sizeof(header);
+        for (unsigned i = 0; i < header.count_; i++)
+        {
+            bundle_entry entry;
+            if (length - at < sizeof(entry))
+            {
+                return false;
+            }
+            memcpy(&entry, data + at, sizeof(entry));
+            at += sizeof(entry);
+            if (entry.username_length_ > MAX_USERNAME_LENGTH || entry.groupname_length_ > MAX_GROUPNAME_LENGTH ||
+                entry.message_length_ > MAX_MESSAGE_LENGTH ||
+                length - at < size_t{entry.username_length_} + entry.groupname_length_ + entry.message_length_)
+            {
+                return false;
+            }
+            chat_message msg{};
+            msg.type_ = entry.type_;
+            memcpy(msg.username_, data + at, entry.username_length_);
+            at += entry.username_length_;
+            memcpy(msg.groupname_, data + at, entry.groupname_length_);
+            at += entry.groupname_length_;
+            memcpy(msg.message_, data + at, entry.message_length_);
+            at += entry.message_length_;
+            f(msg);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Coalesces relayed messages per destination into bundles.
+     *
+     * The first message for a destination opens a bundle, and messages for it in the next
+     * window are appended to it. A flush thread sends bundles once their window has passed,
+     * or one is sent as soon as the next message would not fit. A bundle holding a single
+     * message is sent as that message, so quiet destinations see no change at all.
+     *
+     * A segmented bundler instead keeps the messages whole, one after another, and sends them
+     * with the socket's send_segments, so a socket with UDP GSO makes one system call for
+     * them and the destination still receives them as plain datagrams.
+     *
+     * Everything for a destination is sent under its shard's lock, so a destination gets its
+     * messages in the order they were added. A destination's entry is dropped once its bundle
+     * has been sent, so only destinations with a bundle open are kept.
+     *
+     * @tparam Socket anything with the sendto of uwe::socket, and send_segments if segmented
+     */
+    template <typename Socket>
+    class fanout_bundler
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        /**
+         * @param window how long a bundle collects messages for
+         * @param limit largest bundle, at most BUNDLE_MAX, or BUNDLE_SEGMENTED_MAX if segmented
+         * @param segmented send whole messages with send_segments rather than packing them
+         */
+        fanout_bundler(Socket &sock, std::chrono::microseconds window, size_t limit = BUNDLE_MAX, bool segmented = false)
+            : sock_{sock}, window_{window},
+              limit_{segmented ? std::clamp(limit, sizeof(chat_message), BUNDLE_SEGMENTED_MAX)
+                               : std::clamp(limit, sizeof(bundle_header) + sizeof(bundle_entry) + 1, BUNDLE_MAX)},
+              segmented_{segmented}, datagrams_{"bundle.datagrams"}, messages_{"bundle.messages"}, per_datagram_{"bundle.messages_per_datagram"}
+        {
+            flusher_ = std::thread{[this]()
+                                   { run(); }};
+        }
+
+        ~fanout_bundler()
+        {
+            stop();
+        }
+
+        fanout_bundler(const fanout_bundler &) = delete;
+        fanout_bundler &operator=(const fanout_bundler &) = delete;
+
+        /**
+         * @brief send every open bundle and stop the flush thread
+         */
+        void stop()
+        {
+            if (stopping_.exchange(true))
+            {
+                return;
+            }
+            flusher_.join();
+            flush(clock::time_point::max());
+        }
+
+        /**
+         * @brief queue msg for address
+         */
+        void add(const chat_message &msg, const sockaddr_in &address)
+        {
+            uint64_t key = (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+            shard &s = shards_[key % BUNDLE_SHARDS];
+            size_t size = segmented_ ? sizeof(msg) : bundled_size(msg);
+            // a long message is no smaller bundled and goes on its own, after what is waiting
+            // as is everything once stopped, when nothing would flush it
+            bool alone = (!segmented_ && sizeof(bundle_header) + size > limit_) || stopping_.load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock{s.mutex_};
+            auto found = s.bundles_.find(key);
+            if (found != s.bundles_.end() &&
+                (alone || found->second.data_.size() + size > limit_ || (!segmented_ && found->second.count_ == UINT8_MAX)))
+            {
+                // no room, send what is there and start again
+                send(found->second);
+            }
+            if (alone)
+            {
+                if (found != s.bundles_.end())
+                {
+                    s.bundles_.erase(found);
+                }
+                datagrams_.add();
+                messages_.add();
+                per_datagram_.record(1);
+                sock_.sendto(reinterpret_cast<const char *>(&msg), sizeof(msg), 0, (sockaddr *)&address, sizeof(address));
+                return;
+            }
+            bundle &b = found != s.bundles_.end() ? found->second : s.bundles_[key];
+            if (b.count_ == 0)
+            {
+                b.to_ = address;
+                b.opened_ = clock::now();
+                b.data_.resize(segmented_ ? 0 : sizeof(bundle_header));
+            }
+            size_t at = b.data_.size();
+            b.data_.resize(at + size);
+            if (segmented_)
+            {
+                memcpy(b.data_.data() + at, &msg, size);
+            }
+            else
+            {
+                write_bundled(b.data_.data() + at, msg);
+            }
+            b.count_++;
+        }
+
+    private:
+        struct bundle
+        {
+            sockaddr_in to_;
+            clock::time_point opened_;
+            unsigned count_ = 0;
+            std::vector<char> data_;
+        };
+
+        struct shard
+        {
+            std::mutex mutex_;
+            std::unordered_map<uint64_t, bundle> bundles_;
+        };
+
+        /**
+         * @brief send a bundle and empty it, its shard's lock held
+         */
+        void send(bundle &b)
+        {
+            datagrams_.add();
+            messages_.add(b.count_);
+            per_datagram_.record(b.count_);
+            if (segmented_)
+            {
+                sock_.send_segments(b.data_.data(), sizeof(chat_message), b.count_, 0, (sockaddr *)&b.to_, sizeof(b.to_));
+            }
+            else
+            {
+                bundle_header header{BUNDLE_MARKER, static_cast<uint8_t>(b.count_)};
+                memcpy(b.data_.data(), &header, sizeof(header));
+                if (b.count_ == 1)
+                {
+                    for_each_bundled(b.data_.data(), b.data_.size(), [&](const chat_message &msg)
+                                     { sock_.sendto(reinterpret_cast<const char *>(&msg), sizeof(msg), 0, (sockaddr *)&b.to_, sizeof(b.to_)); });
+                }
+                else
+                {
+                    sock_.sendto(b.data_.data(), b.data_.size(), 0, (sockaddr *)&b.to_, sizeof(b.to_));
+                }
+            }
+            b.data_.clear();
+            b.count_ = 0;
+        }
+
+        /**
+         * @brief send bundles opened at or before cutoff and forget their destinations
+         */
+        void flush(clock::time_point cutoff)
+        {
+            for (shard &s : shards_)
+            {
+                std::lock_guard<std::mutex> lock{s.mutex_};
+                for (auto it = s.bundles_.begin(); it != s.bundles_.end();)
+                {
+                    if (it->second.count_ > 0 && it->second.opened_ > cutoff)
+                    {
+                        ++it;
+                        continue;
+                    }
+                    if (it->second.count_ > 0)
+                    {
+                        send(it->second);
+                    }
+                    it = s.bundles_.erase(it);
+                }
+            }
+        }
+
+        void run()
+        {
+            // a bundle waits between one and one and a half windows
+            auto tick = std::max(window_ / 2, std::chrono::microseconds{1});
+            while (!stopping_.load())
+            {
+                std::this_thread::sleep_for(tick);
+                flush(clock::now() - window_);
+            }
+        }
+
+        Socket &sock_;
+        std::chrono::microseconds window_;
+        size_t limit_;
+        bool segmented_;
+        shard shards_[BUNDLE_SHARDS];
+        std::atomic<bool> stopping_{false};
+        std::thread flusher_;
+
+        counter datagrams_;
+        counter messages_;
+        histogram per_datagram_;
+    };
+
+}; // namespace chat
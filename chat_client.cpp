@@ -2,16 +2,31 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <cstdlib>
 
 #include <atomic>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
 
 // IOT socket api
 #include <iot/socket.hpp>
 // #include <chat.hpp>
 #include "chat_new.hpp"
+#include "chat_trace.hpp"
+#include "chat_dedup.hpp"
+#include "chat_fragment.hpp"
+#include "chat_blob.hpp"
+#include "chat_transport.hpp"
+#include "chat_reliable.hpp"
+#include "chat_bundle.hpp"
+#include "chat_multicast.hpp"
+#include "chat_federation.hpp"
 #include <gui.hpp>
 #include <colors.hpp>
 #include <util.hpp>
@@ -21,11 +36,197 @@
 
 // CHAT_CLIENT
 
+/**
+ * @brief connection to the server, over UDP or the stream selected by CHAT_TRANSPORT
+ */
+typedef chat::client_transport<chat::reliable_link<uwe::socket>> chat_socket;
+
 namespace
 {
     std::atomic<bool> sent_leave{false};
+
+    // set CHAT_TRACE to trace chat messages sent by this client
+    const bool tracing = getenv("CHAT_TRACE") != nullptr;
+    // ids of traces started by this client, the client port is added in the top bits
+    std::atomic<uint64_t> next_trace_id{0};
+    // latency of traced messages relayed to this client
+    chat::trace_hops *trace_stats = nullptr;
+    // ids of messages this client sends in fragments
+    uint32_t next_message_id = 0;
+    // ids of chat messages sent, starting at random so a restarted client is not taken for a retry
+    std::atomic<uint64_t> next_datagram_id{static_cast<uint64_t>(std::random_device{}()) << 32};
+    // local files offered by this client, by blob name, until the offer is accepted
+    std::map<std::string, std::string> offered_files;
+    // blob names of offers received, by transfer id
+    std::map<std::string, std::string> received_offers;
+    // users shown per page by list:<prefix>
+    const size_t list_page_size = 20;
+    // prefix of the last page of users asked for, and where the next page of it starts
+    std::string list_prefix;
+    std::string list_cursor;
+    // set once the multicast receiver should stop
+    std::atomic<bool> multicast_done{false};
+    // group whose channel this client has joined, and the channel
+    std::string multicast_group;
+    sockaddr_in multicast_group_channel{};
 };
 
+/**
+ * @brief file the resumption token of username is kept in between runs
+ */
+std::string resume_file(const std::string &username)
+{
+    const char *home = getenv("HOME");
+    return std::string{home != nullptr ? home : "."} + "/.chat_resume_" + username;
+}
+
+/**
+ * @brief resumption token an earlier run of username was given, empty if none
+ */
+std::string load_resume_token(const std::string &username)
+{
+    std::ifstream in{resume_file(username)};
+    std::string token;
+    std::getline(in, token);
+    return token;
+}
+
+/**
+ * @brief keep the token from the latest JACK for the next run, readable by this user only
+ */
+void save_resume_token(const std::string &username, const std::string &token)
+{
+    int fd = open(resume_file(username).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return;
+    }
+    ssize_t written = write(fd, token.data(), token.size());
+    (void)written;
+    close(fd);
+}
+
+/**
+ * @brief message received from the server, with the whole text if it arrived in fragments
+ */
+struct received_message : chat::chat_message
+{
+    std::string long_text_;
+
+    /**
+     * @brief text of the message, however it was received
+     */
+    const char *text() const
+    {
+        return long_text_.empty() ? (const char *)message_ : long_text_.c_str();
+    }
+};
+
+/**
+ * @brief send a chat message to the server, with a trace extension if tracing is on
+ *
+ * Each message carries an id the server uses to drop it should it arrive twice.
+ *
+ * @param sock socket for communicating with the server
+ * @param msg message to send
+ * @param server_address address of the server
+ */
+void send_chat(chat_socket &sock, const chat::chat_message &msg, const sockaddr_in &server_address)
+{
+    char buffer[chat::MAX_CHAT_DATAGRAM];
+    size_t length = sizeof(chat::chat_message);
+    if (!tracing)
+    {
+        memcpy(buffer, &msg, sizeof(msg));
+    }
+    else
+    {
+        chat::traced_message traced;
+        traced.message_ = msg;
+        chat::set_trace(traced, chat::begin_trace(next_trace_id.fetch_add(1)));
+        memcpy(buffer, &traced, sizeof(traced));
+        length = sizeof(traced);
+    }
+    length = chat::put_message_id(buffer, length, next_datagram_id.fetch_add(1));
+    sock.sendto(buffer, length, 0, (sockaddr *)&server_address, sizeof(server_address));
+}
+
+/**
+ * @brief send a chat message whose text may be too long for one packet, fragmenting it if so
+ *
+ * @param sock socket for communicating with the server
+ * @param type message type
+ * @param username stored in the message
+ * @param groupname stored in the message, the recipient for a fragmented DIRECTMESSAGE
+ * @param text message text
+ * @param server_address address of the server
+ */
+void send_text(chat_socket &sock, chat::chat_type type, std::string_view username, std::string_view groupname,
+               std::string_view text, const sockaddr_in &server_address)
+{
+    if (!chat::needs_fragments(text))
+    {
+        chat::chat_message msg;
+        chat::write_message(chat::as_span(msg), type, username, type == chat::DIRECTMESSAGE ? std::string_view{} : groupname, text);
+        send_chat(sock, msg, server_address);
+        return;
+    }
+    chat::write_fragments(type, username, groupname, text, next_message_id++, [&](const chat::chat_message &fragment)
+                          { send_chat(sock, fragment, server_address); });
+}
+
+/**
+ * @brief size of a local file, the offset to resume a download of it from
+ */
+uint64_t local_size(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+/**
+ * @brief start our side of a transfer the server has accepted, on its own thread
+ *
+ * @param accept ACCEPT from the server, the blob name in groupname and "id:token:offset:size" in message
+ * @param server_address address of the server, the transfer connects to BLOB_PORT on the same host
+ */
+void start_transfer(const chat::chat_message &accept, const sockaddr_in &server_address)
+{
+    std::string name{(const char *)accept.groupname_};
+    auto fields = split(std::string{(const char *)accept.message_}, ':');
+    uint64_t token;
+    uint64_t offset;
+    if (fields.size() != 4 || !chat::parse_number(fields[1], token) || !chat::parse_number(fields[2], offset))
+    {
+        DEBUG("Invalid accept '%s'\n", (const char *)accept.message_);
+        return;
+    }
+
+    // we upload blobs we offered and download everything else
+    auto file = offered_files.find(name);
+    bool upload = file != offered_files.end();
+    std::string path = upload ? file->second : name;
+    if (upload)
+    {
+        offered_files.erase(file);
+    }
+    std::thread{[server_address, token, offset, upload, path]()
+                {
+                    int fd = chat::blob_connect(server_address, token);
+                    if (fd < 0)
+                    {
+                        DEBUG("Could not connect for transfer of %s\n", path.c_str());
+                        return;
+                    }
+                    uint64_t moved = upload ? chat::blob_upload(fd, path.c_str(), offset)
+                                            : chat::blob_download(fd, path.c_str(), offset);
+                    close(fd);
+                    DEBUG("Transfer of %s done, %llu bytes from offset %llu\n", path.c_str(),
+                          static_cast<unsigned long long>(moved), static_cast<unsigned long long>(offset));
+                }}
+        .detach();
+}
+
 //---------------------------------------------------------------------------------------
 
 /**
@@ -42,7 +243,7 @@ chat::chat_type to_type(std::string cmd)
     // case string_to_int("join"): return chat::JOIN;
     // case string_to_int("bc"): return chat::BROADCAST;
     // case string_to_int("dm"): return chat::DIRECTMESSAGE;
-    case string_to_int("list"):
+    case string_to_int("list"): // list, or list:<prefix> for the next page of users starting with prefix
         return chat::LIST;
     case string_to_int("leave"):
         return chat::LEAVE;
@@ -52,6 +253,18 @@ chat::chat_type to_type(std::string cmd)
         return chat::CREATE_GROUP;
     case string_to_int("addtogroup"): // to add a user to a group
         return chat::ADD_TO_GROUP;
+    case string_to_int("subscribe"): // subscribe:<topic filter>
+        return chat::SUBSCRIBE;
+    case string_to_int("unsubscribe"): // unsubscribe:<topic filter>
+        return chat::UNSUBSCRIBE;
+    case string_to_int("publish"): // publish:<topic>:<message>
+        return chat::PUBLISH;
+    case string_to_int("offer"): // offer:<username>:<file>
+    case string_to_int("store"): // store:<file>, offered to the server's store
+        return chat::OFFER;
+    case string_to_int("accept"): // accept:<transfer id>
+    case string_to_int("fetch"):  // fetch:<stored blob name>
+        return chat::ACCEPT;
     default:
         return chat::UNKNOWN;
     }
@@ -61,28 +274,68 @@ chat::chat_type to_type(std::string cmd)
 
 //----------------------------------------------------------------------------------------
 
-std::pair<std::thread, Channel<chat::chat_message>> make_receiver(uwe::socket *sock)
+std::pair<std::thread, Channel<received_message>> make_receiver(chat_socket *sock)
 {
-    auto [tx, rx] = make_channel<chat::chat_message>();
+    auto [tx, rx] = make_channel<received_message>();
 
-    std::thread receiver_thread{[](Channel<chat::chat_message> tx, uwe::socket *sock)
+    std::thread receiver_thread{[](Channel<received_message> tx, chat_socket *sock)
                                 {
+                                    // large messages arrive in fragments and are put back together here
+                                    chat::reassembler fragments;
+                                    // pass a message on to the UI thread, false once nothing more will arrive
+                                    auto deliver = [&tx, &fragments](const chat::chat_message &msg)
+                                    {
+                                        if (chat::is_fragment(msg))
+                                        {
+                                            fragments.add(msg, [&tx](const chat::chat_message &first, std::string_view text)
+                                                          {
+                                                              received_message whole{first, std::string{text}};
+                                                              if (whole.type_ == chat::DIRECTMESSAGE)
+                                                              {
+                                                                  // the recipient was carried in the group name
+                                                                  whole.groupname_[0] = '\0';
+                                                              }
+                                                              tx.send(whole); });
+                                            return true;
+                                        }
+                                        tx.send(received_message{msg, {}});
+                                        return !(msg.type_ == chat::EXIT || (msg.type_ == chat::LACK && sent_leave));
+                                    };
                                     try
                                     {
                                         for (;;)
                                         {
-                                            chat::chat_message msg;
+                                            chat::traced_message packet;
+                                            chat::chat_message &msg = packet.message_;
                                             //////////////////////////////////////// IMPLEMENTATION ////////////////////////////////////////////////////
                                             // you need to fill in
                                             // receive message from server
                                             // send it over channel (tx) to main UI thread
-                                            ssize_t recv_len = sock->recvfrom(reinterpret_cast<char *>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
-                                            if (recv_len > 0)
+                                            ssize_t recv_len = sock->recvfrom(reinterpret_cast<char *>(&packet), sizeof(chat::traced_message), 0, nullptr, nullptr);
+                                            if (recv_len < 0 && sock->closed())
                                             {
-                                                tx.send(msg);
+                                                // the server went away, nothing more will arrive
+                                                break;
+                                            }
+                                            if (trace_stats != nullptr && chat::has_trace(packet, recv_len))
+                                            {
+                                                trace_stats->record(chat::get_trace(packet), chat::trace_clock());
+                                            }
+                                            if (chat::is_bundle(reinterpret_cast<const char *>(&packet), recv_len))
+                                            {
+                                                // several messages the server coalesced, in the order it sent them
+                                                bool more = true;
+                                                chat::for_each_bundled(reinterpret_cast<const char *>(&packet), static_cast<size_t>(recv_len),
+                                                                       [&](const chat::chat_message &bundled)
+                                                                       { more = more && deliver(bundled); });
+                                                if (!more)
+                                                {
+                                                    break;
+                                                }
+                                                continue;
                                             }
                                             // exit receiver thread
-                                            if (msg.type_ == chat::EXIT || (msg.type_ == chat::LACK && sent_leave))
+                                            if (recv_len > 0 && !deliver(msg))
                                             {
                                                 break;
                                             }
@@ -98,6 +351,51 @@ std::pair<std::thread, Channel<chat::chat_message>> make_receiver(uwe::socket *s
     return {std::move(receiver_thread), std::move(rx)};
 }
 
+/**
+ * @brief start a thread receiving the multicast channels joined on multicast, until multicast_done
+ */
+std::pair<std::thread, Channel<received_message>> make_multicast_receiver(chat::multicast_receiver *multicast)
+{
+    auto [tx, rx] = make_channel<received_message>();
+
+    std::thread receiver_thread{[](Channel<received_message> tx, chat::multicast_receiver *multicast)
+                                {
+                                    while (!multicast_done.load())
+                                    {
+                                        chat::chat_message msg;
+                                        ssize_t recv_len = multicast->receive(reinterpret_cast<char *>(&msg), sizeof(msg), 200);
+                                        if (recv_len < 0)
+                                        {
+                                            break;
+                                        }
+                                        if (recv_len == static_cast<ssize_t>(sizeof(msg)))
+                                        {
+                                            tx.send(received_message{msg, {}});
+                                        }
+                                    }
+                                },
+                                std::move(tx), multicast};
+
+    return {std::move(receiver_thread), std::move(rx)};
+}
+
+/**
+ * @brief should a message from a multicast channel be shown
+ *
+ * Channels carry the sender's own broadcasts, which unicast never did, and group channels
+ * may be shared with other groups.
+ */
+bool multicast_wanted(const received_message &msg, const std::string &username)
+{
+    if (msg.type_ == chat::BROADCAST)
+    {
+        // the sender may be decorated with its group, "name[group]"
+        std::string_view sender{(const char *)msg.username_};
+        return sender.substr(0, sender.find('[')) != username;
+    }
+    return msg.type_ == chat::GROUP_MESSAGE && multicast_group == (const char *)msg.groupname_;
+}
+
 int main(int argc, char **argv)
 {
     if (argc != 4)
@@ -113,7 +411,9 @@ int main(int argc, char **argv)
     // const char *server_name = "192.168.1.8";
     const char *server_name = "127.0.0.1";
 
-    const int server_port = SERVER_PORT;
+    // CHAT_PORT asks a server on another port, any node of a federation redirects us to ours
+    const char *port = getenv("CHAT_PORT");
+    const int server_port = port != nullptr && atoi(port) > 0 ? atoi(port) : SERVER_PORT;
 
     sockaddr_in server_address;
     memset(&server_address, 0, sizeof(server_address));
@@ -126,7 +426,11 @@ int main(int argc, char **argv)
     server_address.sin_port = htons(server_port);
 
     // open socket
-    uwe::socket sock{AF_INET, SOCK_DGRAM, 0};
+    uwe::socket udp{AF_INET, SOCK_DGRAM, 0};
+    // set CHAT_RELIABLE to have messages over UDP acked and retransmitted
+    chat::reliable_link<uwe::socket> link{udp};
+    link.start(getenv("CHAT_RELIABLE") != nullptr);
+    chat_socket sock{link};
 
     // port for client
     const int client_port = std::atoi(argv[2]);
@@ -138,9 +442,26 @@ int main(int argc, char **argv)
     client_address.sin_port = htons(client_port);
     inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &client_address.sin_addr);
 
-    sock.bind((struct sockaddr *)&client_address, sizeof(client_address));
+    udp.bind((struct sockaddr *)&client_address, sizeof(client_address));
 
-    chat::chat_message msg = chat::join_msg(username);
+    // CHAT_TRANSPORT=tcp, unix or shm talks to the server over a stream or shared memory instead
+    if (!sock.connect(chat::transport_from_env(), server_address))
+    {
+        printf("Could not connect to the server over CHAT_TRANSPORT\n");
+        exit(0);
+    }
+
+    std::unique_ptr<chat::trace_hops> hops;
+    if (tracing)
+    {
+        hops = std::make_unique<chat::trace_hops>();
+        trace_stats = hops.get();
+        next_trace_id = static_cast<uint64_t>(client_port) << 32;
+    }
+
+    // a token kept by an earlier run resumes its session without joining again
+    std::string token = load_resume_token(username);
+    chat::chat_message msg = token.empty() ? chat::join_msg(username) : chat::resume_msg(username, token);
 
     // send data
     int len = sock.sendto(
@@ -151,14 +472,54 @@ int main(int argc, char **argv)
     // wait for JACK
     sock.recvfrom(reinterpret_cast<char *>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
 
+    // another node of the federation owns our username, all our messages go to it instead
+    if (msg.type_ == chat::REDIRECT && chat::parse_node((const char *)msg.message_, server_address))
+    {
+        msg = token.empty() ? chat::join_msg(username) : chat::resume_msg(username, token);
+        sock.sendto(
+            reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
+            (sockaddr *)&server_address, sizeof(server_address));
+        DEBUG("Redirected to port %d, join message sent again\n", ntohs(server_address.sin_port));
+        sock.recvfrom(reinterpret_cast<char *>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
+    }
+
+    // the session has gone, join afresh
+    if (!token.empty() && msg.type_ == chat::ERROR)
+    {
+        msg = chat::join_msg(username);
+        sock.sendto(
+            reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
+            (sockaddr *)&server_address, sizeof(server_address));
+        DEBUG("Resume refused, join message sent\n");
+        sock.recvfrom(reinterpret_cast<char *>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
+    }
+
+    // the server only lets us join once we echo the cookie it sends back
+    if (msg.type_ == chat::COOKIE)
+    {
+        std::string cookie{(const char *)msg.message_};
+        msg = chat::join_msg(username, cookie);
+        sock.sendto(
+            reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
+            (sockaddr *)&server_address, sizeof(server_address));
+        DEBUG("Cookie received, join message sent again\n");
+        sock.recvfrom(reinterpret_cast<char *>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
+    }
+
     if (msg.type_ == chat::JACK)
     {
         DEBUG("Received jack\n");
+        save_resume_token(username, (const char *)msg.message_);
 
         // create GUI thread and communication channels
         auto [gui_thread, gui_tx, gui_rx] = chat::make_gui();
         auto [rec_thread, rec_rx] = make_receiver(&sock);
 
+        // channels the server offers are joined here, CHAT_NO_MULTICAST keeps everything unicast
+        chat::multicast_receiver multicast;
+        bool multicasting = getenv("CHAT_NO_MULTICAST") == nullptr && multicast.open(client_address.sin_addr);
+        auto [multicast_thread, multicast_rx] = make_multicast_receiver(&multicast);
+
         // going to need recv thread for messages from server
 
         bool exit_loop = false;
@@ -225,6 +586,71 @@ int main(int argc, char **argv)
                             }
                             break;
                         }
+                        case chat::SUBSCRIBE:
+                        case chat::UNSUBSCRIBE:
+                        {
+                            chat::chat_message topic_msg = type == chat::SUBSCRIBE ? chat::subscribe_msg(username, cmds[1])
+                                                                                   : chat::unsubscribe_msg(username, cmds[1]);
+                            sock.sendto(reinterpret_cast<const char *>(&topic_msg), sizeof(chat::chat_message), 0, (sockaddr *)&server_address, sizeof(server_address));
+                            DEBUG("Topic filter '%s' sent\n", cmds[1].c_str());
+                            break;
+                        }
+                        case chat::PUBLISH:
+                        {
+                            if (cmds.size() > 2)
+                            {
+                                // the message itself may contain ':'
+                                std::string content = cmds[2];
+                                for (size_t i = 3; i < cmds.size(); ++i)
+                                {
+                                    content += ":" + cmds[i];
+                                }
+                                send_text(sock, chat::PUBLISH, username, cmds[1], content, server_address);
+                                DEBUG("Published to '%s'\n", cmds[1].c_str());
+                            }
+                            else
+                            {
+                                DEBUG("Invalid publish command format\n");
+                            }
+                            break;
+                        }
+                        case chat::OFFER:
+                        {
+                            // the blob is named after the file, without its directory
+                            bool store = cmds[0] == "store";
+                            std::string path = store ? cmds[1] : (cmds.size() > 2 ? cmds[2] : std::string{});
+                            std::string name = path.substr(path.find_last_of('/') + 1);
+                            if (!chat::is_valid_blob_name(name) || access(path.c_str(), R_OK) != 0)
+                            {
+                                DEBUG("Invalid offer command format\n");
+                                break;
+                            }
+                            offered_files[name] = path;
+                            std::string offer = name + ":" + std::to_string(local_size(path));
+                            send_chat(sock, chat::offer_msg(username, store ? std::string{} : cmds[1], offer), server_address);
+                            DEBUG("Offered '%s'\n", name.c_str());
+                            break;
+                        }
+                        case chat::ACCEPT:
+                        {
+                            if (cmds[0] == "fetch")
+                            {
+                                // resume from whatever part of the blob we already have
+                                std::string offset = std::to_string(local_size(cmds[1]));
+                                send_chat(sock, chat::accept_msg(username, cmds[1], offset), server_address);
+                                break;
+                            }
+                            auto offer = received_offers.find(cmds[1]);
+                            if (offer == received_offers.end())
+                            {
+                                DEBUG("No offer %s\n", cmds[1].c_str());
+                                break;
+                            }
+                            std::string accept = offer->first + ":" + std::to_string(local_size(offer->second));
+                            send_chat(sock, chat::accept_msg(username, {}, accept), server_address);
+                            received_offers.erase(offer);
+                            break;
+                        }
                         case chat::EXIT:
                         {
                             DEBUG("Received Exit from GUI\n");
@@ -248,6 +674,16 @@ int main(int argc, char **argv)
                             DEBUG("Received LIST from GUI\n");
                             // you need to fill in
                             chat::chat_message list_msg = chat::list_msg();
+                            if (!cmds[1].empty())
+                            {
+                                // asking again for the same prefix continues where the last page ended
+                                if (cmds[1] != list_prefix)
+                                {
+                                    list_prefix = cmds[1];
+                                    list_cursor.clear();
+                                }
+                                list_msg = chat::list_page_msg(list_page_size, list_cursor, list_prefix);
+                            }
                             sock.sendto(reinterpret_cast<const char *>(&list_msg), sizeof(chat::chat_message), 0, (sockaddr *)&server_address, sizeof(server_address));
                             break;
                         }
@@ -267,9 +703,9 @@ int main(int argc, char **argv)
                         {
                             std::string recipient = cmds[0];
                             std::string content = cmds[1];
-                            std::string dm_message = recipient + ":" + content;
-                            chat::chat_message dm_msg = chat::dm_msg(username, dm_message);
-                            sock.sendto(reinterpret_cast<const char *>(&dm_msg), sizeof(chat::chat_message), 0, (sockaddr *)&server_address, sizeof(server_address));
+                            // long DMs are fragmented with the recipient in the group name
+                            std::string dm_message = chat::needs_fragments(recipient + ":" + content) ? content : recipient + ":" + content;
+                            send_text(sock, chat::DIRECTMESSAGE, username, recipient, dm_message, server_address);
                             DEBUG("DM sent to %s\n", recipient.c_str());
                         }
                         else if (cmds.size() >= 3 && cmds[0] == "groupmsg")
@@ -283,33 +719,29 @@ int main(int argc, char **argv)
                                 message_content += " " + cmds[i];
                             }
                             // Construct and send the group message
-                            chat::chat_message group_msg = chat::group_message(group_name, username, message_content);
-                            sock.sendto(reinterpret_cast<const char *>(&group_msg), sizeof(chat::chat_message), 0, (sockaddr *)&server_address, sizeof(server_address));
+                            send_text(sock, chat::GROUP_MESSAGE, username, group_name, message_content, server_address);
                             DEBUG("Group message sent to '%s'\n", group_name.c_str());
                         }
-                        else
+                        else if (type == chat::UNKNOWN)
                         {
-                            chat::chat_message bc_msg = chat::broadcast_msg(username, cmds[0]);
-                            sock.sendto(reinterpret_cast<const char *>(&bc_msg), sizeof(chat::chat_message), 0, (sockaddr *)&server_address, sizeof(server_address));
+                            send_text(sock, chat::BROADCAST, username, {}, cmds[0], server_address);
                             DEBUG("Broadcast message sent\n");
                         }
                     }
                     else
                     {
                         // message to broadcast to everyone online
-                        chat::chat_message msg = chat::broadcast_msg(username, *result);
                         // send data
-                        int len = sock.sendto(
-                            reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
-                            (sockaddr *)&server_address, sizeof(server_address));
+                        send_text(sock, chat::BROADCAST, username, {}, *result, server_address);
                     }
                 }
             }
-            // check to see if any messages received from the server
-            if (!rec_rx.empty() && !exit_loop)
+            // check to see if any messages received from the server, or copies the network made of them
+            if ((!rec_rx.empty() || !multicast_rx.empty()) && !exit_loop)
             {
-                auto result = rec_rx.recv();
-                if (result)
+                bool replicated = rec_rx.empty();
+                auto result = replicated ? multicast_rx.recv() : rec_rx.recv();
+                if (result && (!replicated || multicast_wanted(*result, username)))
                 {
                     switch ((*result).type_)
                     {
@@ -339,7 +771,7 @@ int main(int argc, char **argv)
                     {
                         std::string msg{(char *)(*result).username_};
                         msg.append(": ");
-                        msg.append((char *)(*result).message_);
+                        msg.append((*result).text());
                         chat::display_command cmd{chat::GUI_CONSOLE, msg};
                         gui_tx.send(cmd);
                         break;
@@ -349,7 +781,7 @@ int main(int argc, char **argv)
                         std::string msg{"dm("};
                         msg.append((char *)(*result).username_);
                         msg.append("): ");
-                        msg.append((char *)(*result).message_);
+                        msg.append((*result).text());
                         chat::display_command cmd{chat::GUI_CONSOLE, msg};
                         gui_tx.send(cmd);
                         break;
@@ -362,15 +794,63 @@ int main(int argc, char **argv)
                         msg += ") ";
                         msg += std::string((char *)(*result).username_); // Append username of the sender
                         msg += ": ";
-                        msg += std::string((char *)(*result).message_); // Append the message content
+                        msg += std::string((*result).text()); // Append the message content
+
+                        chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                        gui_tx.send(cmd);
+                        break;
+                    }
+
+                    case chat::PUBLISH:
+                    {
+                        std::string msg = "topic(";
+                        msg += std::string((char *)(*result).groupname_);
+                        msg += ") ";
+                        msg += std::string((char *)(*result).username_);
+                        msg += ": ";
+                        msg += std::string((*result).text());
 
                         chat::display_command cmd{chat::GUI_CONSOLE, msg};
                         gui_tx.send(cmd);
                         break;
                     }
 
+                    case chat::OFFER:
+                    {
+                        // "id:name:size", accepted with accept:<id>
+                        auto fields = split(std::string{(char *)(*result).message_}, ':');
+                        if (fields.size() == 3 && chat::is_valid_blob_name(fields[1]))
+                        {
+                            received_offers[fields[0]] = fields[1];
+                            std::string msg = "offer(" + fields[0] + ") ";
+                            msg += std::string((char *)(*result).username_);
+                            msg += ": " + fields[1] + " (" + fields[2] + " bytes)";
+                            chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                            gui_tx.send(cmd);
+                        }
+                        break;
+                    }
+
+                    case chat::ACCEPT:
+                    {
+                        start_transfer(*result, server_address);
+                        break;
+                    }
+
                     case chat::LIST:
                     {
+                        if ((*result).username_[0] == '\0')
+                        {
+                            // a page, with the cursor of the next in the group name
+                            list_cursor = (const char *)(*result).groupname_;
+                            for (auto u : split(std::string{(*result).text()}, ':'))
+                            {
+                                chat::display_command cmd{chat::GUI_USER_ADD, u};
+                                gui_tx.send(cmd);
+                            }
+                            break;
+                        }
+
                         bool end = false;
                         auto users = split(std::string{(char *)(*result).username_}, ':');
                         for (auto u : users)
@@ -398,6 +878,34 @@ int main(int argc, char **argv)
 
                         break;
                     }
+                    case chat::MULTICAST:
+                    {
+                        // join the channel offered and confirm, the server then stops sending unicast copies
+                        std::string group{(const char *)(*result).groupname_};
+                        sockaddr_in channel;
+                        if (!multicasting || !chat::parse_channel((*result).text(), channel))
+                        {
+                            break;
+                        }
+                        if (!group.empty() && multicast_group_channel.sin_addr.s_addr != 0 &&
+                            multicast_group_channel.sin_addr.s_addr != channel.sin_addr.s_addr)
+                        {
+                            // a user is in one group at a time
+                            multicast.leave(multicast_group_channel);
+                            multicast_group_channel = sockaddr_in{};
+                        }
+                        if (multicast.join(channel))
+                        {
+                            if (!group.empty())
+                            {
+                                multicast_group = group;
+                                multicast_group_channel = channel;
+                            }
+                            chat::chat_message confirm = chat::multicast_msg(username, group);
+                            sock.sendto(reinterpret_cast<const char *>(&confirm), sizeof(confirm), 0, (sockaddr *)&server_address, sizeof(server_address));
+                        }
+                        break;
+                    }
                     case chat::ERROR:
                     {
                         break;
@@ -411,14 +919,28 @@ int main(int argc, char **argv)
         }
 
         DEBUG("Exited loop\n");
+        if (sent_leave)
+        {
+            // the session is over, there is nothing to resume
+            unlink(resume_file(username).c_str());
+        }
         // send message to GUI to exit
         chat::display_command cmd{chat::GUI_EXIT};
         gui_tx.send(cmd);
         gui_thread.join();
         rec_thread.join();
+        multicast_done = true;
+        multicast_thread.join();
 
         // so done...
         DEBUG("Time to rest\n");
+
+        if (tracing)
+        {
+            // per hop latency of everything traced that reached this client
+            chat::counter::dump_counters(stderr);
+            trace_stats = nullptr;
+        }
     }
     else
     {
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+
+// seconds a join cookie is issued for, it is accepted for up to twice this
+#define COOKIE_PERIOD_SECONDS 30
+// characters of a cookie: the period and the MAC in hex
+#define COOKIE_LENGTH 24
+// characters of a resumption token in hex
+#define RESUME_TOKEN_LENGTH 16
+
+namespace chat
+{
+
+    /**
+     * @brief SipHash-2-4 of data under a 128 bit key, a MAC fast enough for every packet
+     */
+    inline uint64_t siphash(const uint64_t (&key)[2], const uint8_t *data, size_t length)
+    {
+        uint64_t v0 = 0x736f6d6570736575ull ^ key[0];
+        uint64_t v1 = 0x646f72616e646f6dull ^ key[1];
+        uint64_t v2 = 0x6c7967656e657261ull ^ key[0];
+        uint64_t v3 = 0x7465646279746573ull ^ key[1];
+
+        auto rotl = [](uint64_t x, int b)
+        { return (x << b) | (x >> (64 - b)); };
+        auto round = [&]()
+        {
+            v0 += v1;
+            v1 = rotl(v1, 13);
+            v1 ^= v0;
+            v0 = rotl(v0, 32);
+            v2 += v3;
+            v3 = rotl(v3, 16);
+            v3 ^= v2;
+            v0 += v3;
+            v3 = rotl(v3, 21);
+            v3 ^= v0;
+            v2 += v1;
+            v1 = rotl(v1, 17);
+            v1 ^= v2;
+            v2 = rotl(v2, 32);
+        };
+
+        size_t whole = length - length % 8;
+        for (size_t i = 0; i < whole; i += 8)
+        {
+            uint64_t m;
+            memcpy(&m, data + i, 8);
+            v3 ^= m;
+            round();
+            round();
+            v0 ^= m;
+        }
+        uint64_t last = static_cast<uint64_t>(length) << 56;
+        for (size_t i = 0; i < length % 8; i++)
+        {
+            last |= static_cast<uint64_t>(data[whole + i]) << (8 * i);
+        }
+        v3 ^= last;
+        round();
+        round();
+        v0 ^= last;
+        v2 ^= 0xff;
+        round();
+        round();
+        round();
+        round();
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    /**
+     * @brief parse lower case hex, at most 16 digits
+     * @return false if text holds anything else
+     */
+    inline bool parse_hex(std::string_view text, uint64_t &value)
+    {
+        value = 0;
+        if (text.empty() || text.size() > 16)
+        {
+            return false;
+        }
+        for (char c : text)
+        {
+            int digit = c >= '0' && c <= '9'   ? c - '0'
+                        : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                               : -1;
+            if (digit < 0)
+            {
+                return false;
+            }
+            value = (value << 4) | static_cast<uint64_t>(digit);
+        }
+        return true;
+    }
+
+    /**
+     * @brief random 128 bit key for siphash
+     */
+    inline void random_key(uint64_t (&key)[2])
+    {
+        std::random_device random;
+        for (uint64_t &k : key)
+        {
+            k = (static_cast<uint64_t>(random()) << 32) | random();
+        }
+    }
+
+    /**
+     * @brief Unguessable 64 bit tokens, siphash of a counter under a random key.
+     *
+     * Unlike a seeded generator, seeing any number of tokens tells nothing about the others.
+     */
+    class token_source
+    {
+    public:
+        token_source()
+        {
+            random_key(key_);
+        }
+
+        uint64_t next()
+        {
+            uint64_t n = next_.fetch_add(1, std::memory_order_relaxed);
+            return siphash(key_, reinterpret_cast<const uint8_t *>(&n), sizeof(n));
+        }
+
+        /**
+         * @brief token as the RESUME_TOKEN_LENGTH hex digits carried in messages
+         */
+        static std::string format(uint64_t token)
+        {
+            char text[RESUME_TOKEN_LENGTH + 1];
+            snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(token));
+            return std::string{text, RESUME_TOKEN_LENGTH};
+        }
+
+    private:
+        uint64_t key_[2];
+        std::atomic<uint64_t> next_{0};
+    };
+
+    /**
+     * @brief Stateless cookies proving a joining client can receive at the address it claims.
+     *
+     * Like a TCP SYN cookie: the server answers a JOIN with a MAC of the client's address, the
+     * username and the current period under a key only it knows, and keeps nothing. Only a
+     * JOIN echoing a cookie from this or the previous period creates a session, so a flood of
+     * JOINs from spoofed addresses costs one MAC and one reply of the same size each.
+     */
+    class join_cookies
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        join_cookies() : issued_{"cookie.issued"}, accepted_{"cookie.accepted"}, rejected_{"cookie.rejected"}
+        {
+            random_key(key_);
+        }
+
+        /**
+         * @brief cookie for a client to echo in its next JOIN
+         */
+        std::string issue(const sockaddr_in &client, std::string_view username, clock::time_point now = clock::now())
+        {
+            issued_.add();
+            uint32_t p = period(now);
+            char text[COOKIE_LENGTH + 1];
+            snprintf(text, sizeof(text), "%08x%016llx", p, static_cast<unsigned long long>(mac(client, username, p)));
+            return std::string{text, COOKIE_LENGTH};
+        }
+
+        /**
+         * @brief is cookie one issued to this client and username in this or the previous period
+         */
+        bool check(const sockaddr_in &client, std::string_view username, std::string_view cookie, clock::time_point now = clock::now())
+        {
+            uint64_t p;
+            uint64_t m;
+            if (cookie.size() != COOKIE_LENGTH || !parse_hex(cookie.substr(0, 8), p) || !parse_hex(cookie.substr(8), m))
+            {
+                rejected_.add();
+                return false;
+            }
+            uint32_t current = period(now);
+            if (p != current && p != static_cast<uint32_t>(current - 1))
+            {
+                rejected_.add();
+                return false;
+            }
+            if (mac(client, username, static_cast<uint32_t>(p)) != m)
+            {
+                rejected_.add();
+                return false;
+            }
+            accepted_.add();
+            return true;
+        }
+
+    private:
+        static uint32_t period(clock::time_point now)
+        {
+            return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count() /
+                                         COOKIE_PERIOD_SECONDS);
+        }
+
+        uint64_t mac(const sockaddr_in &client, std::string_view username, uint32_t p) const
+        {
+            uint8_t data[sizeof(p) + sizeof(client.sin_addr.s_addr) + sizeof(client.sin_port) + MAX_USERNAME_LENGTH];
+            size_t length = std::min(username.size(), static_cast<size_t>(MAX_USERNAME_LENGTH));
+            memcpy(data, &p, sizeof(p));
+            memcpy(data + 4, &client.sin_addr.s_addr, sizeof(client.sin_addr.s_addr));
+            memcpy(data + 8, &client.sin_port, sizeof(client.sin_port));
+            memcpy(data + 10, username.data(), length);
+            return siphash(key_, data, 10 + length);
+        }
+
+        uint64_t key_[2];
+        counter issued_;
+        counter accepted_;
+        counter rejected_;
+    };
+
+}; // namespace chat
@@ -0,0 +1,501 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <vector>
+
+// coroutine frames up to this size are recycled through the frame pool
+#define MAX_POOLED_FRAME 4096
+// frames kept per size class and thread before they are returned to the heap
+#define MAX_POOLED_FRAMES_PER_CLASS 1024
+// how often sends that would block are retried by the event loop
+#define SEND_RETRY_INTERVAL std::chrono::milliseconds(1)
+
+namespace chat
+{
+
+    /**
+     * @brief Free-list allocator for coroutine frames.
+     *
+     * Frames are bucketed into 64 byte size classes. Each thread keeps its own free lists,
+     * so a frame freed on the event loop thread is reused by the next coroutine started there
+     * without touching the global heap.
+     */
+    class frame_pool
+    {
+    public:
+        static void *allocate(size_t size)
+        {
+            size_t cls = size_class(size);
+            if (cls >= CLASSES)
+            {
+                return ::operator new(size);
+            }
+            free_list &list = lists()[cls];
+            if (list.head_ != nullptr)
+            {
+                node *n = list.head_;
+                list.head_ = n->next_;
+                list.count_--;
+                return n;
+            }
+            return ::operator new((cls + 1) * GRANULE);
+        }
+
+        static void deallocate(void *ptr, size_t size)
+        {
+            size_t cls = size_class(size);
+            if (cls >= CLASSES)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+            free_list &list = lists()[cls];
+            if (list.count_ >= MAX_POOLED_FRAMES_PER_CLASS)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+            node *n = static_cast<node *>(ptr);
+            n->next_ = list.head_;
+            list.head_ = n;
+            list.count_++;
+        }
+
+    private:
+        static constexpr size_t GRANULE = 64;
+        static constexpr size_t CLASSES = MAX_POOLED_FRAME / GRANULE;
+
+        struct node
+        {
+            node *next_;
+        };
+
+        struct free_list
+        {
+            node *head_ = nullptr;
+            size_t count_ = 0;
+
+            ~free_list()
+            {
+                while (head_ != nullptr)
+                {
+                    node *n = head_;
+                    head_ = n->next_;
+                    ::operator delete(n);
+                }
+            }
+        };
+
+        static size_t size_class(size_t size)
+        {
+            return (size + GRANULE - 1) / GRANULE - 1;
+        }
+
+        static free_list *lists()
+        {
+            thread_local free_list lists[CLASSES];
+            return lists;
+        }
+    };
+
+    class event_loop;
+
+    /**
+     * @brief Lazily started coroutine returning void.
+     *
+     * A task either runs as a child, via co_await, which resumes the awaiting coroutine when it
+     * completes, or is handed to event_loop::spawn, which runs it detached and frees it when done.
+     */
+    class task
+    {
+    public:
+        struct promise_type
+        {
+            std::coroutine_handle<> continuation_;
+            event_loop *loop_ = nullptr;
+
+            task get_return_object()
+            {
+                return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            struct final_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept;
+
+                void await_resume() noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept { return {}; }
+
+            void return_void() {}
+
+            void unhandled_exception()
+            {
+                // handlers report errors to clients themselves, an escaping exception is a bug
+                std::terminate();
+            }
+
+            static void *operator new(size_t size)
+            {
+                return frame_pool::allocate(size);
+            }
+
+            static void operator delete(void *ptr, size_t size)
+            {
+                frame_pool::deallocate(ptr, size);
+            }
+        };
+
+        task(task &&other) noexcept : handle_{other.handle_}
+        {
+            other.handle_ = nullptr;
+        }
+
+        task &operator=(task &&) = delete;
+        task(const task &) = delete;
+
+        ~task()
+        {
+            if (handle_)
+            {
+                handle_.destroy();
+            }
+        }
+
+        struct awaiter
+        {
+            std::coroutine_handle<promise_type> handle_;
+
+            bool await_ready() noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle_.promise().continuation_ = awaiting;
+                return handle_;
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        /**
+         * @brief run this task as a child of the awaiting coroutine
+         */
+        awaiter operator co_await() &&
+        {
+            return awaiter{handle_};
+        }
+
+    private:
+        friend class event_loop;
+
+        explicit task(std::coroutine_handle<promise_type> h) : handle_{h} {}
+
+        std::coroutine_handle<promise_type> release()
+        {
+            auto h = handle_;
+            handle_ = nullptr;
+            return h;
+        }
+
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    /**
+     * @brief Single threaded scheduler for handler coroutines.
+     *
+     * Coroutines are resumed only on the thread calling run(). spawn() and post() may be
+     * called from any thread. Besides ready coroutines the loop owns a timer queue and a set
+     * of pending I/O operations that are retried until they stop reporting EAGAIN.
+     */
+    class event_loop
+    {
+    public:
+        /**
+         * @brief pending non-blocking operation retried by the loop
+         */
+        struct io_operation
+        {
+            std::coroutine_handle<> handle_;
+
+            /**
+             * @brief try the operation once
+             * @return true if it completed (successfully or with a hard error)
+             */
+            virtual bool attempt() = 0;
+
+        protected:
+            ~io_operation() = default;
+        };
+
+        /**
+         * @brief start a task detached, it runs on the loop thread and is freed when done
+         */
+        void spawn(task t)
+        {
+            auto h = t.release();
+            h.promise().loop_ = this;
+            in_flight_.fetch_add(1, std::memory_order_relaxed);
+            post(h);
+        }
+
+        /**
+         * @brief resume a suspended coroutine on the loop thread
+         */
+        void post(std::coroutine_handle<> h)
+        {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                ready_.push_back(h);
+            }
+            cv_.notify_one();
+        }
+
+        /**
+         * @brief number of spawned tasks that have not yet completed
+         */
+        size_t in_flight() const
+        {
+            return in_flight_.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief awaitable suspending the current coroutine for at least d
+         */
+        auto sleep_for(std::chrono::steady_clock::duration d)
+        {
+            struct sleep_awaiter
+            {
+                event_loop &loop_;
+                std::chrono::steady_clock::time_point deadline_;
+
+                bool await_ready() const noexcept
+                {
+                    return deadline_ <= std::chrono::steady_clock::now();
+                }
+
+                void await_suspend(std::coroutine_handle<> h)
+                {
+                    loop_.timers_.push({deadline_, loop_.timer_seq_++, h});
+                }
+
+                void await_resume() noexcept {}
+            };
+            return sleep_awaiter{*this, std::chrono::steady_clock::now() + d};
+        }
+
+        /**
+         * @brief park an operation until attempt() reports it complete, then resume its coroutine
+         *
+         * Must be called on the loop thread.
+         */
+        void wait_io(io_operation *op)
+        {
+            io_.push_back(op);
+        }
+
+        /**
+         * @brief run coroutines until stop() has been called and no work remains
+         */
+        void run()
+        {
+            std::vector<std::coroutine_handle<>> batch;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock{mutex_};
+                    if (ready_.empty())
+                    {
+                        if (stopping_ && timers_.empty() && io_.empty() && in_flight() == 0)
+                        {
+                            return;
+                        }
+                        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+                        if (!io_.empty())
+                        {
+                            deadline = std::chrono::steady_clock::now() + SEND_RETRY_INTERVAL;
+                        }
+                        if (!timers_.empty() && timers_.top().deadline_ < deadline)
+                        {
+                            deadline = timers_.top().deadline_;
+                        }
+                        cv_.wait_until(lock, deadline, [this]()
+                                       { return !ready_.empty() || stopping_; });
+                    }
+                    batch.assign(ready_.begin(), ready_.end());
+                    ready_.clear();
+                }
+
+                for (auto h : batch)
+                {
+                    h.resume();
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                while (!timers_.empty() && timers_.top().deadline_ <= now)
+                {
+                    auto h = timers_.top().handle_;
+                    timers_.pop();
+                    h.resume();
+                }
+
+                if (!io_.empty())
+                {
+                    std::vector<io_operation *> pending;
+                    pending.swap(io_);
+                    for (auto op : pending)
+                    {
+                        if (op->attempt())
+                        {
+                            op->handle_.resume();
+                        }
+                        else
+                        {
+                            io_.push_back(op);
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * @brief ask run() to return once all outstanding work has completed
+         */
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                stopping_ = true;
+            }
+            cv_.notify_one();
+        }
+
+    private:
+        friend class task;
+
+        struct timer
+        {
+            std::chrono::steady_clock::time_point deadline_;
+            uint64_t seq_;
+            std::coroutine_handle<> handle_;
+
+            bool operator>(const timer &other) const
+            {
+                return deadline_ != other.deadline_ ? deadline_ > other.deadline_ : seq_ > other.seq_;
+            }
+        };
+
+        void completed()
+        {
+            in_flight_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<std::coroutine_handle<>> ready_;
+        bool stopping_ = false;
+        std::atomic<size_t> in_flight_{0};
+
+        // only touched on the loop thread
+        std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers_;
+        uint64_t timer_seq_ = 0;
+        std::vector<io_operation *> io_;
+    };
+
+    inline std::coroutine_handle<> task::promise_type::final_awaiter::await_suspend(std::coroutine_handle<promise_type> h) noexcept
+    {
+        promise_type &p = h.promise();
+        if (p.continuation_)
+        {
+            return p.continuation_;
+        }
+        // detached task spawned on a loop, nobody owns the frame so free it here
+        event_loop *loop = p.loop_;
+        h.destroy();
+        if (loop != nullptr)
+        {
+            loop->completed();
+        }
+        return std::noop_coroutine();
+    }
+
+    /**
+     * @brief awaitable non-blocking sendto, yields to the loop while the socket would block
+     *
+     * @tparam Socket socket type providing sendto(const char *, size_t, int, const sockaddr *, socklen_t)
+     */
+    template <typename Socket>
+    class send_awaitable : public event_loop::io_operation
+    {
+    public:
+        send_awaitable(event_loop &loop, Socket &sock, const void *data, size_t length, const sockaddr_in &address)
+            : loop_{loop}, sock_{sock}, data_{data}, length_{length}, address_{address} {}
+
+        bool await_ready()
+        {
+            return attempt();
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle_ = h;
+            loop_.wait_io(this);
+        }
+
+        /**
+         * @return bytes sent, or -1 on a hard error
+         */
+        ssize_t await_resume() const noexcept
+        {
+            return result_;
+        }
+
+        bool attempt() override
+        {
+            result_ = sock_.sendto(static_cast<const char *>(data_), length_, MSG_DONTWAIT,
+                                   (const sockaddr *)&address_, sizeof(address_));
+            return result_ >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+
+    private:
+        event_loop &loop_;
+        Socket &sock_;
+        const void *data_;
+        size_t length_;
+        sockaddr_in address_;
+        ssize_t result_ = -1;
+    };
+
+    /**
+     * @brief co_await a non-blocking send of a complete message to address
+     *
+     * @param loop loop the awaiting coroutine runs on
+     * @param sock socket to send on
+     * @param msg message to send, must stay alive until the send completes
+     * @param address destination
+     */
+    template <typename Socket, typename Message>
+    send_awaitable<Socket> async_sendto(event_loop &loop, Socket &sock, const Message &msg, const sockaddr_in &address)
+    {
+        return send_awaitable<Socket>{loop, sock, &msg, sizeof(Message), address};
+    }
+
+}; // namespace chat
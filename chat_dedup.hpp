@@ -0,0 +1,242 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+#include "chat_trace.hpp"
+
+// marks a datagram as ending in a message_id_extension
+#define MESSAGE_ID_MAGIC 0x43494431u // "CID1"
+// ids a sender's window remembers, retries of anything older are dropped
+#define DEDUP_WINDOW 64
+// senders whose windows are kept, the least recently heard is forgotten past this
+#define DEDUP_SENDERS 4096
+// bits in each of the two bloom filters remembering messages sent without ids
+#define DEDUP_BLOOM_BITS (1u << 20)
+// bits set per message in a bloom filter
+#define DEDUP_BLOOM_HASHES 4
+// a message without an id is taken for a retry if seen again within one to two of these
+#define DEDUP_BLOOM_PERIOD std::chrono::seconds(2)
+
+namespace chat
+{
+
+    /**
+     * @brief Optional id a sender puts at the very end of a datagram, after any trace.
+     *
+     * Ids increase by one per message sent; a sender retrying a message resends it with the
+     * same id, which the server then recognises and drops.
+     */
+    struct message_id_extension
+    {
+        uint32_t magic_;
+        uint32_t reserved_;
+        uint64_t id_;
+    };
+
+    // largest datagram of the chat protocol: a message with a trace and an id
+    constexpr size_t MAX_CHAT_DATAGRAM = sizeof(traced_message) + sizeof(message_id_extension);
+
+    /**
+     * @brief append an id to a datagram of length bytes in buffer, which must have room
+     * @return new length
+     */
+    inline size_t put_message_id(char *buffer, size_t length, uint64_t id)
+    {
+        message_id_extension extension{MESSAGE_ID_MAGIC, 0, id};
+        memcpy(buffer + length, &extension, sizeof(extension));
+        return length + sizeof(extension);
+    }
+
+    /**
+     * @brief strip the id from the end of a received datagram, if it has one
+     *
+     * @param buffer datagram
+     * @param length its length, reduced by the id's size if one is stripped
+     * @param id set to the id if there is one
+     * @return true if the datagram had an id
+     */
+    inline bool take_message_id(const char *buffer, ssize_t &length, uint64_t &id)
+    {
+        if (length != static_cast<ssize_t>(sizeof(chat_message) + sizeof(message_id_extension)) &&
+            length != static_cast<ssize_t>(MAX_CHAT_DATAGRAM))
+        {
+            return false;
+        }
+        message_id_extension extension;
+        memcpy(&extension, buffer + length - sizeof(extension), sizeof(extension));
+        if (extension.magic_ != MESSAGE_ID_MAGIC)
+        {
+            return false;
+        }
+        id = extension.id_;
+        length -= sizeof(extension);
+        return true;
+    }
+
+    /**
+     * @brief Recognises messages a sender has already sent, so retries can be dropped.
+     *
+     * Messages with ids are checked against a per-sender window, a highest id and a bitmap of
+     * the DEDUP_WINDOW ids below it, as in IPsec anti-replay. An id far below the window is a
+     * sender that restarted its numbering, which starts a new window.
+     *
+     * Messages without ids from senders that have never sent one are looked up by a hash of
+     * sender and contents in a pair of bloom filters, one filling and one from the previous
+     * DEDUP_BLOOM_PERIOD, swapped each period. So a message is forgotten one to two periods
+     * after it was seen, and only an identical message from the same sender within that time,
+     * or a rare false positive, is dropped; dedup.content_drops counts them. A sender with an
+     * id window retries with ids, so anything it sends without one is let through.
+     */
+    class duplicate_filter
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        duplicate_filter()
+            : current_{new uint64_t[DEDUP_BLOOM_BITS / 64]()}, previous_{new uint64_t[DEDUP_BLOOM_BITS / 64]()},
+              id_checked_{"dedup.id_checked"}, id_duplicates_{"dedup.id_duplicates"}, id_resets_{"dedup.id_resets"},
+              content_checked_{"dedup.content_checked"}, content_drops_{"dedup.content_drops"} {}
+
+        /**
+         * @brief check a message with an id
+         * @param sender identifies the sender, e.g. its address
+         * @return true if it has been seen before and should be dropped
+         */
+        bool seen_id(uint64_t sender, uint64_t id, clock::time_point now = clock::now())
+        {
+            id_checked_.add();
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto it = windows_.find(sender);
+            if (it == windows_.end())
+            {
+                if (windows_.size() >= DEDUP_SENDERS)
+                {
+                    forget_oldest();
+                }
+                windows_.emplace(sender, window{id, 1, now});
+                return false;
+            }
+            window &w = it->second;
+            w.last_heard_ = now;
+            if (id > w.highest_)
+            {
+                uint64_t shift = id - w.highest_;
+                w.seen_ = shift >= DEDUP_WINDOW ? 1 : (w.seen_ << shift) | 1;
+                w.highest_ = id;
+                return false;
+            }
+            uint64_t behind = w.highest_ - id;
+            if (behind >= DEDUP_WINDOW)
+            {
+                // too far back to be a retry, the sender started numbering again
+                id_resets_.add();
+                w = window{id, 1, now};
+                return false;
+            }
+            if (w.seen_ & (uint64_t{1} << behind))
+            {
+                id_duplicates_.add();
+                return true;
+            }
+            w.seen_ |= uint64_t{1} << behind;
+            return false;
+        }
+
+        /**
+         * @brief check a message without an id by its contents
+         * @return true if the same sender, which has never sent an id, sent the same message
+         *         recently and it should be dropped
+         */
+        bool seen_contents(uint64_t sender, const chat_message &msg, clock::time_point now = clock::now())
+        {
+            uint64_t hash = hash_bytes(reinterpret_cast<const char *>(&msg), sizeof(msg), sender);
+            // double hashing, the odd step visits distinct bits
+            uint64_t step = (hash >> 32) | 1;
+
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (windows_.count(sender) > 0)
+            {
+                return false;
+            }
+            content_checked_.add();
+            if (now - rotated_ > DEDUP_BLOOM_PERIOD)
+            {
+                std::swap(current_, previous_);
+                memset(current_.get(), 0, DEDUP_BLOOM_BITS / 8);
+                rotated_ = now;
+            }
+            bool in_current = true;
+            bool in_previous = true;
+            for (int i = 0; i < DEDUP_BLOOM_HASHES; i++)
+            {
+                uint32_t bit = static_cast<uint32_t>((hash + i * step) % DEDUP_BLOOM_BITS);
+                uint64_t mask = uint64_t{1} << (bit % 64);
+                in_current = in_current && (current_[bit / 64] & mask);
+                in_previous = in_previous && (previous_[bit / 64] & mask);
+                current_[bit / 64] |= mask;
+            }
+            if (in_current || in_previous)
+            {
+                content_drops_.add();
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        struct window
+        {
+            uint64_t highest_;
+            uint64_t seen_; // bit i: highest_ - i has been seen
+            clock::time_point last_heard_;
+        };
+
+        /**
+         * @brief FNV-1a, seeded with the sender
+         */
+        static uint64_t hash_bytes(const char *data, size_t length, uint64_t seed)
+        {
+            uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+            for (size_t i = 0; i < length; i++)
+            {
+                hash = (hash ^ static_cast<uint8_t>(data[i])) * 0x100000001b3ull;
+            }
+            return hash;
+        }
+
+        void forget_oldest()
+        {
+            auto oldest = windows_.begin();
+            for (auto it = windows_.begin(); it != windows_.end(); ++it)
+            {
+                if (it->second.last_heard_ < oldest->second.last_heard_)
+                {
+                    oldest = it;
+                }
+            }
+            windows_.erase(oldest);
+        }
+
+        std::mutex mutex_;
+        std::unordered_map<uint64_t, window> windows_;
+        std::unique_ptr<uint64_t[]> current_;
+        std::unique_ptr<uint64_t[]> previous_;
+        clock::time_point rotated_ = clock::now();
+
+        counter id_checked_;
+        counter id_duplicates_;
+        counter id_resets_;
+        counter content_checked_;
+        counter content_drops_;
+    };
+
+}; // namespace chat
@@ -0,0 +1,467 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chat_cookie.hpp"
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+
+// points each node has on the hash ring, more of them share users out more evenly
+#define FEDERATION_VNODES 64
+// characters of the federation key: 128 bits in hex
+#define FEDERATION_KEY_LENGTH 32
+// seconds a sealed message from another node is accepted for, either side of when it was sealed
+#define FEDERATION_SEAL_SECONDS 30
+// sequence numbers a node remembers below the highest it has had from another, older ones are replays
+#define FEDERATION_REPLAY_WINDOW 64
+
+namespace chat
+{
+
+    /**
+     * @brief node as the "address:port" carried in a REDIRECT
+     */
+    inline std::string format_node(const sockaddr_in &node)
+    {
+        char text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &node.sin_addr, text, sizeof(text));
+        return std::string{text} + ":" + std::to_string(ntohs(node.sin_port));
+    }
+
+    /**
+     * @brief parse a node from a REDIRECT or the federation list
+     * @return false unless text is an IPv4 "address:port"
+     */
+    inline bool parse_node(std::string_view text, sockaddr_in &node)
+    {
+        size_t colon = text.rfind(':');
+        if (colon == std::string_view::npos || colon >= INET_ADDRSTRLEN)
+        {
+            return false;
+        }
+        char address[INET_ADDRSTRLEN] = {};
+        memcpy(address, text.data(), colon);
+        int port = atoi(std::string{text.substr(colon + 1)}.c_str());
+        memset(&node, 0, sizeof(node));
+        node.sin_family = AF_INET;
+        node.sin_port = htons(static_cast<uint16_t>(port));
+        return port > 0 && port <= UINT16_MAX && inet_pton(AF_INET, address, &node.sin_addr) == 1;
+    }
+
+    /**
+     * @brief What a node appends to each message it sends another: its sequence number on the
+     * link between the two, when it was sealed, and a SipHash MAC of all that and the message
+     * under the link's key.
+     */
+    struct peer_seal
+    {
+        uint64_t sequence_;
+        uint64_t sealed_;
+        uint64_t mac_;
+    };
+
+    /**
+     * @brief Consistent hashing of usernames onto nodes.
+     *
+     * Each node is hashed onto a ring at FEDERATION_VNODES points, and a username belongs to
+     * the node of the first point at or after its own hash. Adding or removing a node only
+     * moves the users between it and its neighbours, and every node given the same list
+     * agrees on every owner without talking to the others.
+     */
+    class hash_ring
+    {
+    public:
+        void add(size_t node, std::string_view name)
+        {
+            for (int i = 0; i < FEDERATION_VNODES; i++)
+            {
+                points_.emplace_back(hash(std::string{name} + "#" + std::to_string(i)), node);
+            }
+            std::sort(points_.begin(), points_.end());
+        }
+
+        /**
+         * @brief node owning key, the ring must not be empty
+         */
+        size_t owner(std::string_view key) const
+        {
+            auto at = std::lower_bound(points_.begin(), points_.end(), std::make_pair(hash(key), size_t{0}));
+            return at == points_.end() ? points_.front().second : at->second;
+        }
+
+    private:
+        static uint64_t hash(std::string_view text)
+        {
+            // FNV-1a, then a finaliser so similar names land far apart
+            uint64_t h = 14695981039346656037ull;
+            for (char c : text)
+            {
+                h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+            }
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        std::vector<std::pair<uint64_t, size_t>> points_;
+    };
+
+    /**
+     * @brief The nodes of a federation, who owns each user and which remote users are online.
+     *
+     * Every node is given the same list of node addresses. A user joins the node owning its
+     * name on the hash ring, other nodes redirect it there, so each user's session, groups and
+     * rate limits live on exactly one node. Of users on other nodes a node keeps only their
+     * name and node, learnt from PRESENCE messages, which is enough to route a direct message
+     * or group addition to the right node and to list everyone.
+     *
+     * A node trusts another's messages further than a client's, so every message between
+     * nodes is sealed with a MAC. A datagram merely coming from a node's address, which anyone
+     * can spoof, is not enough. Each link from one node to another has its own key, derived
+     * from the one all nodes share, and numbers its messages. The receiver keeps a window of
+     * the numbers it has had, as in IPsec anti-replay, so a captured message is good once and
+     * only at the node it was sent to. A link starts numbering from the time, so a restarted
+     * node carries on above what it sent before.
+     */
+    class federation
+    {
+    public:
+        federation() : presence_updates_{"federation.presence_updates"}, rejected_{"federation.rejected"}, replays_{"federation.replays"} {}
+
+        /**
+         * @brief join the federation listed in spec, e.g. "127.0.0.1:8867,127.0.0.1:8967"
+         * @param key key shared by all the nodes, FEDERATION_KEY_LENGTH lower case hex digits
+         * @param self address this node receives on, which must be in the list
+         * @return false if the key or list can't be parsed or the list doesn't hold self, the
+         *         node then runs alone
+         */
+        bool configure(std::string_view spec, std::string_view key, const sockaddr_in &self)
+        {
+            if (key.size() != FEDERATION_KEY_LENGTH ||
+                !parse_hex(key.substr(0, FEDERATION_KEY_LENGTH / 2), key_[0]) ||
+                !parse_hex(key.substr(FEDERATION_KEY_LENGTH / 2), key_[1]))
+            {
+                return false;
+            }
+            std::vector<sockaddr_in> nodes;
+            size_t self_index = SIZE_MAX;
+            while (!spec.empty())
+            {
+                size_t comma = spec.find(',');
+                sockaddr_in node;
+                if (!parse_node(spec.substr(0, comma), node))
+                {
+                    return false;
+                }
+                if (node.sin_port == self.sin_port &&
+                    (node.sin_addr.s_addr == self.sin_addr.s_addr || self.sin_addr.s_addr == htonl(INADDR_ANY)))
+                {
+                    self_index = nodes.size();
+                }
+                nodes.push_back(node);
+                spec = comma == std::string_view::npos ? std::string_view{} : spec.substr(comma + 1);
+            }
+            if (self_index == SIZE_MAX)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < nodes.size(); i++)
+            {
+                ring_.add(i, format_node(nodes[i]));
+            }
+            nodes_ = std::move(nodes);
+            self_ = self_index;
+            links_.reset(new link[nodes_.size()]);
+            uint64_t start = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            for (size_t i = 0; i < nodes_.size(); i++)
+            {
+                link_key(self_, i, links_[i].send_key_);
+                link_key(i, self_, links_[i].receive_key_);
+                links_[i].sequence_ = start;
+            }
+            return true;
+        }
+
+        bool enabled() const
+        {
+            return nodes_.size() > 1;
+        }
+
+        const sockaddr_in &owner(std::string_view username) const
+        {
+            return nodes_[ring_.owner(username)];
+        }
+
+        bool owns(std::string_view username) const
+        {
+            return !enabled() || ring_.owner(username) == self_;
+        }
+
+        /**
+         * @brief is address another node of the federation
+         *
+         * Only says where a datagram claims to be from, it must also unseal to be the node's.
+         */
+        bool is_peer(const sockaddr_in &address) const
+        {
+            return node_of(address) != SIZE_MAX;
+        }
+
+        /**
+         * @brief seal a message of length bytes in buffer for the node at address, buffer must have room
+         * @return new length, 0 if address is not another node
+         */
+        size_t seal(char *buffer, size_t length, const sockaddr_in &address)
+        {
+            size_t n = node_of(address);
+            if (n == SIZE_MAX)
+            {
+                return 0;
+            }
+            link &l = links_[n];
+            peer_seal seal{l.sequence_.fetch_add(1, std::memory_order_relaxed), now(), 0};
+            memcpy(buffer + length, &seal, offsetof(peer_seal, mac_));
+            seal.mac_ = siphash(l.send_key_, reinterpret_cast<const uint8_t *>(buffer), length + offsetof(peer_seal, mac_));
+            memcpy(buffer + length, &seal, sizeof(seal));
+            return length + sizeof(seal);
+        }
+
+        /**
+         * @brief check and strip the seal of a datagram from another node
+         *
+         * @param address node the datagram came from
+         * @param buffer datagram
+         * @param length its length, reduced by the seal's size if it checks out
+         * @return false if the datagram is not a message that node sealed for us lately, or
+         *         is one we have already had
+         */
+        bool unseal(const sockaddr_in &address, const char *buffer, ssize_t &length)
+        {
+            size_t n = node_of(address);
+            if (n == SIZE_MAX || length != static_cast<ssize_t>(sizeof(chat_message) + sizeof(peer_seal)))
+            {
+                rejected_.add();
+                return false;
+            }
+            link &l = links_[n];
+            peer_seal seal;
+            memcpy(&seal, buffer + length - sizeof(seal), sizeof(seal));
+            uint64_t at = now();
+            uint64_t skew = at > seal.sealed_ ? at - seal.sealed_ : seal.sealed_ - at;
+            if (skew > FEDERATION_SEAL_SECONDS ||
+                siphash(l.receive_key_, reinterpret_cast<const uint8_t *>(buffer), length - sizeof(seal.mac_)) != seal.mac_)
+            {
+                rejected_.add();
+                return false;
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (seal.sequence_ > l.highest_)
+            {
+                uint64_t shift = seal.sequence_ - l.highest_;
+                l.seen_ = shift >= FEDERATION_REPLAY_WINDOW ? 1 : (l.seen_ << shift) | 1;
+                l.highest_ = seal.sequence_;
+            }
+            else
+            {
+                // unlike a client, a node never starts its numbering again, so anything
+                // below the window is as much a replay as anything marked in it
+                uint64_t behind = l.highest_ - seal.sequence_;
+                if (behind >= FEDERATION_REPLAY_WINDOW || (l.seen_ & (uint64_t{1} << behind)))
+                {
+                    replays_.add();
+                    return false;
+                }
+                l.seen_ |= uint64_t{1} << behind;
+            }
+            length -= sizeof(seal);
+            return true;
+        }
+
+        /**
+         * @brief call f with the address of every other node
+         */
+        template <typename F>
+        void for_each_peer(F &&f) const
+        {
+            for (size_t i = 0; i < nodes_.size(); i++)
+            {
+                if (i != self_)
+                {
+                    f(nodes_[i]);
+                }
+            }
+        }
+
+        /**
+         * @brief record username as online at the peer node at address
+         */
+        void online(std::string_view username, const sockaddr_in &node)
+        {
+            size_t n = node_of(node);
+            if (n == SIZE_MAX)
+            {
+                return;
+            }
+            presence_updates_.add();
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto at = remote_.find(username);
+            if (at == remote_.end())
+            {
+                remote_.emplace(std::string{username}, n);
+            }
+            else
+            {
+                at->second = n;
+            }
+        }
+
+        /**
+         * @brief record username as offline, if the peer node at address had it
+         */
+        void offline(std::string_view username, const sockaddr_in &node)
+        {
+            presence_updates_.add();
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto at = remote_.find(username);
+            if (at != remote_.end() && at->second == node_of(node))
+            {
+                remote_.erase(at);
+            }
+        }
+
+        /**
+         * @brief find the node of a remote user
+         * @return false if username is not online on another node
+         */
+        bool locate(std::string_view username, sockaddr_in &node) const
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto at = remote_.find(username);
+            if (at == remote_.end())
+            {
+                return false;
+            }
+            node = nodes_[at->second];
+            return true;
+        }
+
+        /**
+         * @brief names of the users online on other nodes, in order
+         */
+        std::vector<std::string> remote_users() const
+        {
+            std::vector<std::string> users;
+            std::lock_guard<std::mutex> lock{mutex_};
+            users.reserve(remote_.size());
+            for (auto &user : remote_)
+            {
+                users.push_back(user.first);
+            }
+            return users;
+        }
+
+        /**
+         * @brief names of remote users that sort after a cursor and start with prefix, in order
+         * @param after name the previous page ended with, empty for the first page
+         * @param limit most names returned
+         */
+        std::vector<std::string> remote_users(std::string_view after, std::string_view prefix, size_t limit) const
+        {
+            std::vector<std::string> users;
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto it = remote_.lower_bound(std::max(after, prefix));
+            if (it != remote_.end() && !after.empty() && it->first == after)
+            {
+                ++it;
+            }
+            for (; it != remote_.end() && users.size() < limit && it->first.starts_with(prefix); ++it)
+            {
+                users.push_back(it->first);
+            }
+            return users;
+        }
+
+        /**
+         * @brief drop every user recorded at the peer node at address, e.g. when it restarts
+         */
+        void forget(const sockaddr_in &node)
+        {
+            size_t n = node_of(node);
+            std::lock_guard<std::mutex> lock{mutex_};
+            std::erase_if(remote_, [n](const auto &user)
+                          { return user.second == n; });
+        }
+
+    private:
+        /**
+         * @brief keys and sequence numbers of the links to and from another node
+         */
+        struct link
+        {
+            uint64_t send_key_[2];
+            uint64_t receive_key_[2];
+            std::atomic<uint64_t> sequence_; // next to seal with
+            uint64_t highest_ = 0;           // highest received, with seen_ under mutex_
+            uint64_t seen_ = 0;              // bit i: highest_ - i has been received
+        };
+
+        /**
+         * @brief key of the link from node from to node to, derived from the shared key
+         */
+        void link_key(size_t from, size_t to, uint64_t (&out)[2]) const
+        {
+            uint64_t nodes[2] = {from, to};
+            out[0] = siphash(key_, reinterpret_cast<const uint8_t *>(nodes), sizeof(nodes));
+            nodes[0] |= uint64_t{1} << 63;
+            out[1] = siphash(key_, reinterpret_cast<const uint8_t *>(nodes), sizeof(nodes));
+        }
+
+        static uint64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        size_t node_of(const sockaddr_in &address) const
+        {
+            for (size_t i = 0; i < nodes_.size(); i++)
+            {
+                if (i != self_ && nodes_[i].sin_port == address.sin_port && nodes_[i].sin_addr.s_addr == address.sin_addr.s_addr)
+                {
+                    return i;
+                }
+            }
+            return SIZE_MAX;
+        }
+
+        std::vector<sockaddr_in> nodes_;
+        size_t self_ = 0;
+        hash_ring ring_;
+        uint64_t key_[2] = {};
+        std::unique_ptr<link[]> links_;
+
+        mutable std::mutex mutex_;
+        std::map<std::string, size_t, std::less<>> remote_; // username to its node
+
+        counter presence_updates_;
+        counter rejected_;
+        counter replays_;
+    };
+
+}; // namespace chat
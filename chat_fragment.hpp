@@ -0,0 +1,274 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chat_new.hpp"
+#include "chat_protocol.hpp"
+#include "chat_stats.hpp"
+
+// set in type_ of a chat_message whose message field starts with a fragment_header
+#define FRAGMENT_FLAG 0x80
+// largest message that can be sent in fragments and reassembled
+#define FRAGMENT_MAX_MESSAGE (64 * 1024)
+// messages a reassembler can have partly received at once, each gets a preallocated buffer
+#define FRAGMENT_SLOTS 8
+// a partly received message is dropped if no fragment of it arrives for this long
+#define FRAGMENT_TIMEOUT std::chrono::seconds(5)
+
+namespace chat
+{
+
+    /**
+     * @brief Header at the start of the message field of a fragment.
+     *
+     * A fragment keeps the type (with FRAGMENT_FLAG set), username and group name of the
+     * message it is part of, so it can be routed exactly like the whole message would be.
+     * Fragmented DIRECTMESSAGEs name the recipient in the group name field instead of
+     * prefixing the text with "recipient:".
+     */
+    struct fragment_header
+    {
+        uint32_t message_id_; // chosen by the sender, unique per sender among messages in flight
+        uint16_t index_;      // position of this fragment, from 0
+        uint16_t count_;      // fragments making up the message
+        uint16_t length_;     // payload bytes in this fragment
+        uint16_t reserved_;
+    };
+
+    // payload bytes carried by each fragment
+    constexpr size_t FRAGMENT_PAYLOAD = MAX_MESSAGE_LENGTH - sizeof(fragment_header);
+    // most fragments a message may be split into
+    constexpr size_t FRAGMENT_MAX_COUNT = (FRAGMENT_MAX_MESSAGE + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD;
+
+    /**
+     * @brief true if msg is a fragment of a larger message
+     */
+    inline bool is_fragment(const chat_message &msg)
+    {
+        return (static_cast<uint8_t>(msg.type_) & FRAGMENT_FLAG) != 0;
+    }
+
+    /**
+     * @brief type of the message a fragment is part of
+     */
+    inline chat_type fragment_type(const chat_message &msg)
+    {
+        return static_cast<chat_type>(static_cast<uint8_t>(msg.type_) & ~FRAGMENT_FLAG);
+    }
+
+    /**
+     * @brief read and check the header of a fragment
+     * @return false if the header is inconsistent, the fragment should then be dropped
+     */
+    inline bool get_fragment_header(const chat_message &msg, fragment_header &header)
+    {
+        memcpy(&header, msg.message_, sizeof(header));
+        return header.count_ > 0 && header.count_ <= FRAGMENT_MAX_COUNT && header.index_ < header.count_ &&
+               header.length_ <= FRAGMENT_PAYLOAD &&
+               (header.index_ + 1 == header.count_ || header.length_ == FRAGMENT_PAYLOAD);
+    }
+
+    /**
+     * @brief payload carried by a fragment whose header has been checked
+     */
+    inline std::string_view fragment_payload(const chat_message &msg, const fragment_header &header)
+    {
+        return std::string_view{reinterpret_cast<const char *>(msg.message_) + sizeof(fragment_header), header.length_};
+    }
+
+    /**
+     * @brief true if message has to be sent in fragments
+     */
+    inline bool needs_fragments(std::string_view message)
+    {
+        return message.size() > MAX_MESSAGE_LENGTH - 1;
+    }
+
+    /**
+     * @brief Split message into fragments, each written to one buffer and passed to send.
+     *
+     * Messages longer than FRAGMENT_MAX_MESSAGE are truncated to it.
+     *
+     * @param type type of the whole message
+     * @param username stored in every fragment
+     * @param groupname stored in every fragment
+     * @param message payload to split
+     * @param message_id identifies the message among the sender's messages in flight
+     * @param send callable taking (const chat_message &), called once per fragment in order
+     */
+    template <typename F>
+    void write_fragments(chat_type type, std::string_view username, std::string_view groupname,
+                         std::string_view message, uint32_t message_id, F &&send)
+    {
+        message = message.substr(0, FRAGMENT_MAX_MESSAGE);
+        size_t count = std::max<size_t>(1, (message.size() + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD);
+
+        chat_message fragment;
+        message_span out = as_span(fragment);
+        write_message(out, type, username, groupname);
+        out[wire::TYPE_OFFSET] = static_cast<char>(static_cast<uint8_t>(type) | FRAGMENT_FLAG);
+        for (size_t i = 0; i < count; i++)
+        {
+            std::string_view part = message.substr(i * FRAGMENT_PAYLOAD, FRAGMENT_PAYLOAD);
+            fragment_header header{message_id, static_cast<uint16_t>(i), static_cast<uint16_t>(count),
+                                   static_cast<uint16_t>(part.size()), 0};
+            memcpy(out.data() + wire::MESSAGE_OFFSET, &header, sizeof(header));
+            memcpy(out.data() + wire::MESSAGE_OFFSET + sizeof(header), part.data(), part.size());
+            send(static_cast<const chat_message &>(fragment));
+        }
+    }
+
+    /**
+     * @brief Reassembles fragmented messages into buffers allocated once, up front.
+     *
+     * At most FRAGMENT_SLOTS messages are reassembled at once, so memory use is capped at
+     * FRAGMENT_SLOTS * FRAGMENT_MAX_MESSAGE whatever is received. A message whose fragments stop
+     * arriving is dropped after FRAGMENT_TIMEOUT; if every slot is busy the oldest message is
+     * dropped to make room. Fragments may arrive in any order and duplicates are ignored.
+     * Not thread safe.
+     */
+    class reassembler
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        reassembler()
+            : slots_(FRAGMENT_SLOTS), completed_{"fragment.completed"}, dropped_{"fragment.dropped"}
+        {
+            for (auto &s : slots_)
+            {
+                // FRAGMENT_MAX_COUNT full fragments, a little over FRAGMENT_MAX_MESSAGE
+                s.buffer_.reset(new char[FRAGMENT_MAX_COUNT * FRAGMENT_PAYLOAD]);
+            }
+        }
+
+        /**
+         * @brief add a fragment, calling done once its message is complete
+         *
+         * @param msg received fragment
+         * @param done callable taking (const chat_message &first, std::string_view message), first
+         *        has the routing fields of the message; message is only valid during the call
+         * @return false if the fragment was malformed
+         */
+        template <typename F>
+        bool add(const chat_message &msg, F &&done, clock::time_point now = clock::now())
+        {
+            fragment_header header;
+            if (!get_fragment_header(msg, header))
+            {
+                dropped_.add();
+                return false;
+            }
+
+            std::string_view sender = field(msg.username_, MAX_USERNAME_LENGTH);
+            slot *s = find(sender, header, now);
+            if (s->count_ != header.count_)
+            {
+                // the sender reused a message id before the previous message was complete
+                dropped_.add();
+                return false;
+            }
+            size_t bit = header.index_;
+            if ((s->received_[bit / 64] & (uint64_t{1} << (bit % 64))) == 0)
+            {
+                s->received_[bit / 64] |= uint64_t{1} << (bit % 64);
+                s->remaining_--;
+                std::string_view payload = fragment_payload(msg, header);
+                memcpy(s->buffer_.get() + header.index_ * FRAGMENT_PAYLOAD, payload.data(), payload.size());
+                if (header.index_ + 1 == header.count_)
+                {
+                    s->length_ = header.index_ * FRAGMENT_PAYLOAD + payload.size();
+                }
+                if (header.index_ == 0)
+                {
+                    s->first_ = msg;
+                    s->first_.type_ = static_cast<int8_t>(fragment_type(msg));
+                }
+            }
+            s->last_ = now;
+
+            if (s->remaining_ == 0)
+            {
+                completed_.add();
+                done(static_cast<const chat_message &>(s->first_), std::string_view{s->buffer_.get(), s->length_});
+                s->in_use_ = false;
+            }
+            return true;
+        }
+
+    private:
+        struct slot
+        {
+            bool in_use_ = false;
+            std::string sender_;
+            uint32_t message_id_ = 0;
+            size_t count_ = 0;
+            size_t remaining_ = 0;
+            size_t length_ = 0;
+            uint64_t received_[(FRAGMENT_MAX_COUNT + 63) / 64] = {};
+            chat_message first_;
+            clock::time_point last_;
+            std::unique_ptr<char[]> buffer_;
+        };
+
+        /**
+         * @brief slot reassembling the message header belongs to, starting one if needed
+         */
+        slot *find(std::string_view sender, const fragment_header &header, clock::time_point now)
+        {
+            slot *free_slot = nullptr;
+            slot *oldest = nullptr;
+            for (auto &s : slots_)
+            {
+                if (s.in_use_ && now - s.last_ > FRAGMENT_TIMEOUT)
+                {
+                    // gave up waiting for the rest of this one
+                    s.in_use_ = false;
+                    dropped_.add();
+                }
+                if (!s.in_use_)
+                {
+                    free_slot = free_slot == nullptr ? &s : free_slot;
+                    continue;
+                }
+                if (s.message_id_ == header.message_id_ && s.sender_ == sender)
+                {
+                    return &s;
+                }
+                if (oldest == nullptr || s.last_ < oldest->last_)
+                {
+                    oldest = &s;
+                }
+            }
+            if (free_slot == nullptr)
+            {
+                free_slot = oldest;
+                dropped_.add();
+            }
+
+            slot &s = *free_slot;
+            s.in_use_ = true;
+            s.sender_.assign(sender);
+            s.message_id_ = header.message_id_;
+            s.count_ = header.count_;
+            s.remaining_ = header.count_;
+            s.length_ = 0;
+            std::fill(std::begin(s.received_), std::end(s.received_), 0);
+            s.first_ = chat_message{};
+            return &s;
+        }
+
+        std::vector<slot> slots_;
+        counter completed_;
+        counter dropped_;
+    };
+
+}; // namespace chat
@@ -0,0 +1,486 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "chat_stats.hpp"
+
+// bytes in each thread's log ring, must be a power of two
+#define LOG_RING_SIZE (64 * 1024)
+// longest string argument copied into a record, longer ones are truncated
+#define LOG_MAX_STRING 256
+// how often the log thread drains the rings
+#define LOG_FLUSH_INTERVAL std::chrono::milliseconds(5)
+
+namespace chat
+{
+
+    /**
+     * @brief Log levels, a record is kept if its level is at least the logger's level
+     */
+    enum log_level : int
+    {
+        LOG_LEVEL_TRACE = 0,
+        LOG_LEVEL_DEBUG,
+        LOG_LEVEL_INFO,
+        LOG_LEVEL_WARN,
+        LOG_LEVEL_ERROR,
+        LOG_LEVEL_OFF,
+    };
+
+    /**
+     * @brief Static description of one logging call site, the record refers to it instead of
+     *        carrying the format string
+     */
+    struct log_site
+    {
+        log_level level_;
+        const char *file_;
+        int line_;
+        const char *function_;
+        const char *format_;
+    };
+
+    /**
+     * @brief Single producer, single consumer ring of variable length log records.
+     *
+     * The owning thread reserves and commits records, the log thread drains them. Records never
+     * straddle the end of the buffer, a padding record fills the gap instead.
+     */
+    class log_ring
+    {
+    public:
+        /**
+         * @brief fixed part of every record, followed by the encoded arguments
+         */
+        struct record
+        {
+            uint32_t size_;
+            uint32_t padding_;
+            const log_site *site_;
+            void (*print_)(FILE *, const char *, const char *);
+            uint64_t time_;
+        };
+
+        static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+        static constexpr size_t ALIGN = alignof(record);
+
+        /**
+         * @brief space for a record of size bytes, nullptr if the ring is full
+         */
+        char *reserve(size_t size)
+        {
+            size = (size + ALIGN - 1) & ~(ALIGN - 1);
+            size_t head = head_.load(std::memory_order_relaxed);
+            size_t tail = tail_.load(std::memory_order_acquire);
+            size_t offset = head & (LOG_RING_SIZE - 1);
+            size_t gap = offset + size > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+            if (head + gap + size - tail > LOG_RING_SIZE)
+            {
+                return nullptr;
+            }
+            if (gap != 0)
+            {
+                record *pad = reinterpret_cast<record *>(buffer_ + offset);
+                pad->size_ = static_cast<uint32_t>(gap);
+                pad->padding_ = 1;
+                head += gap;
+                offset = 0;
+            }
+            pending_ = head + size;
+            record *r = reinterpret_cast<record *>(buffer_ + offset);
+            r->size_ = static_cast<uint32_t>(size);
+            r->padding_ = 0;
+            return buffer_ + offset;
+        }
+
+        /**
+         * @brief make the last reserved record visible to the log thread
+         */
+        void commit()
+        {
+            head_.store(pending_, std::memory_order_release);
+        }
+
+        /**
+         * @brief call f(const record &) for every committed record, then release their space
+         */
+        template <typename F>
+        void drain(F &&f)
+        {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            size_t head = head_.load(std::memory_order_acquire);
+            while (tail < head)
+            {
+                const record *r = reinterpret_cast<const record *>(buffer_ + (tail & (LOG_RING_SIZE - 1)));
+                if (r->padding_ == 0)
+                {
+                    f(*r);
+                }
+                tail += r->size_;
+            }
+            tail_.store(tail, std::memory_order_release);
+        }
+
+        /**
+         * @brief set by the owning thread when it exits, the ring is freed once drained
+         */
+        std::atomic<bool> retired_{false};
+
+    private:
+        alignas(64) char buffer_[LOG_RING_SIZE];
+        alignas(64) std::atomic<size_t> head_{0};
+        size_t pending_ = 0;
+        alignas(64) std::atomic<size_t> tail_{0};
+    };
+
+    /**
+     * @brief encoding of one log argument inside a record
+     *
+     * Arithmetic values, enums and pointers are copied as is. Anything convertible to
+     * std::string_view is copied as a NUL terminated string so it can be formatted with %s
+     * after the caller's buffer has gone.
+     */
+    template <typename T, typename = void>
+    struct log_arg
+    {
+        typedef std::decay_t<T> stored;
+        static_assert(std::is_arithmetic_v<stored> || std::is_enum_v<stored> || std::is_pointer_v<stored>,
+                      "log argument must be a number, pointer or string");
+
+        static size_t size(const T &) { return sizeof(stored); }
+
+        static char *encode(char *out, const T &value)
+        {
+            stored v = value;
+            memcpy(out, &v, sizeof(v));
+            return out + sizeof(v);
+        }
+
+        static stored decode(const char *&in)
+        {
+            stored v;
+            memcpy(&v, in, sizeof(v));
+            in += sizeof(v);
+            return v;
+        }
+    };
+
+    template <typename T>
+    struct log_arg<T, std::enable_if_t<std::is_convertible_v<const T &, std::string_view>>>
+    {
+        static std::string_view view(const T &value)
+        {
+            if constexpr (std::is_pointer_v<std::decay_t<T>>)
+            {
+                if (value == nullptr)
+                {
+                    return "(null)";
+                }
+            }
+            std::string_view v = value;
+            return v.substr(0, LOG_MAX_STRING);
+        }
+
+        static size_t size(const T &value)
+        {
+            return sizeof(uint16_t) + view(value).size() + 1;
+        }
+
+        static char *encode(char *out, const T &value)
+        {
+            std::string_view v = view(value);
+            uint16_t length = static_cast<uint16_t>(v.size());
+            memcpy(out, &length, sizeof(length));
+            out += sizeof(length);
+            memcpy(out, v.data(), v.size());
+            out[v.size()] = '\0';
+            return out + v.size() + 1;
+        }
+
+        static const char *decode(const char *&in)
+        {
+            uint16_t length;
+            memcpy(&length, in, sizeof(length));
+            const char *s = in + sizeof(length);
+            in = s + length + 1;
+            return s;
+        }
+    };
+
+    /**
+     * @brief Asynchronous binary logger.
+     *
+     * Logging a record copies the call site pointer, a timestamp and the raw arguments into the
+     * calling thread's log_ring; nothing is formatted on the calling thread. A background thread
+     * started by start() drains the rings every LOG_FLUSH_INTERVAL, formats the records and
+     * writes them out. If a ring is full the record is dropped and counted in log.dropped.
+     */
+    class logger
+    {
+    public:
+        static logger &instance()
+        {
+            static logger l;
+            return l;
+        }
+
+        /**
+         * @brief true if records of this level are currently kept
+         */
+        static bool enabled(log_level level)
+        {
+            return level >= instance().level_.load(std::memory_order_relaxed);
+        }
+
+        void set_level(log_level level)
+        {
+            level_.store(level, std::memory_order_relaxed);
+        }
+
+        log_level level() const
+        {
+            return static_cast<log_level>(level_.load(std::memory_order_relaxed));
+        }
+
+        /**
+         * @brief parse a level name such as "debug" or "warn"
+         * @return fallback if name is not a level
+         */
+        static log_level parse_level(std::string_view name, log_level fallback)
+        {
+            static const char *names[] = {"trace", "debug", "info", "warn", "error", "off"};
+            for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_OFF; i++)
+            {
+                if (name == names[i])
+                {
+                    return static_cast<log_level>(i);
+                }
+            }
+            return fallback;
+        }
+
+        /**
+         * @brief start the log thread
+         * @param out stream records are written to
+         */
+        void start(FILE *out = stderr)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            if (thread_.joinable())
+            {
+                return;
+            }
+            out_ = out;
+            stopping_ = false;
+            thread_ = std::thread{[this]()
+                                  { run(); }};
+        }
+
+        /**
+         * @brief write out everything logged so far and stop the log thread
+         */
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                if (!thread_.joinable())
+                {
+                    return;
+                }
+                stopping_ = true;
+            }
+            cv_.notify_one();
+            thread_.join();
+        }
+
+        /**
+         * @brief append a record for site to the calling thread's ring
+         */
+        template <typename... Args>
+        void write(const log_site &site, const Args &...args)
+        {
+            size_t size = sizeof(log_ring::record) + (size_t{0} + ... + log_arg<Args>::size(args));
+            log_ring &ring = thread_ring();
+            char *out = ring.reserve(size);
+            if (out == nullptr)
+            {
+                dropped_.add();
+                return;
+            }
+            log_ring::record *r = reinterpret_cast<log_ring::record *>(out);
+            r->site_ = &site;
+            r->print_ = &print<Args...>;
+            r->time_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count();
+            out += sizeof(log_ring::record);
+            ((out = log_arg<Args>::encode(out, args)), ...);
+            ring.commit();
+        }
+
+    private:
+        logger()
+        {
+            const char *env = getenv("CHAT_LOG_LEVEL");
+            level_.store(env != nullptr ? parse_level(env, LOG_LEVEL_INFO) : LOG_LEVEL_INFO);
+        }
+
+        ~logger()
+        {
+            stop();
+        }
+
+        /**
+         * @brief owns a thread's ring and hands it to the log thread when the thread exits
+         */
+        struct ring_holder
+        {
+            std::shared_ptr<log_ring> ring_;
+
+            ~ring_holder()
+            {
+                ring_->retired_.store(true, std::memory_order_release);
+            }
+        };
+
+        log_ring &thread_ring()
+        {
+            thread_local ring_holder holder{attach()};
+            return *holder.ring_;
+        }
+
+        std::shared_ptr<log_ring> attach()
+        {
+            auto ring = std::make_shared<log_ring>();
+            std::lock_guard<std::mutex> lock{rings_mutex_};
+            rings_.push_back(ring);
+            return ring;
+        }
+
+        template <typename... Args>
+        static void print(FILE *out, const char *format, const char *payload)
+        {
+            // braced initialisation decodes the arguments left to right
+            std::tuple<decltype(log_arg<Args>::decode(payload))...> values{log_arg<Args>::decode(payload)...};
+            std::apply([out, format](auto... v)
+                       {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+                           fprintf(out, format, v...);
+#pragma GCC diagnostic pop
+                       },
+                       values);
+        }
+
+        void print_record(const log_ring::record &r)
+        {
+            static const char *labels[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+            const log_site &site = *r.site_;
+            fprintf(out_, "%s: %llu.%06llu %s:%d:%s(): ", labels[site.level_],
+                    static_cast<unsigned long long>(r.time_ / 1000000),
+                    static_cast<unsigned long long>(r.time_ % 1000000),
+                    site.file_, site.line_, site.function_);
+            r.print_(out_, site.format_, reinterpret_cast<const char *>(&r + 1));
+            written_.add();
+        }
+
+        /**
+         * @brief drain every ring once, freeing rings whose threads have exited
+         * @return true if anything was written
+         */
+        bool flush()
+        {
+            std::vector<std::shared_ptr<log_ring>> rings;
+            {
+                std::lock_guard<std::mutex> lock{rings_mutex_};
+                rings = rings_;
+            }
+            bool wrote = false;
+            for (auto &ring : rings)
+            {
+                bool retired = ring->retired_.load(std::memory_order_acquire);
+                ring->drain([this, &wrote](const log_ring::record &r)
+                            {
+                                print_record(r);
+                                wrote = true; });
+                if (retired)
+                {
+                    std::lock_guard<std::mutex> lock{rings_mutex_};
+                    rings_.erase(std::remove(rings_.begin(), rings_.end(), ring), rings_.end());
+                }
+            }
+            if (wrote)
+            {
+                fflush(out_);
+            }
+            return wrote;
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            while (!stopping_)
+            {
+                lock.unlock();
+                flush();
+                lock.lock();
+                cv_.wait_for(lock, LOG_FLUSH_INTERVAL, [this]()
+                             { return stopping_; });
+            }
+            lock.unlock();
+            flush();
+        }
+
+        std::atomic<int> level_{LOG_LEVEL_INFO};
+        FILE *out_ = stderr;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool stopping_ = false;
+        std::thread thread_;
+
+        std::mutex rings_mutex_;
+        std::vector<std::shared_ptr<log_ring>> rings_;
+
+        counter written_{"log.written"};
+        counter dropped_{"log.dropped"};
+    };
+
+}; // namespace chat
+
+/**
+ * @brief log a printf style message at level, format and call site are only referenced, arguments are copied
+ *
+ * Strings, including std::string and std::string_view, are formatted with %s.
+ */
+#define LOG_AT(level, format, ...)                                                           \
+    do                                                                                       \
+    {                                                                                        \
+        if (chat::logger::enabled(level))                                                    \
+        {                                                                                    \
+            static const chat::log_site log_site_{level, __FILE__, __LINE__, __func__, format}; \
+            chat::logger::instance().write(log_site_ __VA_OPT__(, ) __VA_ARGS__);              \
+        }                                                                                    \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(chat::LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(chat::LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(chat::LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(chat::LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(chat::LOG_LEVEL_ERROR, __VA_ARGS__)
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <string_view>
+
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+
+// UDP port of every multicast channel
+#define MULTICAST_PORT (SERVER_PORT + 3)
+// addresses from the base, the first carries broadcasts and groups share the rest by hash
+#define MULTICAST_CHANNELS 256
+// routers a channel's datagrams may cross, one keeps them on the LAN
+#define MULTICAST_TTL 1
+
+namespace chat
+{
+
+    /**
+     * @brief channel as the "address:port" carried in a MULTICAST offer
+     */
+    inline std::string format_channel(const sockaddr_in &channel)
+    {
+        char text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &channel.sin_addr, text, sizeof(text));
+        return std::string{text} + ":" + std::to_string(ntohs(channel.sin_port));
+    }
+
+    /**
+     * @brief parse a channel from a MULTICAST offer
+     * @return false unless text is a multicast "address:port"
+     */
+    inline bool parse_channel(std::string_view text, sockaddr_in &channel)
+    {
+        size_t colon = text.rfind(':');
+        if (colon == std::string_view::npos || colon >= INET_ADDRSTRLEN)
+        {
+            return false;
+        }
+        char address[INET_ADDRSTRLEN] = {};
+        memcpy(address, text.data(), colon);
+        int port = atoi(std::string{text.substr(colon + 1)}.c_str());
+        memset(&channel, 0, sizeof(channel));
+        channel.sin_family = AF_INET;
+        channel.sin_port = htons(static_cast<uint16_t>(port));
+        return port > 0 && port <= UINT16_MAX && inet_pton(AF_INET, address, &channel.sin_addr) == 1 &&
+               IN_MULTICAST(ntohl(channel.sin_addr.s_addr));
+    }
+
+    /**
+     * @brief The server's side of multicast fan-out: a channel address per group and one for broadcasts.
+     *
+     * Channels are MULTICAST_CHANNELS consecutive addresses from a base. Groups are hashed
+     * onto them, so nothing is kept per group and two groups may share a channel; clients
+     * drop group messages for groups they are not in. Who may send to a group is still
+     * decided by the server, the network only does the copying.
+     */
+    class multicast_channels
+    {
+    public:
+        multicast_channels() : sent_{"multicast.sent"} {}
+
+        ~multicast_channels()
+        {
+            if (fd_ >= 0)
+            {
+                close(fd_);
+            }
+        }
+
+        multicast_channels(const multicast_channels &) = delete;
+        multicast_channels &operator=(const multicast_channels &) = delete;
+
+        /**
+         * @brief send on the channels from base, e.g. "239.192.0.0", out of the interface with address local
+         * @return false if they cannot be used, everything then stays unicast
+         */
+        bool open(std::string_view base, const in_addr &local)
+        {
+            sockaddr_in first;
+            if (!parse_channel(std::string{base} + ":" + std::to_string(MULTICAST_PORT), first))
+            {
+                return false;
+            }
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0)
+            {
+                return false;
+            }
+            unsigned char ttl = MULTICAST_TTL;
+            unsigned char loop = 1; // clients on this host are members too
+            if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) < 0 ||
+                setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+                setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+            {
+                close(fd);
+                return false;
+            }
+            base_ = first;
+            fd_ = fd;
+            return true;
+        }
+
+        bool enabled() const
+        {
+            return fd_ >= 0;
+        }
+
+        /**
+         * @brief channel carrying broadcasts
+         */
+        const sockaddr_in &broadcasts() const
+        {
+            return base_;
+        }
+
+        /**
+         * @brief channel carrying the messages of a group
+         */
+        sockaddr_in group(std::string_view name) const
+        {
+            // FNV-1a
+            uint32_t hash = 2166136261u;
+            for (char c : name)
+            {
+                hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+            }
+            sockaddr_in channel = base_;
+            channel.sin_addr.s_addr = htonl(ntohl(base_.sin_addr.s_addr) + 1 + hash % (MULTICAST_CHANNELS - 1));
+            return channel;
+        }
+
+        /**
+         * @brief send a message once to every member of a channel
+         */
+        ssize_t send(const char *data, size_t length, const sockaddr_in &channel)
+        {
+            sent_.add();
+            return sendto(fd_, data, length, 0, (const sockaddr *)&channel, sizeof(channel));
+        }
+
+    private:
+        int fd_ = -1;
+        sockaddr_in base_{};
+        counter sent_;
+    };
+
+    /**
+     * @brief A client's socket for the multicast channels it has been offered.
+     */
+    class multicast_receiver
+    {
+    public:
+        ~multicast_receiver()
+        {
+            if (fd_ >= 0)
+            {
+                close(fd_);
+            }
+        }
+
+        /**
+         * @brief listen on MULTICAST_PORT, joining channels on the interface with address local
+         * @return false if multicast can't be received, the server then keeps sending unicast
+         */
+        bool open(const in_addr &local)
+        {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0)
+            {
+                return false;
+            }
+            // every client on a host binds the port, and gets only the channels it joined
+            int on = 1;
+            int off = 0;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+            sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(MULTICAST_PORT);
+            if (bind(fd, (sockaddr *)&address, sizeof(address)) < 0)
+            {
+                close(fd);
+                return false;
+            }
+            local_ = local;
+            fd_ = fd;
+            return true;
+        }
+
+        /**
+         * @brief join a channel, or stay in it if already joined
+         */
+        bool join(const sockaddr_in &channel)
+        {
+            ip_mreq membership{channel.sin_addr, local_};
+            return fd_ >= 0 && (setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == 0 || errno == EADDRINUSE);
+        }
+
+        void leave(const sockaddr_in &channel)
+        {
+            ip_mreq membership{channel.sin_addr, local_};
+            if (fd_ >= 0)
+            {
+                setsockopt(fd_, IPPROTO_IP, IP_DROP_MEMBERSHIP, &membership, sizeof(membership));
+            }
+        }
+
+        /**
+         * @brief wait up to timeout_ms for a message on any joined channel
+         * @return its length, 0 if none came, or -1
+         */
+        ssize_t receive(char *data, size_t length, int timeout_ms)
+        {
+            pollfd p{fd_, POLLIN, 0};
+            int ready = poll(&p, 1, timeout_ms);
+            if (ready <= 0)
+            {
+                return ready == 0 || errno == EINTR ? 0 : -1;
+            }
+            return recv(fd_, data, length, 0);
+        }
+
+    private:
+        int fd_ = -1;
+        in_addr local_{};
+    };
+
+}; // namespace chat
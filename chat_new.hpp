@@ -2,8 +2,12 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <cstddef>
+#include <span>
 #include <arpa/inet.h>
 
 #define MAX_USERNAME_LENGTH 64
@@ -19,16 +23,17 @@ namespace chat
     /**
      * @brief Chat protocol command types
      * @var chat_type::JOIN
-     * Client join server message
+     * Client join server message, with the cookie from a COOKIE in message
      * @var chat_type::JACK
-     * Client ACK in reply to JOIN
+     * Server ACK in reply to JOIN or RESUME, with the token for the next RESUME in message
      * @var chat_type::BROADCAST
      * Client sends message to all online users
      * @var chat_type::DIRECTMESSAGE
      * Client sends message to particlar user
      * @var chat_type::LIST
-     * Client request list of current online users
+     * Client request list of current online users, or one page of them with "limit:after:prefix" in message
      * Server sends list of current online users (might be multiple of these terminated with user END)
+     * Server sends a page as the names in message and the cursor for the next page in groupname, empty on the last
      * @var chat_type::LEAVE
      * Client requests to leave
      * Server sents to all online users that particular user has left
@@ -39,6 +44,30 @@ namespace chat
      * Server sends to all online users informing them to terminate
      * @var chat_type::ERROR
      * Server sends to client if an error has occured
+     * @var chat_type::SUBSCRIBE
+     * Client subscribes to the topic filter in groupname, which may use the + and # wildcards
+     * @var chat_type::UNSUBSCRIBE
+     * Client drops a subscription made with SUBSCRIBE
+     * @var chat_type::PUBLISH
+     * Client publishes message to the topic in groupname
+     * Server forwards it to every client subscribed to a matching filter
+     * @var chat_type::OFFER
+     * Client offers the blob "name:size" to the user in groupname, or to the server's store if groupname is empty
+     * Server forwards the offer to the recipient as "id:name:size"
+     * @var chat_type::ACCEPT
+     * Client accepts offer "id:offset", or fetches the stored blob named in groupname from "offset"
+     * Server tells each side of the transfer "id:token:offset:size", with the blob name in groupname
+     * @var chat_type::COOKIE
+     * Server sends in reply to a JOIN without a valid cookie, the client repeats the JOIN with the cookie in message
+     * @var chat_type::RESUME
+     * Client rebinds the session of username to the address it sends from, with the token from its last JACK in message
+     * @var chat_type::MULTICAST
+     * Server offers the "address:port" in message carrying groupname's messages, or broadcasts if groupname is empty
+     * Client confirms it receives the channel in groupname, and is then sent no unicast copies of it
+     * @var chat_type::REDIRECT
+     * Server sends in reply to a JOIN or RESUME for a username another node of the federation owns, with that node's "address:port" in message
+     * @var chat_type::PRESENCE
+     * Node tells the other nodes of its federation username is online with "+" in message or offline with "-", or asks for all their users with "?"
      *
      */
     enum chat_type
@@ -56,6 +85,16 @@ namespace chat
         LACK,
         EXIT,
         ERROR,
+        SUBSCRIBE,
+        UNSUBSCRIBE,
+        PUBLISH,
+        OFFER,
+        ACCEPT,
+        COOKIE,
+        RESUME,
+        MULTICAST,
+        REDIRECT,
+        PRESENCE,
         UNKNOWN,
     };
 
@@ -66,7 +105,7 @@ namespace chat
     inline bool is_valid_type(chat_type type)
     {
         // return type >= JOIN && type <= ERROR;
-        return type >= JOIN && type <= ERROR;
+        return type >= JOIN && type < UNKNOWN;
     }
 
     /**
@@ -87,6 +126,131 @@ namespace chat
         int8_t message_[MAX_MESSAGE_LENGTH];
     };
 
+    /**
+     * @brief byte layout of chat_message on the wire
+     */
+    namespace wire
+    {
+        constexpr size_t TYPE_OFFSET = offsetof(chat_message, type_);
+        constexpr size_t USERNAME_OFFSET = offsetof(chat_message, username_);
+        constexpr size_t GROUPNAME_OFFSET = offsetof(chat_message, groupname_);
+        constexpr size_t MESSAGE_OFFSET = offsetof(chat_message, message_);
+        constexpr size_t MESSAGE_SIZE = sizeof(chat_message);
+
+        static_assert(USERNAME_OFFSET + MAX_USERNAME_LENGTH == GROUPNAME_OFFSET, "chat_message must be packed");
+        static_assert(GROUPNAME_OFFSET + MAX_GROUPNAME_LENGTH == MESSAGE_OFFSET, "chat_message must be packed");
+        static_assert(MESSAGE_OFFSET + MAX_MESSAGE_LENGTH == MESSAGE_SIZE, "chat_message must be packed");
+    }; // namespace wire
+
+    /**
+     * @brief a buffer exactly one chat_message long, e.g. a send ring slot
+     */
+    typedef std::span<char, wire::MESSAGE_SIZE> message_span;
+
+    /**
+     * @brief view a chat_message as a message_span
+     */
+    inline message_span as_span(chat_message &msg)
+    {
+        return message_span{reinterpret_cast<char *>(&msg), wire::MESSAGE_SIZE};
+    }
+
+    /**
+     * @brief Copy text into a fixed size field, truncating to leave room for the NUL terminator.
+     *        The rest of the field is zeroed so a reused buffer never leaks earlier contents.
+     *
+     * @param out buffer the message is written into
+     * @param offset offset of the field within the message
+     * @param size size of the field
+     * @param text text to store
+     */
+    inline void write_field(message_span out, size_t offset, size_t size, std::string_view text)
+    {
+        size_t length = std::min(text.length(), size - 1);
+        if (length > 0)
+        {
+            memcpy(out.data() + offset, text.data(), length);
+        }
+        memset(out.data() + offset + length, 0, size - length);
+    }
+
+    /**
+     * @brief Append text to a field already written with write_field, truncating as write_field does
+     *
+     * @param out buffer the message is written into
+     * @param offset offset of the field within the message
+     * @param size size of the field
+     * @param text text to append
+     */
+    inline void append_field(message_span out, size_t offset, size_t size, std::string_view text)
+    {
+        size_t used = strnlen(out.data() + offset, size - 1);
+        size_t length = std::min(text.length(), size - 1 - used);
+        if (length > 0)
+        {
+            memcpy(out.data() + offset + used, text.data(), length);
+        }
+        out[offset + used + length] = '\0';
+    }
+
+    /**
+     * @brief Write a complete message straight into a caller provided buffer.
+     *        No temporaries are created, each field is copied exactly once and clamped to its size.
+     *
+     * @param out buffer the message is written into
+     * @param type message type
+     * @param username stored in username_
+     * @param groupname stored in groupname_
+     * @param message stored in message_
+     */
+    inline void write_message(message_span out, chat_type type, std::string_view username = {},
+                              std::string_view groupname = {}, std::string_view message = {})
+    {
+        out[wire::TYPE_OFFSET] = static_cast<char>(type);
+        write_field(out, wire::USERNAME_OFFSET, MAX_USERNAME_LENGTH, username);
+        write_field(out, wire::GROUPNAME_OFFSET, MAX_GROUPNAME_LENGTH, groupname);
+        write_field(out, wire::MESSAGE_OFFSET, MAX_MESSAGE_LENGTH, message);
+    }
+
+    /**
+     * @brief Write an ERROR message into a caller provided buffer
+     * @param out buffer the message is written into
+     * @param err code
+     */
+    inline void write_error(message_span out, uint16_t err)
+    {
+        write_message(out, ERROR);
+        uint16_t code = htons(err);
+        memcpy(out.data() + wire::MESSAGE_OFFSET, &code, sizeof(code));
+    }
+
+    /**
+     * @brief Fixed ring of message sized send buffers.
+     *
+     * Lets a sender build several messages in place and keep each alive until its send has
+     * completed, as long as fewer than Slots sends are outstanding. Not thread safe, use one
+     * ring per thread.
+     */
+    template <size_t Slots>
+    class send_ring
+    {
+        static_assert((Slots & (Slots - 1)) == 0, "send_ring size must be a power of two");
+
+    public:
+        /**
+         * @brief the next slot, reusing the oldest once the ring has wrapped
+         */
+        message_span next()
+        {
+            chat_message &slot = slots_[next_++ & (Slots - 1)];
+            return as_span(slot);
+        }
+
+    private:
+        chat_message slots_[Slots];
+        size_t next_ = 0;
+    };
+
     /**
      * @brief Creates a chat_message structure for the purpose of creating a new group, initialising it with the provided group name and username.
      *        The function ensures that the group name and username fit within predefined maximum lengths, and explicitly null-terminates these strings
@@ -98,20 +262,10 @@ namespace chat
      * @param username The username of the user creating the group. It is truncated if it exceeds MAX_USERNAME_LENGTH - 1 characters to leave space for a null terminator.
      * @return A chat_message structure populated with the type set to CREATE_GROUP, and the group name and username fields filled with the provided values, appropriately truncated and null-terminated. The message field is left empty.
      */
-    inline chat_message create_group(std::string group_name, std::string username)
+    inline chat_message create_group(std::string_view group_name, std::string_view username)
     {
         chat_message msg;
-        msg.type_ = CREATE_GROUP;
-
-        // copied string does not exceed the buffer size, leaving space for null terminator
-        size_t group_name_length = std::min(group_name.length(), static_cast<size_t>(MAX_GROUPNAME_LENGTH - 1));
-        memcpy(&msg.groupname_[0], group_name.c_str(), group_name.length());
-        msg.groupname_[group_name_length] = '\0'; // NULL terminate
-        
-        size_t username_length = std::min(username.length(), static_cast<size_t>(MAX_USERNAME_LENGTH - 1));
-        memcpy(&msg.username_[0], username.c_str(), username_length);
-        msg.username_[username_length] = '\0'; // NULL terminate
-        msg.message_[0] = '\0';
+        write_message(as_span(msg), CREATE_GROUP, username, group_name);
         return msg;
     }
 
@@ -129,21 +283,10 @@ namespace chat
      *         indicating the action to be performed. The message part of the chat_message is explicitly null-terminated but otherwise left empty as it is not needed for this operation.
      */
 
-    inline chat_message add_to_group(std::string group_name, std::string username)
+    inline chat_message add_to_group(std::string_view group_name, std::string_view username)
     {
-        chat_message msg = {};
-        // Ensure we do not exceed buffer size - 1 to leave space for null terminator
-        size_t group_name_len = std::min(group_name.length(), sizeof(msg.groupname_) - 1);
-        size_t username_len = std::min(username.length(), sizeof(msg.username_) - 1);
-
-        memcpy(msg.groupname_, group_name.c_str(), group_name_len);
-        msg.groupname_[group_name_len] = '\0'; // Explicitly null-terminate
-        memcpy(msg.username_, username.c_str(), username_len);
-        msg.username_[username_len] = '\0'; // Explicitly null-terminate
-
-        msg.type_ = ADD_TO_GROUP; // Set the message type
-        msg.message_[0] = '\0';   // Explicitly null-terminate the message part
-
+        chat_message msg;
+        write_message(as_span(msg), ADD_TO_GROUP, username, group_name);
         return msg;
     }
 
@@ -158,50 +301,37 @@ namespace chat
      * @param message The content of the message to be sent to the group. It is truncated to ensure it does not exceed MAX_MESSAGE_LENGTH - 1 characters, leaving space for a null terminator, to maintain the integrity of the message.
      * @return A chat_message object populated with the group name, username, and message content, all appropriately truncated and null-terminated. The message type is set to GROUP_MESSAGE, indicating its purpose for group communication.
      */
-    inline chat_message group_message(std::string group_name, std::string username, std::string message)
+    inline chat_message group_message(std::string_view group_name, std::string_view username, std::string_view message)
     {
         chat_message msg;
-        msg.type_ = GROUP_MESSAGE;
-
-        size_t group_name_len = std::min(group_name.length(), static_cast<size_t>(MAX_GROUPNAME_LENGTH - 1));
-        std::memcpy(msg.groupname_, group_name.c_str(), group_name_len);
-        msg.groupname_[group_name_len] = '\0'; // NULL terminate
-
-        size_t username_len = std::min(username.length(), static_cast<size_t>(MAX_USERNAME_LENGTH - 1));
-        std::memcpy(msg.username_, username.c_str(), username_len);
-        msg.username_[username_len] = '\0'; // NULL terminate
-
-        size_t message_len = std::min(message.length(), static_cast<size_t>(MAX_MESSAGE_LENGTH - 1));
-        std::memcpy(msg.message_, message.c_str(), message_len);
-        msg.message_[message_len] = '\0'; // NULL terminate
-
+        write_message(as_span(msg), GROUP_MESSAGE, username, group_name, message);
         return msg;
     }
 
     /**
      * @brief Create a JOIN message
      * @param username to be stored in the message
+     * @param cookie echoed from the server's COOKIE, empty on the first attempt
      * @return the chat message
      */
     inline chat_message
-    join_msg(std::string username)
+    join_msg(std::string_view username, std::string_view cookie = {})
     {
         chat_message msg;
-        msg.type_ = JOIN;
-        memcpy(&msg.username_[0], username.c_str(), username.length());
-        msg.username_[username.length()] = '\0';
-        msg.message_[0] = '\0';
+        write_message(as_span(msg), JOIN, username, {}, cookie);
         return msg;
     }
 
     /**
      * @brief Create a JACK message
-
+     * @param token resumption token for the client's next RESUME
      * @return the chat message
     */
-    inline chat_message jack_msg()
+    inline chat_message jack_msg(std::string_view token = {})
     {
-        return chat_message{JACK, '\0', '\0'};
+        chat_message msg;
+        write_message(as_span(msg), JACK, {}, {}, token);
+        return msg;
     }
 
     /**
@@ -210,13 +340,10 @@ namespace chat
      * @param message to be stored in the message
      * @return the chat message
      */
-    inline chat_message broadcast_msg(std::string username, std::string message)
+    inline chat_message broadcast_msg(std::string_view username, std::string_view message)
     {
-        chat_message msg{BROADCAST, '\0', '\0'};
-        memcpy(&msg.username_[0], username.c_str(), username.length());
-        msg.username_[username.length()] = '\0';
-        memcpy(&msg.message_[0], message.c_str(), message.length());
-        msg.message_[message.length()] = '\0';
+        chat_message msg;
+        write_message(as_span(msg), BROADCAST, username, {}, message);
         return msg;
     }
 
@@ -226,13 +353,10 @@ namespace chat
      * @param message to be stored in the message
      * @return the chat message
      */
-    inline chat_message dm_msg(std::string username, std::string message)
+    inline chat_message dm_msg(std::string_view username, std::string_view message)
     {
-        chat_message msg{DIRECTMESSAGE, '\0', '\0'};
-        memcpy(&msg.username_[0], username.c_str(), username.length());
-        msg.username_[username.length()] = '\0';
-        memcpy(&msg.message_[0], message.c_str(), message.length());
-        msg.message_[message.length()] = '\0';
+        chat_message msg;
+        write_message(as_span(msg), DIRECTMESSAGE, username, {}, message);
         return msg;
     }
 
@@ -242,13 +366,25 @@ namespace chat
      * @param message to be stored in the message
      * @return the chat message
      */
-    inline chat_message list_msg(std::string username = "", std::string message = "")
+    inline chat_message list_msg(std::string_view username = "", std::string_view message = "")
     {
-        chat_message msg{LIST, '\0', '\0'};
-        memcpy(&msg.username_[0], username.c_str(), username.length());
-        msg.username_[username.length()] = '\0';
-        memcpy(&msg.message_[0], message.c_str(), message.length());
-        msg.message_[message.length()] = '\0';
+        chat_message msg;
+        write_message(as_span(msg), LIST, username, {}, message);
+        return msg;
+    }
+
+    /**
+     * @brief Create a LIST message asking for one page of users
+     * @param limit most users in the page
+     * @param after cursor from the previous page, empty for the first
+     * @param prefix only users whose names start with this
+     * @return the chat message
+     */
+    inline chat_message list_page_msg(size_t limit, std::string_view after, std::string_view prefix = {})
+    {
+        std::string query = std::to_string(limit) + ":" + std::string{after} + ":" + std::string{prefix};
+        chat_message msg;
+        write_message(as_span(msg), LIST, {}, {}, query);
         return msg;
     }
 
@@ -279,6 +415,138 @@ namespace chat
         return chat_message{EXIT, '\0', '\0'};
     }
 
+    /**
+     * @brief Create a SUBSCRIBE message
+     * @param username subscribing user
+     * @param filter topic filter, e.g. site/+/temp or site/#
+     * @return the chat message
+     */
+    inline chat_message subscribe_msg(std::string_view username, std::string_view filter)
+    {
+        chat_message msg;
+        write_message(as_span(msg), SUBSCRIBE, username, filter);
+        return msg;
+    }
+
+    /**
+     * @brief Create an UNSUBSCRIBE message
+     * @param username unsubscribing user
+     * @param filter topic filter given when subscribing
+     * @return the chat message
+     */
+    inline chat_message unsubscribe_msg(std::string_view username, std::string_view filter)
+    {
+        chat_message msg;
+        write_message(as_span(msg), UNSUBSCRIBE, username, filter);
+        return msg;
+    }
+
+    /**
+     * @brief Create a PUBLISH message
+     * @param username publishing user
+     * @param topic topic published to, e.g. site/floor3/temp
+     * @param message to be stored in the message
+     * @return the chat message
+     */
+    inline chat_message publish_msg(std::string_view username, std::string_view topic, std::string_view message)
+    {
+        chat_message msg;
+        write_message(as_span(msg), PUBLISH, username, topic, message);
+        return msg;
+    }
+
+    /**
+     * @brief Create an OFFER message
+     * @param username offering user, or the sender when forwarded by the server
+     * @param recipient user offered the blob, empty to store it on the server
+     * @param offer "name:size", or "id:name:size" when forwarded by the server
+     * @return the chat message
+     */
+    inline chat_message offer_msg(std::string_view username, std::string_view recipient, std::string_view offer)
+    {
+        chat_message msg;
+        write_message(as_span(msg), OFFER, username, recipient, offer);
+        return msg;
+    }
+
+    /**
+     * @brief Create an ACCEPT message
+     * @param username accepting user, or the server's peer when sent by the server
+     * @param name blob to fetch from the store, or the name of the blob transferred when sent by the server
+     * @param accept "id:offset", "offset" when fetching, or "id:token:offset:size" when sent by the server
+     * @return the chat message
+     */
+    inline chat_message accept_msg(std::string_view username, std::string_view name, std::string_view accept)
+    {
+        chat_message msg;
+        write_message(as_span(msg), ACCEPT, username, name, accept);
+        return msg;
+    }
+
+    /**
+     * @brief Create a COOKIE message
+     * @param cookie to be echoed in the client's next JOIN
+     * @return the chat message
+     */
+    inline chat_message cookie_msg(std::string_view cookie)
+    {
+        chat_message msg;
+        write_message(as_span(msg), COOKIE, {}, {}, cookie);
+        return msg;
+    }
+
+    /**
+     * @brief Create a RESUME message
+     * @param username whose session to resume
+     * @param token from the last JACK
+     * @return the chat message
+     */
+    inline chat_message resume_msg(std::string_view username, std::string_view token)
+    {
+        chat_message msg;
+        write_message(as_span(msg), RESUME, username, {}, token);
+        return msg;
+    }
+
+    /**
+     * @brief Create a MULTICAST message
+     * @param username confirming the channel, empty in an offer
+     * @param channel group of the channel, empty for broadcasts
+     * @param address "address:port" of the channel in an offer, empty in a confirmation
+     * @return the chat message
+     */
+    inline chat_message multicast_msg(std::string_view username, std::string_view channel, std::string_view address = {})
+    {
+        chat_message msg;
+        write_message(as_span(msg), MULTICAST, username, channel, address);
+        return msg;
+    }
+
+    /**
+     * @brief Create a REDIRECT message
+     * @param node "address:port" of the node owning the username
+     * @return the chat message
+     */
+    inline chat_message redirect_msg(std::string_view node)
+    {
+        chat_message msg;
+        write_message(as_span(msg), REDIRECT, {}, {}, node);
+        return msg;
+    }
+
+    /**
+     * @brief Create a PRESENCE message
+     * @param username online or offline, empty when asking
+     * @param state "+" online, "-" offline or "?" asking for every user of the receiving node
+     * @return the chat message
+     */
+    inline chat_message presence_msg(std::string_view username, std::string_view state)
+    {
+        chat_message msg;
+        write_message(as_span(msg), PRESENCE, username, {}, state);
+        return msg;
+    }
+
     /**
      * @brief Create a ERROR message
      * @param err code
@@ -286,8 +554,8 @@ namespace chat
      */
     inline chat_message error_msg(uint16_t err)
     {
-        chat_message msg{ERROR, '\0'};
-        *((int *)(&msg.message_[0])) = htons(err);
+        chat_message msg;
+        write_error(as_span(msg), err);
         return msg;
     }
 
@@ -304,5 +572,8 @@ namespace chat
 #define ERR_USER_ALREADY_IN_GROUP 4
 #define ERR_GROUP_NOT_FOUND 5
 #define ERR_USER_NOT_IN_GROUP 6
+#define ERR_INVALID_TOPIC 7
+#define ERR_TRANSFER_REFUSED 8
+#define ERR_RESUME_REFUSED 9
 
 }; // namespace chat
\ No newline at end of file
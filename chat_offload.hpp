@@ -0,0 +1,306 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "chat_stats.hpp"
+
+// options of kernels from 4.18 (UDP_SEGMENT) and 5.0 (UDP_GRO), for older headers
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// segments the kernel accepts in one segmented send, its UDP_MAX_SEGMENTS
+#define OFFLOAD_MAX_SEGMENTS 64
+// largest payload of one segmented send, UDP's own limit
+#define OFFLOAD_MAX_BYTES 65507
+// datagrams taken by one recvmmsg
+#define OFFLOAD_RECEIVE_BATCH 8
+// bytes of each receive buffer, room for a whole run of segments coalesced by GRO
+#define OFFLOAD_RECEIVE_BUFFER 65536
+
+namespace chat
+{
+
+    /**
+     * @brief A kernel UDP socket using segmentation and receive offload where the kernel has them.
+     *
+     * Until open is called, or if it fails, everything goes to the fallback socket, so the
+     * server only leaves the simulated socket when asked to. Once open:
+     *
+     * - send_segments sends a run of equal size datagrams to one address with a single
+     *   sendmsg carrying UDP_SEGMENT, which the kernel splits, or one sendto each without GSO.
+     * - recvfrom reads up to OFFLOAD_RECEIVE_BATCH datagrams per recvmmsg and hands them out
+     *   one per call. With UDP_GRO the kernel may coalesce a run of datagrams from one sender
+     *   into one buffer, which is split back into the datagrams here.
+     *
+     * @tparam Fallback datagram socket providing sendto and recvfrom, e.g. uwe::socket
+     */
+    template <typename Fallback>
+    class offload_socket
+    {
+    public:
+        explicit offload_socket(Fallback &fallback)
+            : fallback_{fallback}, gso_sends_{"offload.gso_sends"}, gso_segments_{"offload.gso_segments"},
+              gso_failures_{"offload.gso_failures"}, receive_batches_{"offload.receive_batches"},
+              gro_coalesced_{"offload.gro_coalesced"}, gro_segments_{"offload.gro_segments"},
+              send_ns_{"offload.send_ns_per_datagram"} {}
+
+        ~offload_socket()
+        {
+            if (fd_ >= 0)
+            {
+                close(fd_);
+            }
+        }
+
+        offload_socket(const offload_socket &) = delete;
+        offload_socket &operator=(const offload_socket &) = delete;
+
+        /**
+         * @brief bind a kernel UDP socket to address and use it from now on
+         * @param offload turn on GSO and GRO if the kernel supports them, or leave them off to compare
+         * @return false if the socket could not be bound, the fallback is then still used
+         */
+        bool open(const sockaddr_in &address, bool offload)
+        {
+            int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd < 0)
+            {
+                return false;
+            }
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, (const sockaddr *)&address, sizeof(address)) < 0)
+            {
+                close(fd);
+                return false;
+            }
+            if (offload)
+            {
+                // a segment size of 0 leaves sends unsegmented, it only fails if UDP_SEGMENT is unknown
+                int none = 0;
+                gso_.store(setsockopt(fd, SOL_UDP, UDP_SEGMENT, &none, sizeof(none)) == 0, std::memory_order_relaxed);
+                gro_ = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+            }
+            slots_.reset(new slot[OFFLOAD_RECEIVE_BATCH]);
+            fd_ = fd;
+            return true;
+        }
+
+        bool gso() const
+        {
+            return gso_.load(std::memory_order_relaxed);
+        }
+
+        bool gro() const
+        {
+            return gro_;
+        }
+
+        ssize_t sendto(const char *data, size_t length, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            if (fd_ < 0)
+            {
+                return fallback_.sendto(data, length, flags, to, to_length);
+            }
+            return ::sendto(fd_, data, length, flags, to, to_length);
+        }
+
+        /**
+         * @brief send count datagrams of segment bytes each, laid out one after another in data, to one address
+         * @return bytes sent, or -1 if nothing could be sent
+         */
+        ssize_t send_segments(const char *data, size_t segment, size_t count, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            auto started = std::chrono::steady_clock::now();
+            size_t per_send = std::min<size_t>(OFFLOAD_MAX_SEGMENTS, OFFLOAD_MAX_BYTES / segment);
+            size_t sent = 0;
+            while (sent < count)
+            {
+                size_t n = std::min(per_send, count - sent);
+                const char *first = data + sent * segment;
+                if (n > 1 && gso() && send_segmented(first, segment, n, flags, to, to_length))
+                {
+                    sent += n;
+                    continue;
+                }
+                for (size_t i = 0; i < n; i++)
+                {
+                    sendto(first + i * segment, segment, flags, to, to_length);
+                }
+                sent += n;
+            }
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+            send_ns_.record(count > 0 ? static_cast<uint64_t>(elapsed.count()) / count : 0);
+            return static_cast<ssize_t>(count * segment);
+        }
+
+        /**
+         * @brief receive the next datagram, from one thread only
+         * @return its size, truncated to length like a datagram, or -1
+         */
+        ssize_t recvfrom(char *data, size_t length, int flags, sockaddr *from, size_t *from_length)
+        {
+            if (fd_ < 0)
+            {
+                return fallback_.recvfrom(data, length, flags, from, from_length);
+            }
+            while (next_ == received_)
+            {
+                if (!receive_batch(flags))
+                {
+                    return -1;
+                }
+            }
+            slot &s = slots_[next_];
+            size_t size = std::min(s.segment_, s.length_ - offset_);
+            memcpy(data, s.data_ + offset_, std::min(length, size));
+            if (from != nullptr && from_length != nullptr)
+            {
+                memcpy(from, &s.from_, std::min(*from_length, sizeof(s.from_)));
+                *from_length = sizeof(s.from_);
+            }
+            offset_ += size;
+            if (offset_ >= s.length_)
+            {
+                next_++;
+                offset_ = 0;
+            }
+            return static_cast<ssize_t>(std::min(length, size));
+        }
+
+    private:
+        struct slot
+        {
+            char data_[OFFLOAD_RECEIVE_BUFFER];
+            char control_[CMSG_SPACE(sizeof(int))];
+            sockaddr_in from_;
+            size_t length_;
+            size_t segment_; // size of each datagram GRO coalesced into data_, or length_
+        };
+
+        bool send_segmented(const char *data, size_t segment, size_t count, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            iovec iov{const_cast<char *>(data), segment * count};
+            char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+            msghdr m{};
+            m.msg_name = const_cast<sockaddr *>(to);
+            m.msg_namelen = to_length;
+            m.msg_iov = &iov;
+            m.msg_iovlen = 1;
+            m.msg_control = control;
+            m.msg_controllen = sizeof(control);
+            cmsghdr *c = CMSG_FIRSTHDR(&m);
+            c->cmsg_level = SOL_UDP;
+            c->cmsg_type = UDP_SEGMENT;
+            c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t size = static_cast<uint16_t>(segment);
+            memcpy(CMSG_DATA(c), &size, sizeof(size));
+            if (sendmsg(fd_, &m, flags) < 0)
+            {
+                // EIO is a device without checksum offload, later sends go one by one
+                gso_failures_.add();
+                if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)
+                {
+                    gso_.store(false, std::memory_order_relaxed);
+                }
+                return false;
+            }
+            gso_sends_.add();
+            gso_segments_.add(count);
+            return true;
+        }
+
+        /**
+         * @brief wait for at least one datagram and take as many more as are ready
+         */
+        bool receive_batch(int flags)
+        {
+            mmsghdr headers[OFFLOAD_RECEIVE_BATCH];
+            iovec iov[OFFLOAD_RECEIVE_BATCH];
+            memset(headers, 0, sizeof(headers));
+            for (int i = 0; i < OFFLOAD_RECEIVE_BATCH; i++)
+            {
+                iov[i] = iovec{slots_[i].data_, sizeof(slots_[i].data_)};
+                msghdr &m = headers[i].msg_hdr;
+                m.msg_name = &slots_[i].from_;
+                m.msg_namelen = sizeof(slots_[i].from_);
+                m.msg_iov = &iov[i];
+                m.msg_iovlen = 1;
+                m.msg_control = slots_[i].control_;
+                m.msg_controllen = sizeof(slots_[i].control_);
+            }
+            int n;
+            do
+            {
+                n = recvmmsg(fd_, headers, OFFLOAD_RECEIVE_BATCH, flags | MSG_WAITFORONE, nullptr);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+            {
+                return false;
+            }
+            receive_batches_.add();
+            for (int i = 0; i < n; i++)
+            {
+                slot &s = slots_[i];
+                s.length_ = headers[i].msg_len;
+                s.segment_ = s.length_;
+                msghdr &m = headers[i].msg_hdr;
+                for (cmsghdr *c = CMSG_FIRSTHDR(&m); c != nullptr; c = CMSG_NXTHDR(&m, c))
+                {
+                    if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+                    {
+                        int size;
+                        memcpy(&size, CMSG_DATA(c), sizeof(size));
+                        if (size > 0 && static_cast<size_t>(size) < s.length_)
+                        {
+                            s.segment_ = static_cast<size_t>(size);
+                            gro_coalesced_.add();
+                            gro_segments_.add((s.length_ + s.segment_ - 1) / s.segment_);
+                        }
+                    }
+                }
+            }
+            received_ = static_cast<unsigned>(n);
+            next_ = 0;
+            offset_ = 0;
+            return true;
+        }
+
+        Fallback &fallback_;
+        int fd_ = -1;
+        std::atomic<bool> gso_{false};
+        bool gro_ = false;
+
+        std::unique_ptr<slot[]> slots_;
+        unsigned received_ = 0; // slots filled by the last batch
+        unsigned next_ = 0;     // slot the next datagram comes from
+        size_t offset_ = 0;     // of the next datagram in that slot
+
+        counter gso_sends_;
+        counter gso_segments_;
+        counter gso_failures_;
+        counter receive_batches_;
+        counter gro_coalesced_;
+        counter gro_segments_;
+        histogram send_ns_;
+    };
+
+}; // namespace chat
@@ -0,0 +1,540 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// number of recipients sent to by a single stealable fan-out chunk
+#define FAN_OUT_CHUNK 256
+// bytes of captured state a pool task can hold without allocating
+#define SMALL_TASK_SIZE 64
+// priority levels of ordered tasks, 0 is the most urgent
+#define PRIORITY_LEVELS 3
+// ordered tasks of a level run per round of the weighted scheduler: 16, 4 and 1
+#define PRIORITY_WEIGHT(level) (1u << (2 * (PRIORITY_LEVELS - 1 - (level))))
+// buckets of keys per worker, each remembering the level its queued ordered tasks are at
+#define ORDER_BUCKETS 256
+
+namespace chat
+{
+
+    /**
+     * @brief Move-only void() callable stored inline.
+     *
+     * Unlike std::function it never allocates; callables larger than SMALL_TASK_SIZE are
+     * rejected at compile time, so large state has to be passed by pointer.
+     */
+    class small_task
+    {
+    public:
+        small_task() = default;
+
+        template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, small_task>>>
+        small_task(F &&f)
+        {
+            typedef std::decay_t<F> D;
+            static_assert(sizeof(D) <= SMALL_TASK_SIZE, "task captures too much state, pass it by pointer");
+            static_assert(alignof(D) <= alignof(std::max_align_t), "task capture is over aligned");
+            new (storage_) D(std::forward<F>(f));
+            ops_ = &ops_for<D>;
+        }
+
+        small_task(small_task &&other) noexcept
+        {
+            take(other);
+        }
+
+        small_task &operator=(small_task &&other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                take(other);
+            }
+            return *this;
+        }
+
+        ~small_task()
+        {
+            reset();
+        }
+
+        void operator()()
+        {
+            ops_->invoke_(storage_);
+        }
+
+        explicit operator bool() const
+        {
+            return ops_ != nullptr;
+        }
+
+    private:
+        struct ops
+        {
+            void (*invoke_)(void *);
+            void (*move_)(void *, void *);
+            void (*destroy_)(void *);
+        };
+
+        template <typename D>
+        static constexpr ops ops_for = {
+            [](void *p)
+            { (*static_cast<D *>(p))(); },
+            [](void *dst, void *src)
+            { new (dst) D(std::move(*static_cast<D *>(src))); },
+            [](void *p)
+            { static_cast<D *>(p)->~D(); }};
+
+        void take(small_task &other)
+        {
+            if (other.ops_ != nullptr)
+            {
+                other.ops_->move_(storage_, other.storage_);
+                ops_ = other.ops_;
+                other.reset();
+            }
+        }
+
+        void reset()
+        {
+            if (ops_ != nullptr)
+            {
+                ops_->destroy_(storage_);
+                ops_ = nullptr;
+            }
+        }
+
+        alignas(std::max_align_t) unsigned char storage_[SMALL_TASK_SIZE];
+        const ops *ops_ = nullptr;
+    };
+
+    /**
+     * @brief Growable ring buffer of tasks usable from both ends.
+     *
+     * Capacity only ever doubles, so once a queue has reached its working size pushing and
+     * popping do not allocate.
+     *
+     * @tparam T element, a small_task or one with what its queue needs to know about it
+     */
+    template <typename T = small_task>
+    class task_ring
+    {
+    public:
+        bool empty() const { return size_ == 0; }
+        size_t size() const { return size_; }
+
+        void push_back(T t)
+        {
+            if (size_ == slots_.size())
+            {
+                grow();
+            }
+            slots_[(head_ + size_) & (slots_.size() - 1)] = std::move(t);
+            size_++;
+        }
+
+        T pop_front()
+        {
+            T t = std::move(slots_[head_]);
+            head_ = (head_ + 1) & (slots_.size() - 1);
+            size_--;
+            return t;
+        }
+
+        T pop_back()
+        {
+            size_--;
+            return std::move(slots_[(head_ + size_) & (slots_.size() - 1)]);
+        }
+
+    private:
+        void grow()
+        {
+            std::vector<T> bigger(slots_.empty() ? 64 : slots_.size() * 2);
+            for (size_t i = 0; i < size_; i++)
+            {
+                bigger[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+            }
+            slots_.swap(bigger);
+            head_ = 0;
+        }
+
+        std::vector<T> slots_;
+        size_t head_ = 0;
+        size_t size_ = 0;
+    };
+
+    /**
+     * @brief Work-stealing pool for running message handlers off the receive thread.
+     *
+     * Every worker owns ordered queues and a stealable deque. The ordered queues are FIFO,
+     * one per priority level, and are only ever drained by their owner. The owner drains
+     * them by weighted round robin: each round runs up to PRIORITY_WEIGHT tasks of a level,
+     * most urgent first, so urgent tasks overtake a backlog without starving it. Tasks with
+     * the same key still run in submission order whatever their priority: a task for a key
+     * that has tasks queued joins them at their level, so only another key's tasks are
+     * overtaken. Keys are tracked in ORDER_BUCKETS buckets per worker, keys sharing a
+     * bucket are ordered together.
+     * The stealable deque is used for independent work such as fan-out chunks; the owner
+     * pops from the back and idle workers steal from the front.
+     */
+    class work_pool
+    {
+    public:
+        typedef small_task task;
+
+        /**
+         * @brief start the pool
+         * @param threads number of worker threads, at least one is always started
+         */
+        explicit work_pool(unsigned threads)
+        {
+            if (threads == 0)
+            {
+                threads = 1;
+            }
+            for (unsigned i = 0; i < threads; i++)
+            {
+                workers_.emplace_back(new worker{});
+            }
+            for (unsigned i = 0; i < threads; i++)
+            {
+                workers_[i]->thread_ = std::thread{[this, i]()
+                                                   { run(i); }};
+            }
+        }
+
+        ~work_pool()
+        {
+            stop();
+        }
+
+        work_pool(const work_pool &) = delete;
+        work_pool &operator=(const work_pool &) = delete;
+
+        /**
+         * @brief number of worker threads
+         */
+        unsigned size() const
+        {
+            return static_cast<unsigned>(workers_.size());
+        }
+
+        /**
+         * @brief tasks submitted and not yet finished, how far the workers are behind
+         */
+        size_t backlog() const
+        {
+            return outstanding_.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief queue a task that must run after every earlier task with the same key
+         * @param key ordering key, e.g. derived from the sender address
+         * @param t task to run
+         * @param priority level below PRIORITY_LEVELS, 0 is the most urgent, used if the key has nothing queued
+         */
+        void submit_ordered(uint64_t key, task t, unsigned priority = 0)
+        {
+            worker &w = *workers_[key % workers_.size()];
+            unsigned bucket = static_cast<unsigned>((key / workers_.size()) % ORDER_BUCKETS);
+            outstanding_.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock{w.mutex_};
+                order_bucket &b = w.buckets_[bucket];
+                if (b.queued_ == 0)
+                {
+                    b.level_ = std::min(priority, PRIORITY_LEVELS - 1u);
+                }
+                b.queued_++;
+                w.ordered_[b.level_].push_back(ordered_task{bucket, std::move(t)});
+                w.pinned_.fetch_add(1, std::memory_order_seq_cst);
+            }
+            wake(w);
+        }
+
+        /**
+         * @brief queue an independent task that any worker may steal
+         * @param t task to run
+         */
+        void submit(task t)
+        {
+            int self = current_index();
+            unsigned target = self >= 0 ? static_cast<unsigned>(self)
+                                        : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+            worker &w = *workers_[target];
+            outstanding_.fetch_add(1, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock{w.mutex_};
+                w.stealable_.push_back(std::move(t));
+                stealable_.fetch_add(1, std::memory_order_seq_cst);
+            }
+
+            // wake one sleeping worker so the task can be stolen
+            for (auto &other : workers_)
+            {
+                if (other->sleeping_.load(std::memory_order_seq_cst))
+                {
+                    wake(*other);
+                    break;
+                }
+            }
+        }
+
+        /**
+         * @brief run f over [0, count) split into stealable chunks of at most grain items
+         *
+         * The caller runs the first chunk itself and then helps with stealable work until
+         * every chunk has finished, so it is safe to pass state that lives on its stack.
+         *
+         * @param count number of items
+         * @param grain maximum number of items per chunk
+         * @param f callable taking (begin, end)
+         */
+        template <typename F>
+        void parallel_for(size_t count, size_t grain, F &&f)
+        {
+            if (grain == 0 || count <= grain || workers_.size() == 1)
+            {
+                f(size_t{0}, count);
+                return;
+            }
+
+            size_t chunks = (count + grain - 1) / grain;
+            std::atomic<size_t> remaining{chunks - 1};
+            for (size_t c = 1; c < chunks; c++)
+            {
+                size_t begin = c * grain;
+                size_t end = std::min(begin + grain, count);
+                submit([&f, &remaining, begin, end]()
+                       {
+                           f(begin, end);
+                           remaining.fetch_sub(1, std::memory_order_release); });
+            }
+
+            f(size_t{0}, std::min(grain, count));
+
+            while (remaining.load(std::memory_order_acquire) > 0)
+            {
+                if (!run_stealable(current_index()))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        /**
+         * @brief block until every submitted task has run
+         */
+        void wait_idle()
+        {
+            std::unique_lock<std::mutex> lock{idle_mutex_};
+            idle_cv_.wait(lock, [this]()
+                          { return outstanding_.load(std::memory_order_acquire) == 0; });
+        }
+
+        /**
+         * @brief run all queued tasks and join the workers
+         */
+        void stop()
+        {
+            if (stopping_.exchange(true))
+            {
+                return;
+            }
+            for (auto &w : workers_)
+            {
+                wake(*w);
+            }
+            for (auto &w : workers_)
+            {
+                if (w->thread_.joinable())
+                {
+                    w->thread_.join();
+                }
+            }
+        }
+
+    private:
+        struct ordered_task
+        {
+            unsigned bucket_ = 0;
+            task task_;
+        };
+
+        struct order_bucket
+        {
+            unsigned queued_ = 0; // ordered tasks of the bucket's keys not yet started
+            unsigned level_ = 0;  // where they are all queued
+        };
+
+        struct worker
+        {
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            task_ring<ordered_task> ordered_[PRIORITY_LEVELS];
+            unsigned credit_[PRIORITY_LEVELS] = {}; // tasks each level may still run this round
+            order_bucket buckets_[ORDER_BUCKETS];
+            task_ring<> stealable_;
+            std::atomic<size_t> pinned_{0};
+            std::atomic<bool> sleeping_{false};
+            std::thread thread_;
+        };
+
+        /**
+         * @brief index of the worker running on the calling thread, or -1
+         */
+        static int &current_index()
+        {
+            thread_local int index = -1;
+            return index;
+        }
+
+        void wake(worker &w)
+        {
+            std::lock_guard<std::mutex> lock{w.mutex_};
+            w.cv_.notify_one();
+        }
+
+        void finished()
+        {
+            if (outstanding_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> lock{idle_mutex_};
+                idle_cv_.notify_all();
+            }
+        }
+
+        bool pop_ordered(worker &w, task &t)
+        {
+            std::lock_guard<std::mutex> lock{w.mutex_};
+            for (int round = 0; round < 2; round++)
+            {
+                for (unsigned level = 0; level < PRIORITY_LEVELS; level++)
+                {
+                    if (w.credit_[level] > 0 && !w.ordered_[level].empty())
+                    {
+                        w.credit_[level]--;
+                        ordered_task o = w.ordered_[level].pop_front();
+                        w.buckets_[o.bucket_].queued_--;
+                        t = std::move(o.task_);
+                        w.pinned_.fetch_sub(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                // every level with work has used its share, start a new round
+                for (unsigned level = 0; level < PRIORITY_LEVELS; level++)
+                {
+                    w.credit_[level] = PRIORITY_WEIGHT(level);
+                }
+            }
+            return false;
+        }
+
+        static bool ordered_empty(const worker &w)
+        {
+            for (const auto &ring : w.ordered_)
+            {
+                if (!ring.empty())
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool pop_stealable(worker &w, task &t, bool owner)
+        {
+            std::lock_guard<std::mutex> lock{w.mutex_};
+            if (w.stealable_.empty())
+            {
+                return false;
+            }
+            if (owner)
+            {
+                t = w.stealable_.pop_back();
+            }
+            else
+            {
+                t = w.stealable_.pop_front();
+            }
+            stealable_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        /**
+         * @brief run one stealable task, preferring the caller's own deque
+         * @param self worker index of the caller, or -1 for a non pool thread
+         * @return true if a task was run
+         */
+        bool run_stealable(int self)
+        {
+            task t;
+            bool found = self >= 0 && pop_stealable(*workers_[self], t, true);
+            for (size_t i = 1; !found && i <= workers_.size(); i++)
+            {
+                size_t victim = (static_cast<size_t>(self < 0 ? 0 : self) + i) % workers_.size();
+                found = pop_stealable(*workers_[victim], t, false);
+            }
+            if (found)
+            {
+                t();
+                finished();
+            }
+            return found;
+        }
+
+        void run(unsigned self)
+        {
+            current_index() = static_cast<int>(self);
+            worker &w = *workers_[self];
+            for (;;)
+            {
+                task t;
+                if (pop_ordered(w, t))
+                {
+                    t();
+                    finished();
+                    continue;
+                }
+                if (run_stealable(static_cast<int>(self)))
+                {
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock{w.mutex_};
+                w.sleeping_.store(true, std::memory_order_seq_cst);
+                w.cv_.wait(lock, [this, &w]()
+                           { return stopping_.load() ||
+                                    w.pinned_.load(std::memory_order_seq_cst) > 0 ||
+                                    stealable_.load(std::memory_order_seq_cst) > 0; });
+                w.sleeping_.store(false, std::memory_order_relaxed);
+                if (stopping_.load() && ordered_empty(w) &&
+                    stealable_.load(std::memory_order_seq_cst) == 0)
+                {
+                    return;
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<worker>> workers_;
+        std::atomic<size_t> stealable_{0};
+        std::atomic<size_t> outstanding_{0};
+        std::atomic<unsigned> next_{0};
+        std::atomic<bool> stopping_{false};
+        std::mutex idle_mutex_;
+        std::condition_variable idle_cv_;
+    };
+
+}; // namespace chat
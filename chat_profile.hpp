@@ -0,0 +1,266 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// spans kept per thread, older spans are overwritten once a thread has recorded this many
+#define PROFILE_SPANS 16384
+// signal that makes the server write its spans out as a Chrome trace
+#define PROFILE_SIGNAL SIGRTMIN
+
+namespace chat
+{
+
+    /**
+     * @brief Ring of the most recent spans recorded by one thread.
+     *
+     * Only the owning thread records. Fields are relaxed atomics so the profiler can copy
+     * the ring while it is being written, spans overwritten during the copy are discarded.
+     */
+    class span_buffer
+    {
+    public:
+        explicit span_buffer(long tid) : tid_{tid} {}
+
+        void record(const char *name, uint64_t begin, uint64_t end)
+        {
+            uint64_t head = head_.load(std::memory_order_relaxed);
+            span &s = spans_[head % PROFILE_SPANS];
+            s.name_.store(name, std::memory_order_relaxed);
+            s.begin_.store(begin, std::memory_order_relaxed);
+            s.end_.store(end, std::memory_order_relaxed);
+            head_.store(head + 1, std::memory_order_release);
+        }
+
+        /**
+         * @brief call f(name, begin, end) for every span still in the ring, oldest first
+         */
+        template <typename F>
+        void for_each(F &&f) const
+        {
+            uint64_t head = head_.load(std::memory_order_acquire);
+            uint64_t first = head > PROFILE_SPANS ? head - PROFILE_SPANS : 0;
+            std::vector<std::pair<const char *, std::pair<uint64_t, uint64_t>>> copy;
+            copy.reserve(head - first);
+            for (uint64_t i = first; i < head; i++)
+            {
+                const span &s = spans_[i % PROFILE_SPANS];
+                copy.push_back({s.name_.load(std::memory_order_relaxed),
+                                {s.begin_.load(std::memory_order_relaxed), s.end_.load(std::memory_order_relaxed)}});
+            }
+            // anything the owner may have overwritten while we copied is not trusted
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t now = head_.load(std::memory_order_relaxed);
+            uint64_t valid = now > PROFILE_SPANS ? now - PROFILE_SPANS : 0;
+            for (uint64_t i = std::max(first, valid); i < head; i++)
+            {
+                const auto &c = copy[i - first];
+                f(c.first, c.second.first, c.second.second);
+            }
+        }
+
+        long tid() const { return tid_; }
+
+        std::atomic<bool> retired_{false};
+
+    private:
+        struct span
+        {
+            std::atomic<const char *> name_{nullptr};
+            std::atomic<uint64_t> begin_{0};
+            std::atomic<uint64_t> end_{0};
+        };
+
+        long tid_;
+        std::atomic<uint64_t> head_{0};
+        span spans_[PROFILE_SPANS];
+    };
+
+    /**
+     * @brief Process wide span profiler.
+     *
+     * Off unless CHAT_PROFILE is set in the environment or enable() is called; while off a
+     * profile_span costs one relaxed load. Spans are buffered per thread and written out on
+     * request as Chrome trace event JSON, which chrome://tracing and Perfetto open directly.
+     */
+    class profiler
+    {
+    public:
+        static profiler &instance()
+        {
+            static profiler p;
+            return p;
+        }
+
+        static bool enabled()
+        {
+            return instance().enabled_.load(std::memory_order_relaxed);
+        }
+
+        void enable(bool on)
+        {
+            enabled_.store(on, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief monotonic clock spans are measured with, in nanoseconds
+         */
+        static uint64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        }
+
+        /**
+         * @brief add a span to the calling thread's buffer
+         * @param name static string naming the span
+         */
+        void record(const char *name, uint64_t begin, uint64_t end)
+        {
+            thread_buffer().record(name, begin, end);
+        }
+
+        /**
+         * @brief write every buffered span as Chrome trace JSON
+         * @param out stream to write to
+         * @return number of spans written
+         */
+        size_t dump(FILE *out)
+        {
+            std::vector<std::shared_ptr<span_buffer>> buffers;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                buffers = buffers_;
+                // threads that have exited are written this once and then forgotten
+                buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [](const std::shared_ptr<span_buffer> &b)
+                                              { return b->retired_.load(std::memory_order_acquire); }),
+                               buffers_.end());
+            }
+
+            size_t written = 0;
+            long pid = static_cast<long>(getpid());
+            fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+            for (auto &b : buffers)
+            {
+                long tid = b->tid();
+                b->for_each([&](const char *name, uint64_t begin, uint64_t end)
+                            {
+                                fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+                                        written == 0 ? "" : ",", name, pid, tid,
+                                        begin / 1000.0, (end - begin) / 1000.0);
+                                written++; });
+            }
+            fprintf(out, "\n]}\n");
+            fflush(out);
+            return written;
+        }
+
+        /**
+         * @brief write every buffered span to a new chat_trace_<pid>_<n>.json in the working directory
+         * @return name of the file written, empty if it could not be created
+         */
+        std::string dump_to_file()
+        {
+            std::string name = "chat_trace_" + std::to_string(getpid()) + "_" +
+                               std::to_string(dumps_.fetch_add(1)) + ".json";
+            FILE *out = fopen(name.c_str(), "w");
+            if (out == nullptr)
+            {
+                return {};
+            }
+            dump(out);
+            fclose(out);
+            return name;
+        }
+
+    private:
+        profiler()
+        {
+            enabled_.store(getenv("CHAT_PROFILE") != nullptr);
+        }
+
+        /**
+         * @brief owns a thread's buffer and marks it retired when the thread exits
+         */
+        struct buffer_holder
+        {
+            std::shared_ptr<span_buffer> buffer_;
+
+            ~buffer_holder()
+            {
+                buffer_->retired_.store(true, std::memory_order_release);
+            }
+        };
+
+        span_buffer &thread_buffer()
+        {
+            thread_local buffer_holder holder{attach()};
+            return *holder.buffer_;
+        }
+
+        std::shared_ptr<span_buffer> attach()
+        {
+            auto buffer = std::make_shared<span_buffer>(static_cast<long>(syscall(SYS_gettid)));
+            std::lock_guard<std::mutex> lock{mutex_};
+            buffers_.push_back(buffer);
+            return buffer;
+        }
+
+        std::atomic<bool> enabled_{false};
+        std::atomic<unsigned> dumps_{0};
+        std::mutex mutex_;
+        std::vector<std::shared_ptr<span_buffer>> buffers_;
+    };
+
+    /**
+     * @brief RAII span, records the time between construction and destruction when profiling is on
+     */
+    class profile_span
+    {
+    public:
+        /**
+         * @param name static string naming the span, it is stored by pointer
+         */
+        explicit profile_span(const char *name)
+        {
+            if (profiler::enabled())
+            {
+                name_ = name;
+                begin_ = profiler::now();
+            }
+        }
+
+        ~profile_span()
+        {
+            if (name_ != nullptr)
+            {
+                profiler::instance().record(name_, begin_, profiler::now());
+            }
+        }
+
+        profile_span(const profile_span &) = delete;
+        profile_span &operator=(const profile_span &) = delete;
+
+    private:
+        const char *name_ = nullptr;
+        uint64_t begin_ = 0;
+    };
+
+}; // namespace chat
+
+/**
+ * @brief span covering the rest of the enclosing function, named after it
+ */
+#define PROFILE_FUNCTION() chat::profile_span profile_function_span_{__func__}
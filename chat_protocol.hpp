@@ -0,0 +1,211 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+
+#include "chat_new.hpp"
+#include "chat_profile.hpp"
+
+namespace chat
+{
+
+    /**
+     * @brief Fields of chat_message a message type carries, combined as a bit mask
+     */
+    enum message_field : unsigned
+    {
+        FIELD_NONE = 0,
+        FIELD_USERNAME = 1 << 0,
+        FIELD_GROUPNAME = 1 << 1,
+        FIELD_MESSAGE = 1 << 2,
+    };
+
+    /**
+     * @brief chat_message with its text fields decoded into bounded views
+     *
+     * Fields a message type does not carry are left empty. Views point into the received
+     * packet and are valid for as long as it is.
+     */
+    struct decoded_message
+    {
+        chat_type type_;
+        std::string_view username_;
+        std::string_view groupname_;
+        std::string_view message_;
+    };
+
+    /**
+     * @brief Outcome of dispatching a received message
+     * @var dispatch_result::DISPATCHED
+     * Handler was run
+     * @var dispatch_result::UNKNOWN_TYPE
+     * No route for the message type
+     * @var dispatch_result::INVALID
+     * A field the message type requires was empty
+     */
+    enum class dispatch_result
+    {
+        DISPATCHED,
+        UNKNOWN_TYPE,
+        INVALID,
+    };
+
+    /**
+     * @brief view of a fixed size, NUL terminated protocol field
+     *
+     * Never reads past the field, even if the sender did not terminate it.
+     *
+     * @param data start of the field
+     * @param size size of the field in bytes
+     */
+    inline std::string_view field(const int8_t *data, size_t size)
+    {
+        const char *chars = reinterpret_cast<const char *>(data);
+        return std::string_view{chars, strnlen(chars, size)};
+    }
+
+    /**
+     * @brief One row of the protocol table.
+     *
+     * @tparam Type message type the row describes
+     * @tparam Fields mask of message_field values carried by the type, only these are decoded
+     * @tparam Required mask of fields that must be non-empty for the message to be valid
+     * @tparam Handler function called as Handler(context, decoded_message)
+     */
+    template <chat_type Type, unsigned Fields, unsigned Required, auto Handler>
+    struct route
+    {
+        static_assert(Type >= JOIN && Type < UNKNOWN, "route for a type outside the protocol");
+        static_assert((Required & ~Fields) == 0, "route requires a field it does not carry");
+
+        static constexpr chat_type type = Type;
+        static constexpr unsigned fields = Fields;
+        static constexpr unsigned required = Required;
+        static constexpr auto handler = Handler;
+
+        /**
+         * @brief decode the fields this type carries and check the required ones
+         * @return false if a required field is empty
+         */
+        static bool decode(const chat_message &msg, decoded_message &out)
+        {
+            out.type_ = Type;
+            if constexpr ((Fields & FIELD_USERNAME) != 0)
+            {
+                out.username_ = field(msg.username_, MAX_USERNAME_LENGTH);
+            }
+            if constexpr ((Fields & FIELD_GROUPNAME) != 0)
+            {
+                out.groupname_ = field(msg.groupname_, MAX_GROUPNAME_LENGTH);
+            }
+            if constexpr ((Fields & FIELD_MESSAGE) != 0)
+            {
+                out.message_ = field(msg.message_, MAX_MESSAGE_LENGTH);
+            }
+
+            return ((Required & FIELD_USERNAME) == 0 || !out.username_.empty()) &&
+                   ((Required & FIELD_GROUPNAME) == 0 || !out.groupname_.empty()) &&
+                   ((Required & FIELD_MESSAGE) == 0 || !out.message_.empty());
+        }
+    };
+
+    /**
+     * @brief Dispatcher generated from a list of routes.
+     *
+     * Builds, at compile time, one entry per chat_type. Each entry decodes, validates and calls
+     * the route's handler; types without a route get an entry that rejects the message. So
+     * dispatch is one bounds check followed by one indirect call. A handler that cannot be
+     * called with (Context &, const decoded_message &) or a type routed twice fails to compile.
+     *
+     * @tparam Context state passed through to every handler
+     * @tparam Routes route<> rows of the protocol table
+     */
+    template <typename Context, typename... Routes>
+    class dispatcher
+    {
+    public:
+        typedef dispatch_result (*entry)(Context &, const chat_message &);
+
+        static constexpr size_t TABLE_SIZE = UNKNOWN;
+
+        /**
+         * @brief decode msg and run the handler for its type
+         */
+        static dispatch_result dispatch(Context &ctx, const chat_message &msg)
+        {
+            if (msg.type_ >= TABLE_SIZE)
+            {
+                return dispatch_result::UNKNOWN_TYPE;
+            }
+            return table[msg.type_](ctx, msg);
+        }
+
+        /**
+         * @brief true if the protocol table has a route for type
+         */
+        static constexpr bool routed(chat_type type)
+        {
+            return ((Routes::type == type) || ...);
+        }
+
+    private:
+        static_assert((std::is_invocable_v<decltype(Routes::handler), Context &, const decoded_message &> && ...),
+                      "route handler must be callable as handler(Context &, const decoded_message &)");
+
+        static constexpr bool unique_types()
+        {
+            constexpr chat_type types[] = {Routes::type...};
+            for (size_t i = 0; i < sizeof...(Routes); i++)
+            {
+                for (size_t j = i + 1; j < sizeof...(Routes); j++)
+                {
+                    if (types[i] == types[j])
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+        static_assert(unique_types(), "message type routed more than once");
+
+        static dispatch_result reject(Context &, const chat_message &)
+        {
+            return dispatch_result::UNKNOWN_TYPE;
+        }
+
+        template <typename Route>
+        static dispatch_result invoke(Context &ctx, const chat_message &msg)
+        {
+            decoded_message decoded{};
+            {
+                profile_span span{"decode"};
+                if (!Route::decode(msg, decoded))
+                {
+                    return dispatch_result::INVALID;
+                }
+            }
+            Route::handler(ctx, decoded);
+            return dispatch_result::DISPATCHED;
+        }
+
+        static constexpr std::array<entry, TABLE_SIZE> build()
+        {
+            std::array<entry, TABLE_SIZE> t{};
+            for (auto &e : t)
+            {
+                e = &reject;
+            }
+            ((t[Routes::type] = &invoke<Routes>), ...);
+            return t;
+        }
+
+        static constexpr std::array<entry, TABLE_SIZE> table = build();
+    };
+
+}; // namespace chat
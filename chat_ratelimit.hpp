@@ -0,0 +1,280 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "chat_fragment.hpp"
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+
+// sender tables of a rate_limiter, each with its own lock
+#define RATE_LIMIT_SHARDS 16
+// senders a shard tracks before idle ones are forgotten
+#define RATE_LIMIT_SENDERS 1024
+// a sender not heard from for this long has full buckets again and can be forgotten
+#define RATE_LIMIT_IDLE std::chrono::seconds(10)
+// handler backlog beyond which chat messages are shed
+#define ADMISSION_CHAT_BACKLOG 4096
+// handler backlog beyond which control messages are shed too
+#define ADMISSION_CONTROL_BACKLOG 16384
+
+namespace chat
+{
+
+    /**
+     * @brief classes of message, rate limited separately by what handling them costs
+     */
+    enum traffic_class
+    {
+        TRAFFIC_CONTROL, // sessions, groups, subscriptions and transfers
+        TRAFFIC_DIRECT,  // delivered to one user
+        TRAFFIC_FANOUT,  // delivered to every user, group member or subscriber
+        TRAFFIC_CLASSES,
+    };
+
+    /**
+     * @brief class of a message by its type, fragments are classed as the message they carry
+     */
+    inline traffic_class classify(uint8_t type)
+    {
+        switch (static_cast<chat_type>(type & ~FRAGMENT_FLAG))
+        {
+        case BROADCAST:
+        case GROUP_MESSAGE:
+        case PUBLISH:
+            return TRAFFIC_FANOUT;
+        case DIRECTMESSAGE:
+            return TRAFFIC_DIRECT;
+        default:
+            return TRAFFIC_CONTROL;
+        }
+    }
+
+    /**
+     * @brief rate a sender may keep up in one class, and how far it may burst above it
+     */
+    struct rate_limit
+    {
+        double rate_;  // messages per second
+        double burst_; // messages
+    };
+
+    /**
+     * @brief Tokens refilled continuously at a limit's rate up to its burst, one spent per message
+     */
+    class token_bucket
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        /**
+         * @brief spend a token
+         * @return false if there is none, the message is over the limit
+         */
+        bool take(const rate_limit &limit, clock::time_point now)
+        {
+            if (!started_)
+            {
+                tokens_ = limit.burst_;
+                started_ = true;
+            }
+            else
+            {
+                std::chrono::duration<double> elapsed = now - refilled_;
+                tokens_ = std::min(limit.burst_, tokens_ + elapsed.count() * limit.rate_);
+            }
+            refilled_ = now;
+            if (tokens_ < 1.0)
+            {
+                return false;
+            }
+            tokens_ -= 1.0;
+            return true;
+        }
+
+    private:
+        double tokens_ = 0;
+        bool started_ = false;
+        clock::time_point refilled_;
+    };
+
+    /**
+     * @brief Per-sender token buckets for each traffic class.
+     *
+     * Limits default to enough for a person typing, with a fan-out burst that fits the
+     * fragments of one FRAGMENT_MAX_MESSAGE, and are overridden by CHAT_RATE_LIMITS, e.g.
+     * "fanout=32/128,direct=64/128,control=32/64" in messages per second / burst.
+     */
+    class rate_limiter
+    {
+    public:
+        typedef token_bucket::clock clock;
+
+        rate_limiter()
+            : shed_{counter{"ratelimit.shed_control"}, counter{"ratelimit.shed_direct"}, counter{"ratelimit.shed_fanout"}},
+              forgotten_{"ratelimit.forgotten"}
+        {
+            limits_[TRAFFIC_CONTROL] = rate_limit{32, 64};
+            limits_[TRAFFIC_DIRECT] = rate_limit{64, 128};
+            limits_[TRAFFIC_FANOUT] = rate_limit{32, 128};
+            const char *env = getenv("CHAT_RATE_LIMITS");
+            if (env != nullptr)
+            {
+                configure(env);
+            }
+        }
+
+        /**
+         * @brief set limits from a spec like "fanout=32/128,direct=64/128", unnamed classes keep theirs
+         */
+        void configure(std::string_view spec)
+        {
+            while (!spec.empty())
+            {
+                std::string_view item = spec.substr(0, spec.find(','));
+                spec.remove_prefix(std::min(spec.size(), item.size() + 1));
+
+                size_t equals = item.find('=');
+                size_t slash = item.find('/');
+                if (equals == std::string_view::npos || slash == std::string_view::npos || slash < equals)
+                {
+                    continue;
+                }
+                std::string_view name = item.substr(0, equals);
+                traffic_class c = name == "control"  ? TRAFFIC_CONTROL
+                                  : name == "direct" ? TRAFFIC_DIRECT
+                                  : name == "fanout" ? TRAFFIC_FANOUT
+                                                     : TRAFFIC_CLASSES;
+                double rate = strtod(std::string{item.substr(equals + 1, slash - equals - 1)}.c_str(), nullptr);
+                double burst = strtod(std::string{item.substr(slash + 1)}.c_str(), nullptr);
+                if (c != TRAFFIC_CLASSES && rate > 0 && burst >= 1)
+                {
+                    limits_[c] = rate_limit{rate, burst};
+                }
+            }
+        }
+
+        const rate_limit &limit(traffic_class c) const
+        {
+            return limits_[c];
+        }
+
+        /**
+         * @brief spend a token of the sender's bucket for the class
+         * @param sender identifies the sender, e.g. its address
+         * @return false if the sender is over its limit and the message should be dropped
+         */
+        bool admit(uint64_t sender, traffic_class c, clock::time_point now = clock::now())
+        {
+            shard &s = shards_[sender % RATE_LIMIT_SHARDS];
+            std::lock_guard<std::mutex> lock{s.mutex_};
+            auto it = s.senders_.find(sender);
+            if (it == s.senders_.end())
+            {
+                if (s.senders_.size() >= RATE_LIMIT_SENDERS)
+                {
+                    forget_idle(s, now);
+                }
+                it = s.senders_.emplace(sender, buckets{}).first;
+            }
+            it->second.heard_ = now;
+            if (!it->second.classes_[c].take(limits_[c], now))
+            {
+                shed_[c].add();
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        struct buckets
+        {
+            token_bucket classes_[TRAFFIC_CLASSES];
+            clock::time_point heard_;
+        };
+
+        struct shard
+        {
+            std::mutex mutex_;
+            std::unordered_map<uint64_t, buckets> senders_;
+        };
+
+        /**
+         * @brief forget senders idle long enough to have full buckets, or failing that the least recent
+         */
+        void forget_idle(shard &s, clock::time_point now)
+        {
+            size_t before = s.senders_.size();
+            auto oldest = s.senders_.end();
+            for (auto it = s.senders_.begin(); it != s.senders_.end();)
+            {
+                if (now - it->second.heard_ > RATE_LIMIT_IDLE)
+                {
+                    it = s.senders_.erase(it);
+                    continue;
+                }
+                if (oldest == s.senders_.end() || it->second.heard_ < oldest->second.heard_)
+                {
+                    oldest = it;
+                }
+                ++it;
+            }
+            if (s.senders_.size() == before && oldest != s.senders_.end())
+            {
+                s.senders_.erase(oldest);
+            }
+            forgotten_.add(before - s.senders_.size());
+        }
+
+        rate_limit limits_[TRAFFIC_CLASSES];
+        shard shards_[RATE_LIMIT_SHARDS];
+        counter shed_[TRAFFIC_CLASSES];
+        counter forgotten_;
+    };
+
+    /**
+     * @brief Sheds messages from everyone once handlers fall behind.
+     *
+     * Chat messages go first, at ADMISSION_CHAT_BACKLOG queued handlers, so joins, leaves and
+     * the like keep working under a flood; control messages are only shed well beyond that.
+     */
+    class admission_control
+    {
+    public:
+        admission_control() : shed_chat_{"admission.shed_chat"}, shed_control_{"admission.shed_control"} {}
+
+        /**
+         * @brief should a message of the class be handled with backlog handlers queued
+         */
+        bool admit(traffic_class c, size_t backlog)
+        {
+            if (c == TRAFFIC_CONTROL)
+            {
+                if (backlog >= ADMISSION_CONTROL_BACKLOG)
+                {
+                    shed_control_.add();
+                    return false;
+                }
+                return true;
+            }
+            if (backlog >= ADMISSION_CHAT_BACKLOG)
+            {
+                shed_chat_.add();
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        counter shed_chat_;
+        counter shed_control_;
+    };
+
+}; // namespace chat
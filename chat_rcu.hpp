@@ -0,0 +1,299 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+
+// threads that read snapshots each with a slot of their own, any more share one slot
+#define MAX_RCU_READERS 64
+
+namespace chat
+{
+
+    /**
+     * @brief Epoch based reclamation domain.
+     *
+     * Readers announce the global epoch they entered in a per-thread slot, writers retire
+     * old versions tagged with the epoch at which they were unpublished. A retired version
+     * is freed once no reader is still inside an epoch at or before that tag.
+     *
+     * Past MAX_RCU_READERS threads, readers share one last slot under a lock. It holds the
+     * epoch of the first of them to enter until the last leaves, which may keep versions
+     * longer than needed but never frees one a reader can still see.
+     */
+    class epoch_domain
+    {
+    public:
+        /**
+         * @brief the process wide domain shared by all snapshots
+         */
+        static epoch_domain &instance()
+        {
+            static epoch_domain domain;
+            return domain;
+        }
+
+        /**
+         * @brief enter a read side critical section for the calling thread (nestable)
+         */
+        void enter()
+        {
+            thread_state &state = local();
+            if (state.depth++ == 0)
+            {
+                if (state.slot == MAX_RCU_READERS)
+                {
+                    std::lock_guard<std::mutex> lock{shared_mutex_};
+                    if (shared_readers_++ == 0)
+                    {
+                        slots_[state.slot].epoch.store(global_epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+                    }
+                    return;
+                }
+                slots_[state.slot].epoch.store(global_epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+            }
+        }
+
+        /**
+         * @brief leave a read side critical section for the calling thread
+         */
+        void exit()
+        {
+            thread_state &state = local();
+            if (--state.depth == 0)
+            {
+                if (state.slot == MAX_RCU_READERS)
+                {
+                    std::lock_guard<std::mutex> lock{shared_mutex_};
+                    if (--shared_readers_ == 0)
+                    {
+                        slots_[state.slot].epoch.store(0, std::memory_order_release);
+                    }
+                    return;
+                }
+                slots_[state.slot].epoch.store(0, std::memory_order_release);
+            }
+        }
+
+        /**
+         * @brief hand an unpublished version over for deferred deletion
+         *
+         * @param ptr version that is no longer reachable by new readers
+         * @param deleter function used to free ptr
+         */
+        void retire(void *ptr, void (*deleter)(void *))
+        {
+            uint64_t epoch = global_epoch_.fetch_add(1, std::memory_order_seq_cst);
+            std::lock_guard<std::mutex> lock{retire_mutex_};
+            retired_.push_back({ptr, deleter, epoch});
+            collect_locked();
+        }
+
+        /**
+         * @brief free any retired versions that no reader can still observe
+         */
+        void collect()
+        {
+            std::lock_guard<std::mutex> lock{retire_mutex_};
+            collect_locked();
+        }
+
+        /**
+         * @brief number of retired versions waiting for readers to move on
+         */
+        size_t pending()
+        {
+            std::lock_guard<std::mutex> lock{retire_mutex_};
+            return retired_.size();
+        }
+
+    private:
+        struct alignas(64) reader_slot
+        {
+            std::atomic<uint64_t> epoch{0};
+            std::atomic<bool> used{false};
+        };
+
+        struct retired_version
+        {
+            void *ptr_;
+            void (*deleter_)(void *);
+            uint64_t epoch_;
+        };
+
+        struct thread_state
+        {
+            int slot = -1;
+            int depth = 0;
+
+            ~thread_state()
+            {
+                if (slot >= 0 && slot < MAX_RCU_READERS)
+                {
+                    epoch_domain::instance().slots_[slot].used.store(false, std::memory_order_release);
+                }
+            }
+        };
+
+        epoch_domain() = default;
+
+        ~epoch_domain()
+        {
+            for (auto &r : retired_)
+            {
+                r.deleter_(r.ptr_);
+            }
+        }
+
+        thread_state &local()
+        {
+            thread_local thread_state state;
+            if (state.slot < 0)
+            {
+                for (int i = 0; i < MAX_RCU_READERS; i++)
+                {
+                    bool expected = false;
+                    if (slots_[i].used.compare_exchange_strong(expected, true))
+                    {
+                        state.slot = i;
+                        break;
+                    }
+                }
+                // more reader threads than slots, this one shares the last
+                if (state.slot < 0)
+                {
+                    state.slot = MAX_RCU_READERS;
+                }
+            }
+            return state;
+        }
+
+        /**
+         * @brief oldest epoch any reader is currently inside, or UINT64_MAX if none
+         */
+        uint64_t min_active_epoch() const
+        {
+            uint64_t min = UINT64_MAX;
+            for (int i = 0; i <= MAX_RCU_READERS; i++)
+            {
+                uint64_t e = slots_[i].epoch.load(std::memory_order_seq_cst);
+                if (e != 0 && e < min)
+                {
+                    min = e;
+                }
+            }
+            return min;
+        }
+
+        void collect_locked()
+        {
+            uint64_t min = min_active_epoch();
+            auto keep = retired_.begin();
+            for (auto it = retired_.begin(); it != retired_.end(); ++it)
+            {
+                if (it->epoch_ < min)
+                {
+                    it->deleter_(it->ptr_);
+                }
+                else
+                {
+                    *keep++ = *it;
+                }
+            }
+            retired_.erase(keep, retired_.end());
+        }
+
+        std::atomic<uint64_t> global_epoch_{1};
+        reader_slot slots_[MAX_RCU_READERS + 1]; // the last shared by readers without one of their own
+        std::mutex shared_mutex_;
+        int shared_readers_ = 0;
+        std::mutex retire_mutex_;
+        std::vector<retired_version> retired_;
+    };
+
+    /**
+     * @brief RAII read side critical section, snapshots read inside stay valid until it ends
+     */
+    struct rcu_read_guard
+    {
+        rcu_read_guard() { epoch_domain::instance().enter(); }
+        ~rcu_read_guard() { epoch_domain::instance().exit(); }
+
+        rcu_read_guard(const rcu_read_guard &) = delete;
+        rcu_read_guard &operator=(const rcu_read_guard &) = delete;
+    };
+
+    /**
+     * @brief Read-mostly value published as immutable versions.
+     *
+     * Readers call read() inside an rcu_read_guard and walk the returned version without
+     * taking any lock. Writers are serialised, copy the current version, modify the copy
+     * and swap it in; the old version is reclaimed through the epoch domain.
+     */
+    template <typename T>
+    class rcu_snapshot
+    {
+    public:
+        rcu_snapshot() : current_{new T{}} {}
+
+        ~rcu_snapshot()
+        {
+            delete current_.load(std::memory_order_relaxed);
+        }
+
+        rcu_snapshot(const rcu_snapshot &) = delete;
+        rcu_snapshot &operator=(const rcu_snapshot &) = delete;
+
+        /**
+         * @brief current version, only valid while the caller holds an rcu_read_guard
+         */
+        const T *read() const
+        {
+            return current_.load(std::memory_order_seq_cst);
+        }
+
+        /**
+         * @brief copy the current version, apply f to the copy and publish it
+         *
+         * @param f callable taking T & that performs the modification
+         */
+        template <typename F>
+        void update(F &&f)
+        {
+            std::lock_guard<std::mutex> lock{write_mutex_};
+            std::unique_ptr<T> next{new T(*current_.load(std::memory_order_relaxed))};
+            f(*next);
+            swap_in(next.release());
+        }
+
+        /**
+         * @brief replace the current version wholesale
+         *
+         * @param next new version, ownership is taken
+         */
+        void publish(std::unique_ptr<T> next)
+        {
+            std::lock_guard<std::mutex> lock{write_mutex_};
+            swap_in(next.release());
+        }
+
+    private:
+        static void destroy(void *ptr)
+        {
+            delete static_cast<T *>(ptr);
+        }
+
+        void swap_in(T *next)
+        {
+            T *old = current_.exchange(next, std::memory_order_seq_cst);
+            epoch_domain::instance().retire(old, &rcu_snapshot::destroy);
+        }
+
+        std::atomic<T *> current_;
+        std::mutex write_mutex_;
+    };
+
+}; // namespace chat
@@ -0,0 +1,596 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "chat_stats.hpp"
+#include "chat_dedup.hpp"
+
+// first byte of a datagram carrying a reliable_header, never a valid chat_type
+#define RELIABLE_MARKER 0x7e
+// datagrams a peer may have unacknowledged at once, one per bit of the selective ack
+#define RELIABLE_WINDOW 32
+// datagrams queued behind a full window before further sends are dropped
+#define RELIABLE_BACKLOG 1024
+// retransmit timer before any round trip has been measured, and its bounds
+#define RELIABLE_INITIAL_RTO std::chrono::milliseconds(200)
+#define RELIABLE_MIN_RTO std::chrono::milliseconds(10)
+#define RELIABLE_MAX_RTO std::chrono::seconds(2)
+// how often retransmit timers are checked
+#define RELIABLE_TICK std::chrono::milliseconds(5)
+// a peer is given up on after a datagram has been retransmitted this many times
+#define RELIABLE_MAX_RETRIES 12
+// state of a peer nothing has been exchanged with for this long is dropped
+#define RELIABLE_IDLE_TIMEOUT std::chrono::seconds(120)
+// later datagrams selectively acked past a missing one before it is resent without waiting
+#define RELIABLE_FAST_RETRANSMIT 3
+
+namespace chat
+{
+
+    /**
+     * @brief Header in front of every datagram of the reliability layer.
+     *
+     * Data datagrams carry a chat message after the header, pure acks carry nothing. Every
+     * datagram acks what its sender has received of the stream ack_session_: everything
+     * before ack_, and ack_ + 1 + i for each bit i set in sack_. Sequence numbers count from
+     * 1 per sending stream, and session_ identifies the stream, drawn afresh whenever a side
+     * starts one, so neither a restarted peer nor one given up on is taken for a duplicate.
+     * base_ is the lowest sequence of the stream not yet acked, where a receiver that has
+     * never heard of the stream starts.
+     */
+    struct reliable_header
+    {
+        uint8_t marker_;
+        uint8_t flags_;
+        uint16_t reserved_;
+        uint32_t session_;
+        uint32_t seq_; // 0 in a pure ack
+        uint32_t base_;
+        uint32_t ack_session_;
+        uint32_t ack_;
+        uint32_t sack_;
+    };
+
+    // set in flags_ of a datagram carrying a message
+    constexpr uint8_t RELIABLE_DATA = 1;
+
+    /**
+     * @brief true if a datagram of length bytes starts with a reliable_header
+     */
+    inline bool is_reliable(const char *datagram, ssize_t length)
+    {
+        return length >= static_cast<ssize_t>(sizeof(reliable_header)) && static_cast<uint8_t>(datagram[0]) == RELIABLE_MARKER;
+    }
+
+    /**
+     * @brief Optional reliable delivery over a datagram socket.
+     *
+     * Wraps the socket with the same sendto and recvfrom, so it slots in under the server's
+     * transport_hub or a client's client_transport. Messages to a peer are numbered, kept
+     * until acknowledged, and resent when their retransmit timer, estimated from measured
+     * round trips as in RFC 6298, expires, or at once when later messages have been
+     * selectively acked past them. Up to RELIABLE_WINDOW are in flight, so throughput is not
+     * limited to one message per round trip. Received messages are acked and handed up in
+     * order, without duplicates.
+     *
+     * Peers that don't use the layer are unaffected: an active link (a client that turned
+     * it on) sends everything reliably, a passive one (the server) only talks reliably to
+     * peers that have sent it reliable datagrams.
+     *
+     * @tparam Datagram datagram socket providing sendto and recvfrom, recvfrom from one thread only
+     */
+    template <typename Datagram>
+    class reliable_link
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        explicit reliable_link(Datagram &datagram)
+            : datagram_{datagram}, sent_{"reliable.sent"}, retransmits_{"reliable.retransmits"},
+              fast_retransmits_{"reliable.fast_retransmits"}, duplicates_{"reliable.duplicates"},
+              out_of_order_{"reliable.out_of_order"}, dropped_{"reliable.backlog_dropped"},
+              lost_{"reliable.peers_lost"}, rtt_{"reliable.rtt_us"}, sessions_{std::random_device{}()} {}
+
+        ~reliable_link()
+        {
+            stop();
+        }
+
+        reliable_link(const reliable_link &) = delete;
+        reliable_link &operator=(const reliable_link &) = delete;
+
+        /**
+         * @brief start the retransmit timer thread
+         * @param active send everything reliably, rather than only to peers that do
+         */
+        void start(bool active)
+        {
+            active_ = active;
+            timer_ = std::thread{[this]()
+                                 { run_timers(); }};
+        }
+
+        void stop()
+        {
+            if (!timer_.joinable())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                stopping_ = true;
+            }
+            wake_.notify_all();
+            timer_.join();
+        }
+
+        /**
+         * @brief send reliably if to is a reliable peer, otherwise pass straight through
+         * @return length once the message is sent or queued, -1 if it had to be dropped
+         */
+        ssize_t sendto(const char *data, size_t length, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            const sockaddr_in &address = *reinterpret_cast<const sockaddr_in *>(to);
+            std::shared_ptr<peer> p = find(address, active_);
+            if (!p || length > MAX_CHAT_DATAGRAM)
+            {
+                return datagram_.sendto(data, length, flags, to, to_length);
+            }
+
+            std::lock_guard<std::mutex> lock{p->mutex_};
+            if (p->backlog_.size() >= RELIABLE_BACKLOG)
+            {
+                dropped_.add();
+                return -1;
+            }
+            p->backlog_.emplace_back();
+            segment &s = p->backlog_.back();
+            s.length_ = length;
+            memcpy(s.data_, data, length);
+            flush(*p);
+            return static_cast<ssize_t>(length);
+        }
+
+        /**
+         * @brief send count datagrams of segment bytes each to one address, segmented by the socket
+         * unless it is a reliable peer, which gets them one by one
+         */
+        ssize_t send_segments(const char *data, size_t segment, size_t count, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            if (!find(*reinterpret_cast<const sockaddr_in *>(to), active_))
+            {
+                return datagram_.send_segments(data, segment, count, flags, to, to_length);
+            }
+            ssize_t sent = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (sendto(data + i * segment, segment, flags, to, to_length) > 0)
+                {
+                    sent += static_cast<ssize_t>(segment);
+                }
+            }
+            return sent > 0 ? sent : -1;
+        }
+
+        /**
+         * @brief receive the next message, in order per reliable peer
+         *
+         * Acks and duplicates are consumed here and never returned.
+         */
+        ssize_t recvfrom(char *data, size_t length, int flags, sockaddr *from, size_t *from_length)
+        {
+            for (;;)
+            {
+                if (!ready_.empty())
+                {
+                    const delivery &d = ready_.front();
+                    memcpy(data, d.data_, std::min(length, d.length_));
+                    ssize_t size = static_cast<ssize_t>(d.length_);
+                    copy_address(d.from_, from, from_length);
+                    ready_.pop_front();
+                    return size;
+                }
+
+                char buffer[sizeof(reliable_header) + MAX_CHAT_DATAGRAM];
+                sockaddr_in address;
+                size_t address_length = sizeof(address);
+                ssize_t n = datagram_.recvfrom(buffer, sizeof(buffer), flags, (sockaddr *)&address, &address_length);
+                if (!is_reliable(buffer, n))
+                {
+                    if (n > 0 && !active_)
+                    {
+                        // a peer that stopped using the layer, e.g. restarted without it
+                        forget(address);
+                    }
+                    memcpy(data, buffer, n > 0 ? std::min(length, static_cast<size_t>(n)) : 0);
+                    copy_address(address, from, from_length);
+                    return n > 0 && static_cast<size_t>(n) > length ? static_cast<ssize_t>(length) : n;
+                }
+                receive(buffer, static_cast<size_t>(n), address);
+            }
+        }
+
+    private:
+        struct segment
+        {
+            uint32_t seq_ = 0;
+            size_t length_ = 0;
+            clock::time_point sent_at_;
+            int retries_ = 0;
+            bool acked_ = false;
+            bool fast_resent_ = false;
+            char data_[MAX_CHAT_DATAGRAM];
+        };
+
+        struct delivery
+        {
+            sockaddr_in from_;
+            size_t length_;
+            char data_[MAX_CHAT_DATAGRAM];
+        };
+
+        struct peer
+        {
+            sockaddr_in address_;
+            std::mutex mutex_;
+
+            // sending
+            uint32_t session_ = 0; // of the stream to this peer, new each time the peer is created
+            uint32_t next_seq_ = 1;
+            uint32_t unacked_ = 1; // lowest sequence not yet acknowledged
+            segment window_[RELIABLE_WINDOW];
+            std::deque<segment> backlog_;
+            clock::duration srtt_{0};
+            clock::duration rttvar_{0};
+            clock::duration rto_{RELIABLE_INITIAL_RTO};
+
+            // receiving
+            uint32_t remote_session_ = 0;
+            uint32_t next_expected_ = 1;
+            uint32_t received_ = 0; // bit i: next_expected_ + 1 + i has been received
+            segment reorder_[RELIABLE_WINDOW];
+
+            clock::time_point last_heard_ = clock::now();
+        };
+
+        static void copy_address(const sockaddr_in &address, sockaddr *to, size_t *to_length)
+        {
+            if (to != nullptr)
+            {
+                memcpy(to, &address, sizeof(address));
+            }
+            if (to_length != nullptr)
+            {
+                *to_length = sizeof(address);
+            }
+        }
+
+        static uint64_t key(const sockaddr_in &address)
+        {
+            return (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+        }
+
+        std::shared_ptr<peer> find(const sockaddr_in &address, bool create)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            auto it = peers_.find(key(address));
+            if (it != peers_.end())
+            {
+                return it->second;
+            }
+            if (!create)
+            {
+                return nullptr;
+            }
+            auto p = std::make_shared<peer>();
+            p->address_ = address;
+            // never 0, which is no stream
+            p->session_ = static_cast<uint32_t>(sessions_()) | 1;
+            peers_[key(address)] = p;
+            return p;
+        }
+
+        void forget(const sockaddr_in &address)
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            peers_.erase(key(address));
+        }
+
+        /**
+         * @brief what this side has received from p, for the header of anything sent to it
+         */
+        reliable_header header(const peer &p, uint32_t seq) const
+        {
+            return reliable_header{RELIABLE_MARKER, static_cast<uint8_t>(seq != 0 ? RELIABLE_DATA : 0), 0,
+                                   p.session_, seq, p.unacked_, p.remote_session_, p.next_expected_, p.received_};
+        }
+
+        void transmit(peer &p, segment &s)
+        {
+            char buffer[sizeof(reliable_header) + MAX_CHAT_DATAGRAM];
+            reliable_header h = header(p, s.seq_);
+            memcpy(buffer, &h, sizeof(h));
+            memcpy(buffer + sizeof(h), s.data_, s.length_);
+            s.sent_at_ = clock::now();
+            datagram_.sendto(buffer, sizeof(h) + s.length_, 0, (const sockaddr *)&p.address_, sizeof(p.address_));
+        }
+
+        void send_ack(peer &p)
+        {
+            reliable_header h = header(p, 0);
+            datagram_.sendto(reinterpret_cast<const char *>(&h), sizeof(h), 0, (const sockaddr *)&p.address_, sizeof(p.address_));
+        }
+
+        /**
+         * @brief move backlog into the window while there is room, p.mutex_ held
+         */
+        void flush(peer &p)
+        {
+            while (!p.backlog_.empty() && p.next_seq_ - p.unacked_ < RELIABLE_WINDOW)
+            {
+                segment &s = p.window_[p.next_seq_ % RELIABLE_WINDOW];
+                s = p.backlog_.front();
+                p.backlog_.pop_front();
+                s.seq_ = p.next_seq_++;
+                s.retries_ = 0;
+                s.acked_ = false;
+                s.fast_resent_ = false;
+                transmit(p, s);
+                sent_.add();
+            }
+        }
+
+        /**
+         * @brief fold a round trip sample into the retransmit timer, RFC 6298
+         */
+        void measure(peer &p, clock::duration sample)
+        {
+            rtt_.record(std::chrono::duration_cast<std::chrono::microseconds>(sample).count());
+            if (p.srtt_ == clock::duration{0})
+            {
+                p.srtt_ = sample;
+                p.rttvar_ = sample / 2;
+            }
+            else
+            {
+                clock::duration error = p.srtt_ > sample ? p.srtt_ - sample : sample - p.srtt_;
+                p.rttvar_ = (3 * p.rttvar_ + error) / 4;
+                p.srtt_ = (7 * p.srtt_ + sample) / 8;
+            }
+            p.rto_ = std::clamp<clock::duration>(p.srtt_ + 4 * p.rttvar_, RELIABLE_MIN_RTO, RELIABLE_MAX_RTO);
+        }
+
+        /**
+         * @brief apply the acks in a header from p, p.mutex_ held
+         */
+        void acknowledge(peer &p, const reliable_header &h)
+        {
+            auto now = clock::now();
+            // only trust acks for what has actually been sent
+            uint32_t cumulative = std::min(h.ack_, p.next_seq_);
+            auto ack_one = [&](segment &s)
+            {
+                if (!s.acked_)
+                {
+                    s.acked_ = true;
+                    // Karn: a resent segment's ack can't tell which copy it was for
+                    if (s.retries_ == 0 && !s.fast_resent_)
+                    {
+                        measure(p, now - s.sent_at_);
+                    }
+                }
+            };
+            for (; p.unacked_ < cumulative; p.unacked_++)
+            {
+                ack_one(p.window_[p.unacked_ % RELIABLE_WINDOW]);
+            }
+            int later = 0;
+            for (int i = RELIABLE_WINDOW - 1; i >= 0; i--)
+            {
+                uint32_t seq = cumulative + 1 + static_cast<uint32_t>(i);
+                if (seq < p.unacked_ || seq >= p.next_seq_)
+                {
+                    continue;
+                }
+                segment &s = p.window_[seq % RELIABLE_WINDOW];
+                if (h.sack_ & (uint32_t{1} << i))
+                {
+                    ack_one(s);
+                    later++;
+                }
+                else if (later >= RELIABLE_FAST_RETRANSMIT && !s.acked_ && !s.fast_resent_)
+                {
+                    s.fast_resent_ = true;
+                    fast_retransmits_.add();
+                    transmit(p, s);
+                }
+            }
+            // the cumulative ack's own hole: everything after it acked selectively
+            if (cumulative == p.unacked_ && p.unacked_ < p.next_seq_ && later >= RELIABLE_FAST_RETRANSMIT)
+            {
+                segment &s = p.window_[p.unacked_ % RELIABLE_WINDOW];
+                if (!s.fast_resent_)
+                {
+                    s.fast_resent_ = true;
+                    fast_retransmits_.add();
+                    transmit(p, s);
+                }
+            }
+            // slide past anything selectively acked that is now at the front
+            while (p.unacked_ < p.next_seq_ && p.window_[p.unacked_ % RELIABLE_WINDOW].acked_)
+            {
+                p.unacked_++;
+            }
+            flush(p);
+        }
+
+        /**
+         * @brief handle a reliable datagram: apply its acks, ack its data and queue what is now in order
+         */
+        void receive(const char *buffer, size_t length, const sockaddr_in &from)
+        {
+            reliable_header h;
+            memcpy(&h, buffer, sizeof(h));
+            size_t payload = length - sizeof(h);
+            bool data = (h.flags_ & RELIABLE_DATA) != 0 && h.seq_ != 0 && payload > 0 && payload <= MAX_CHAT_DATAGRAM;
+
+            std::shared_ptr<peer> p = find(from, data);
+            if (!p)
+            {
+                return;
+            }
+            std::lock_guard<std::mutex> lock{p->mutex_};
+            p->last_heard_ = clock::now();
+            // acks for an earlier stream to this address say nothing about the current one
+            if (h.ack_session_ == p->session_)
+            {
+                acknowledge(*p, h);
+            }
+            if (!data)
+            {
+                return;
+            }
+
+            if (h.session_ != p->remote_session_)
+            {
+                // a new peer, one that restarted or gave up on us, or one we gave up on: all
+                // before its base was delivered while we knew it, so carry on from there
+                p->remote_session_ = h.session_;
+                p->next_expected_ = h.base_ != 0 && h.base_ <= h.seq_ ? h.base_ : h.seq_;
+                p->received_ = 0;
+            }
+
+            uint32_t seq = h.seq_;
+            if (seq < p->next_expected_ || seq - p->next_expected_ > RELIABLE_WINDOW)
+            {
+                // already delivered, or too far ahead to hold; acking tells the sender where we are
+                duplicates_.add();
+            }
+            else if (seq == p->next_expected_)
+            {
+                queue(from, buffer + sizeof(h), payload);
+                p->next_expected_++;
+                // hand up whatever was waiting on this one
+                while (p->received_ & 1)
+                {
+                    segment &s = p->reorder_[p->next_expected_ % RELIABLE_WINDOW];
+                    queue(from, s.data_, s.length_);
+                    p->next_expected_++;
+                    p->received_ >>= 1;
+                }
+                p->received_ >>= 1;
+            }
+            else
+            {
+                uint32_t bit = uint32_t{1} << (seq - p->next_expected_ - 1);
+                if (p->received_ & bit)
+                {
+                    duplicates_.add();
+                }
+                else
+                {
+                    out_of_order_.add();
+                    p->received_ |= bit;
+                    segment &s = p->reorder_[seq % RELIABLE_WINDOW];
+                    s.length_ = payload;
+                    memcpy(s.data_, buffer + sizeof(h), payload);
+                }
+            }
+            send_ack(*p);
+        }
+
+        void queue(const sockaddr_in &from, const char *data, size_t length)
+        {
+            ready_.emplace_back();
+            delivery &d = ready_.back();
+            d.from_ = from;
+            d.length_ = length;
+            memcpy(d.data_, data, length);
+        }
+
+        /**
+         * @brief resend whatever has timed out and forget idle or unreachable peers
+         */
+        void run_timers()
+        {
+            std::unique_lock<std::mutex> lock{mutex_};
+            while (!stopping_)
+            {
+                wake_.wait_for(lock, RELIABLE_TICK);
+                auto now = clock::now();
+                for (auto it = peers_.begin(); it != peers_.end();)
+                {
+                    peer &p = *it->second;
+                    std::lock_guard<std::mutex> peer_lock{p.mutex_};
+                    bool lost = false;
+                    for (uint32_t seq = p.unacked_; seq < p.next_seq_ && !lost; seq++)
+                    {
+                        segment &s = p.window_[seq % RELIABLE_WINDOW];
+                        if (s.acked_ || now - s.sent_at_ < p.rto_)
+                        {
+                            continue;
+                        }
+                        if (++s.retries_ > RELIABLE_MAX_RETRIES)
+                        {
+                            lost = true;
+                            break;
+                        }
+                        // back off until a fresh round trip is measured
+                        p.rto_ = std::min<clock::duration>(p.rto_ * 2, RELIABLE_MAX_RTO);
+                        retransmits_.add();
+                        transmit(p, s);
+                    }
+                    bool idle = p.unacked_ == p.next_seq_ && p.backlog_.empty() && now - p.last_heard_ > RELIABLE_IDLE_TIMEOUT;
+                    if (lost)
+                    {
+                        lost_.add();
+                    }
+                    if (lost || idle)
+                    {
+                        it = peers_.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+            }
+        }
+
+        Datagram &datagram_;
+        bool active_ = false;
+        std::thread timer_;
+        bool stopping_ = false;
+        std::condition_variable wake_;
+
+        std::mutex mutex_;
+        std::map<uint64_t, std::shared_ptr<peer>> peers_;
+        // in order messages waiting for recvfrom, only touched by the receiving thread
+        std::deque<delivery> ready_;
+
+        counter sent_;
+        counter retransmits_;
+        counter fast_retransmits_;
+        counter duplicates_;
+        counter out_of_order_;
+        counter dropped_;
+        counter lost_;
+        histogram rtt_;
+        std::mt19937 sessions_; // draws stream sessions, under mutex_
+    };
+
+}; // namespace chat
@@ -1,4 +1,5 @@
 #include <map>
+#include <set>
 // IOT socket api
 #include <iot/socket.hpp>
 #include <arpa/inet.h>
@@ -7,15 +8,48 @@
 #include <unistd.h>
 // #include <chat.hpp>
 #include "chat_new.hpp"
+#include "chat_rcu.hpp"
+#include "chat_pool.hpp"
+#include "chat_coro.hpp"
+#include "chat_alloc.hpp"
+#include "chat_protocol.hpp"
+#include "chat_log.hpp"
+#include "chat_trace.hpp"
+#include "chat_dedup.hpp"
+#include "chat_ratelimit.hpp"
+#include "chat_cookie.hpp"
+#include "chat_profile.hpp"
+#include "chat_topics.hpp"
+#include "chat_fragment.hpp"
+#include "chat_blob.hpp"
+#include "chat_transport.hpp"
+#include "chat_reliable.hpp"
+#include "chat_bundle.hpp"
+#include "chat_offload.hpp"
+#include "chat_multicast.hpp"
+#include "chat_federation.hpp"
 #include <iostream>
 #include <chrono>
 #include <iomanip>
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <mutex>
+#include <thread>
+#include <string_view>
+#include <csignal>
+#include <pthread.h>
 
 #define USER_ALL "__ALL"
 #define USER_END "END"
+// per thread buffers outgoing messages are built in
+#define SEND_RING_SLOTS 8
+// most users in one page of a paginated LIST
+#define LIST_PAGE_MAX 64
+// seconds the session of a stream client that lost its connection waits for it to RESUME
+#define RESUME_GRACE_SECONDS 30
+// threads besides the pool's that read the roster: receive, coroutine loop and streams
+#define RCU_OTHER_READERS 3
 
 // ./chat_client "192.168.1.10" 1000 s2-akram
 // ./chat_client "192.168.1.10" 1020 user1
@@ -32,18 +66,379 @@
 
 // CHAT_SERVER
 
+/**
+ * @brief the server's UDP socket, a kernel socket with GSO and GRO when CHAT_OFFLOAD is set
+ */
+typedef chat::offload_socket<uwe::socket> udp_socket;
+
+/**
+ * @brief UDP with delivery made reliable for clients that ask for it
+ */
+typedef chat::reliable_link<udp_socket> datagram_link;
+
+/**
+ * @brief sends to each client over the transport it is connected by
+ */
+typedef chat::transport_hub<datagram_link> chat_socket;
+
 /**
  * @brief map of current online clients
  */
-typedef std::map<std::string, sockaddr_in *> online_users;
-typedef std::map<std::string, std::vector<std::string>> group_members;
-typedef std::map<std::string, std::string> user_group_map;
+typedef std::map<std::string, sockaddr_in *, std::less<>,
+                 chat::slab_allocator<std::pair<const std::string, sockaddr_in *>>>
+    online_users;
+typedef std::map<std::string, std::vector<std::string>, std::less<>> group_members;
+typedef std::map<std::string, std::string, std::less<>> user_group_map;
 
 user_group_map user_groups;
 
+/**
+ * @brief session records (the address each online user is reached at)
+ */
+chat::slab_pool<sockaddr_in> session_pool{"alloc.session"};
+
+/**
+ * @brief a received packet waiting on the handler pool
+ */
+struct inbound
+{
+    chat::traced_message packet_;
+    char id_[sizeof(chat::message_id_extension)]; // room for a message id after the longest packet
+    chat::trace_extension trace_;
+    bool traced_;
+    sockaddr_in from_;
+    std::chrono::steady_clock::time_point queued_;
+};
+
+/**
+ * @brief receive buffers, a packet is received straight into one and freed by its handler
+ */
+chat::slab_pool<inbound> inbound_pool{"alloc.inbound"};
+
+static_assert(offsetof(inbound, id_) == sizeof(chat::traced_message), "a packet is received into packet_ and id_ together");
+static_assert(sizeof(chat::chat_message) + sizeof(chat::peer_seal) <= chat::MAX_CHAT_DATAGRAM, "a sealed message from another node fits a receive buffer");
+
+/**
+ * @brief recognises retried messages, which are dropped before any handler sees them
+ */
+chat::duplicate_filter duplicates;
+
+/**
+ * @brief issues and checks the cookies a JOIN must echo before a session is created
+ */
+chat::join_cookies cookies;
+
+/**
+ * @brief resumption token of each online user, sent in JACK and presented in RESUME, guarded by state_mutex
+ */
+std::map<std::string, uint64_t, std::less<>> resume_tokens;
+
+/**
+ * @brief when the session of each stream client that lost its connection is dropped unless
+ * resumed, guarded by state_mutex
+ */
+std::map<std::string, std::chrono::steady_clock::time_point, std::less<>> detached_sessions;
+
+/**
+ * @brief source of resumption tokens
+ */
+chat::token_source resume_token_source;
+
+/**
+ * @brief give username a new resumption token, replacing any earlier one. Called under state_mutex
+ * @return the token as sent in JACK
+ */
+std::string issue_resume_token(std::string_view username)
+{
+    uint64_t token = resume_token_source.next();
+    resume_tokens.insert_or_assign(std::string{username}, token);
+    return chat::token_source::format(token);
+}
+
+/**
+ * @brief per-sender limits on each class of message
+ */
+chat::rate_limiter rate_limits;
+
+/**
+ * @brief sheds messages from everyone while the handlers are behind
+ */
+chat::admission_control admission;
+
+/**
+ * @brief handlers queued for each traffic class, which is also its priority in the pool
+ */
+chat::counter queue_depth[chat::TRAFFIC_CLASSES] = {
+    chat::counter{"queue.control.depth"}, chat::counter{"queue.direct.depth"}, chat::counter{"queue.fanout.depth"}};
+
+/**
+ * @brief time handlers of each traffic class spend queued
+ */
+chat::histogram queue_wait[chat::TRAFFIC_CLASSES] = {
+    chat::histogram{"queue.control.wait_us"}, chat::histogram{"queue.direct.wait_us"}, chat::histogram{"queue.fanout.wait_us"}};
+
+/**
+ * @brief is a message of this type, sent without an id, checked for repeats by its contents
+ *
+ * Only messages relayed to others, whose repeats other users would see; resending anything
+ * else is harmless or, like LIST, deliberate.
+ */
+bool dedup_by_contents(chat::chat_type type)
+{
+    return type == chat::BROADCAST || type == chat::DIRECTMESSAGE || type == chat::GROUP_MESSAGE || type == chat::PUBLISH;
+}
+
+/**
+ * @brief latency of traced messages, client send to server receive
+ */
+chat::histogram trace_uplink{"trace.uplink_us"};
+
+/**
+ * @brief latency of traced messages, server receive to each relayed send
+ */
+chat::histogram trace_server{"trace.server_us"};
+
+/**
+ * @brief immutable version of session and group state, walked lock-free by fan-out
+ *
+ * Holds addresses by value so a version stays valid after the session it was copied
+ * from has been deleted.
+ */
+struct roster
+{
+    // sorted by username, so it can be both searched and split into index ranges
+    std::vector<std::pair<std::string, sockaddr_in>> users;
+    group_members groups;
+    user_group_map user_groups;
+    // users that confirmed receiving the broadcast channel, and their group's channel
+    std::set<std::string, std::less<>> multicast_broadcasts;
+    std::set<std::string, std::less<>> multicast_groups;
+
+    /**
+     * @brief look up the address of an online user
+     * @param username user to find
+     * @return address, or nullptr if username is not online
+     */
+    const sockaddr_in *find(std::string_view username) const
+    {
+        auto it = lower_bound(username);
+        return it != users.end() && it->first == username ? &it->second : nullptr;
+    }
+
+    /**
+     * @brief add or replace an online user
+     */
+    void insert(std::string_view username, const sockaddr_in &address)
+    {
+        auto it = lower_bound(username);
+        if (it != users.end() && it->first == username)
+        {
+            it->second = address;
+        }
+        else
+        {
+            users.insert(it, {std::string{username}, address});
+        }
+    }
+
+    /**
+     * @brief first user, in name order, whose name sorts after cursor and is at least prefix
+     *
+     * Names starting with prefix are contiguous from here, so a page is this and the users
+     * following it while they still match.
+     *
+     * @param after name the previous page ended with, empty for the first page
+     * @param prefix only names starting with this are wanted
+     */
+    std::vector<std::pair<std::string, sockaddr_in>>::const_iterator seek(std::string_view after, std::string_view prefix) const
+    {
+        auto it = lower_bound(std::max(after, prefix));
+        if (it != users.end() && !after.empty() && it->first == after)
+        {
+            ++it;
+        }
+        return it;
+    }
+
+    /**
+     * @brief remove an online user, if present
+     */
+    void erase(std::string_view username)
+    {
+        auto it = lower_bound(username);
+        if (it != users.end() && it->first == username)
+        {
+            users.erase(it);
+        }
+        forget_multicast(username);
+    }
+
+    /**
+     * @brief send username unicast copies again, until it confirms its channels anew
+     */
+    void forget_multicast(std::string_view username)
+    {
+        if (auto it = multicast_broadcasts.find(username); it != multicast_broadcasts.end())
+        {
+            multicast_broadcasts.erase(it);
+        }
+        if (auto it = multicast_groups.find(username); it != multicast_groups.end())
+        {
+            multicast_groups.erase(it);
+        }
+    }
+
+private:
+    std::vector<std::pair<std::string, sockaddr_in>>::const_iterator lower_bound(std::string_view username) const
+    {
+        return std::lower_bound(users.begin(), users.end(), username,
+                                [](const std::pair<std::string, sockaddr_in> &user, std::string_view name)
+                                { return user.first < name; });
+    }
+
+    std::vector<std::pair<std::string, sockaddr_in>>::iterator lower_bound(std::string_view username)
+    {
+        return std::lower_bound(users.begin(), users.end(), username,
+                                [](const std::pair<std::string, sockaddr_in> &user, std::string_view name)
+                                { return user.first < name; });
+    }
+};
+
+/**
+ * @brief currently published roster, updated on join, leave, exit and group changes
+ */
+chat::rcu_snapshot<roster> roster_snapshot;
+
+/**
+ * @brief pool running handlers off the receive thread, nullptr when handlers run inline
+ */
+chat::work_pool *handler_pool = nullptr;
+
+/**
+ * @brief coalesces relayed messages per destination when CHAT_BUNDLE_US is set, otherwise nullptr
+ */
+chat::fanout_bundler<chat_socket> *bundler = nullptr;
+
+/**
+ * @brief channels broadcasts and group messages are multicast on when CHAT_MULTICAST is set
+ */
+chat::multicast_channels multicast;
+
+/**
+ * @brief the other nodes, who owns which user and who is online on them, when CHAT_FEDERATION is set
+ */
+chat::federation federation;
+
+/**
+ * @brief messages passed on to other nodes of the federation
+ */
+chat::counter federation_forwarded{"federation.forwarded"};
+
+/**
+ * @brief JOINs and RESUMEs sent on to the node owning their username
+ */
+chat::counter federation_redirects{"federation.redirects"};
+
+/**
+ * @brief loop running multi-step handler coroutines, e.g. the join sequence
+ */
+chat::event_loop *handler_loop = nullptr;
+
+/**
+ * @brief serialises handlers that modify online_users, groups and user_groups
+ */
+std::mutex state_mutex;
+
+/**
+ * @brief topic subscriptions of online users, keyed by username
+ */
+chat::topic_tree<std::string> topics;
+
+/**
+ * @brief guards topics, held only while subscribing or matching, never while sending
+ */
+std::mutex topics_mutex;
+
+/**
+ * @brief bulk transfer channel negotiated by OFFER and ACCEPT, null until the server starts it
+ */
+chat::blob_server *blob_service = nullptr;
+
+/**
+ * @brief call send_range over [0, count), split into stealable chunks when a pool is running
+ *
+ * Returns once every chunk has been sent, so send_range may refer to the caller's snapshot.
+ *
+ * @param count number of recipients
+ * @param send_range callable taking (begin, end) that sends to that range of recipients
+ */
+template <typename F>
+void fan_out(size_t count, F &&send_range)
+{
+    if (handler_pool != nullptr)
+    {
+        // chunks may run on other workers, carry the trace being relayed over to them
+        const chat::trace_extension *trace = chat::active_trace();
+        handler_pool->parallel_for(count, FAN_OUT_CHUNK, [&send_range, trace](size_t begin, size_t end)
+                                   {
+                                       chat::profile_span span{"fan_out_batch"};
+                                       chat::trace_scope tracing{trace};
+                                       send_range(begin, end); });
+    }
+    else
+    {
+        chat::profile_span span{"fan_out_batch"};
+        send_range(size_t{0}, count);
+    }
+}
+
+/**
+ * @brief send a relayed message, appending the trace of the message being handled if it had one
+ *
+ * @param sock socket to send on
+ * @param msg message to send
+ * @param address destination
+ * @return bytes of msg sent, or -1
+ */
+ssize_t send_relayed(chat_socket &sock, chat::message_span msg, const sockaddr_in &address)
+{
+    const chat::trace_extension *trace = chat::active_trace();
+    if (trace == nullptr && bundler != nullptr && msg.size() == sizeof(chat::chat_message))
+    {
+        bundler->add(*reinterpret_cast<const chat::chat_message *>(msg.data()), address);
+        return static_cast<ssize_t>(msg.size());
+    }
+    if (trace == nullptr)
+    {
+        return sock.sendto(msg.data(), msg.size(), 0, (sockaddr *)&address, sizeof(struct sockaddr_in));
+    }
+
+    chat::traced_message out;
+    memcpy(&out.message_, msg.data(), msg.size());
+    chat::trace_extension stamped = *trace;
+    stamped.server_send_ = chat::trace_clock();
+    chat::set_trace(out, stamped);
+    trace_server.record(chat::trace_hop(stamped.server_receive_, stamped.server_send_));
+
+    ssize_t len = sock.sendto(reinterpret_cast<const char *>(&out), sizeof(out), 0, (sockaddr *)&address, sizeof(struct sockaddr_in));
+    return len == static_cast<ssize_t>(sizeof(out)) ? static_cast<ssize_t>(msg.size()) : -1;
+}
+
+/**
+ * @brief next buffer of the calling thread's send ring
+ *
+ * Replies are built directly in the slot and sent synchronously, so a slot is free again
+ * once the handler that took it returns.
+ */
+chat::message_span send_slot()
+{
+    thread_local chat::send_ring<SEND_RING_SLOTS> ring;
+    return ring.next();
+}
+
 void handle_list(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop);
+    online_users &online_users, std::string_view username, std::string_view,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop);
 
 /**
  * @brief Send a given message to all clients
@@ -55,20 +450,86 @@ void handle_list(
  * @param send_to_username determines also to send to username
  */
 void send_all(
-    chat::chat_message &msg, std::string username, online_users &online_users,
-    uwe::socket &sock, bool send_to_username = true)
+    chat::chat_message &msg, std::string_view username, online_users &online_users,
+    chat_socket &sock, bool send_to_username = true)
+{
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+
+    fan_out(r->users.size(), [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i++)
+                {
+                    const auto &user = r->users[i];
+                    if ((send_to_username && user.first.compare(username) == 0) || user.first.compare(username) != 0)
+                    {
+                        int len = sock.sendto(
+                            reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
+                            (sockaddr *)&user.second, sizeof(struct sockaddr_in));
+                    }
+                } });
+}
+
+/**
+ * @brief offer a client the channel of a group, or of broadcasts, if multicasting
+ *
+ * Until the client confirms it has joined, it is still sent unicast copies.
+ *
+ * @param group group of the channel, empty for broadcasts
+ * @param address client to offer it to
+ * @param sock socket for communicting with client
+ */
+void offer_multicast(std::string_view group, const sockaddr_in &address, chat_socket &sock)
 {
-    for (const auto user : online_users)
+    if (!multicast.enabled())
     {
-        if ((send_to_username && user.first.compare(username) == 0) || user.first.compare(username) != 0)
-        {
-            int len = sock.sendto(
-                reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
-                (sockaddr *)user.second, sizeof(struct sockaddr_in));
-        }
+        return;
+    }
+    std::string channel = chat::format_channel(group.empty() ? multicast.broadcasts() : multicast.group(group));
+    chat::chat_message offer = chat::multicast_msg({}, group, channel);
+    sock.sendto(reinterpret_cast<const char *>(&offer), sizeof(offer), 0, (sockaddr *)&address, sizeof(address));
+}
+
+/**
+ * @brief pass a message on to another node of the federation
+ *
+ * Never bundled or traced, nodes only take whole messages from each other, each sealed
+ * so the node can tell it from one spoofed from our address.
+ *
+ * @param msg message to pass on
+ * @param node address of the node
+ * @param sock socket for communicting with the node
+ */
+void forward_to_node(chat::message_span msg, const sockaddr_in &node, chat_socket &sock)
+{
+    federation_forwarded.add();
+    char sealed[sizeof(chat::chat_message) + sizeof(chat::peer_seal)];
+    memcpy(sealed, msg.data(), msg.size());
+    size_t length = federation.seal(sealed, msg.size(), node);
+    if (length > 0)
+    {
+        sock.sendto(sealed, length, 0, (sockaddr *)&node, sizeof(node));
     }
 }
 
+/**
+ * @brief pass a message on to every other node of the federation, if there are any
+ */
+void forward_to_peers(chat::message_span msg, chat_socket &sock)
+{
+    federation.for_each_peer([&](const sockaddr_in &node)
+                             { forward_to_node(msg, node, sock); });
+}
+
+/**
+ * @brief tell the other nodes of the federation a user of this node came online or went offline
+ */
+void announce_presence(std::string_view username, bool online, chat_socket &sock)
+{
+    chat::chat_message presence = chat::presence_msg(username, online ? "+" : "-");
+    forward_to_peers(chat::as_span(presence), sock);
+}
+
 /**
  * @brief handle sending an error and incoming error messages
  *
@@ -79,14 +540,76 @@ void send_all(
  * @param sock socket for communicting with client
  * @parm exit_loop set to true if event loop is to terminate
  */
-void handle_error(uint16_t err, struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+void handle_error(uint16_t err, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    auto msg = chat::error_msg(err);
+    PROFILE_FUNCTION();
+    chat::message_span out = send_slot();
+    chat::write_error(out, err);
     int len = sock.sendto(
-        reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
+        out.data(), out.size(), 0,
         (sockaddr *)&client_address, sizeof(struct sockaddr_in));
 }
 
+/**
+ * @brief send a broadcast, whole or a fragment of one, to everyone but its sender
+ *
+ * Decorates the sender with their group if they have one, then sends it on the broadcast
+ * channel, to every other user not on the channel and to the other nodes.
+ *
+ * @param r current roster
+ * @param m the broadcast, built in a send slot
+ * @param username sender of the broadcast
+ * @param client_address address it was received from
+ * @param sock socket for communicting with clients
+ */
+void relay_broadcast(const roster *r, chat::message_span m, std::string_view username, struct sockaddr_in &client_address, chat_socket &sock)
+{
+    // another node passes on its users' broadcasts already decorated, to be sent to ours only
+    bool from_peer = federation.is_peer(client_address);
+
+    auto it = r->user_groups.find(username);
+    if (!from_peer && it != r->user_groups.end())
+    {
+        chat::append_field(m, chat::wire::USERNAME_OFFSET, MAX_USERNAME_LENGTH, "[");
+        chat::append_field(m, chat::wire::USERNAME_OFFSET, MAX_USERNAME_LENGTH, it->second);
+        chat::append_field(m, chat::wire::USERNAME_OFFSET, MAX_USERNAME_LENGTH, "]");
+    }
+
+    // the network copies it to users on the broadcast channel, the sender drops its own copy
+    bool multicasting = multicast.enabled() && !r->multicast_broadcasts.empty();
+    if (multicasting)
+    {
+        multicast.send(m.data(), m.size(), multicast.broadcasts());
+    }
+
+    // send message to all other users, except the one we received it from
+    fan_out(r->users.size(), [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i++)
+                {
+                    const auto &user = r->users[i];
+                    LOG_TRACE("username %s\n", user.first.c_str());
+                    if (multicasting && r->multicast_broadcasts.count(user.first) > 0)
+                    {
+                        continue;
+                    }
+                    if (client_address.sin_addr.s_addr != user.second.sin_addr.s_addr ||
+                        client_address.sin_port != user.second.sin_port)
+                    {
+                        ssize_t len = send_relayed(sock, m, user.second);
+                    }
+                    else
+                    {
+                        LOG_TRACE("Not sending message to self: %s\n", username);
+                    }
+                } });
+
+    if (!from_peer)
+    {
+        forward_to_peers(m, sock);
+    }
+}
+
 /**
  * @brief handle broadcast message
  *
@@ -97,33 +620,88 @@ void handle_error(uint16_t err, struct sockaddr_in &client_address, uwe::socket
  * @param sock socket for communicting with client
  * @parm exit_loop set to true if event loop is to terminate
  */
-void handle_broadcast(online_users &online_users, std::string username, std::string msg, struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+void handle_broadcast(online_users &online_users, std::string_view username, std::string_view msg, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received broadcast\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received broadcast\n");
 
-    auto it = user_groups.find(username);
-    if (it != user_groups.end())
-    {
-        username += "[" + it->second + "]";
-    }
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
 
-    // send message to all users, except the one we received it from
-    for (const auto user : online_users)
+    // build the message in place
+    chat::message_span m = send_slot();
+    chat::write_message(m, chat::BROADCAST, username, {}, msg);
+    relay_broadcast(r, m, username, client_address, sock);
+}
+
+/**
+ * @brief coroutine finishing a join once the session has been registered
+ *
+ * Sends JACK, tells everyone else about the new user, sends the welcome DM and finally the
+ * user list. Sends are awaited on the handler loop, so many joins can be in flight at once.
+ * If JACK cannot be sent the session is removed again.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username name of the user that joined
+ * @param token resumption token of the new session
+ * @param client_address address of the user that joined
+ * @param sock socket for communicting with client
+ */
+chat::task join_sequence(online_users &online_users, std::string username, std::string token, struct sockaddr_in client_address, chat_socket &sock)
+{
+    // Send back a JACK message to the client that has joined, with its resumption token
+    auto jack_message = chat::jack_msg(token);
+    ssize_t sent_bytes = co_await chat::async_sendto(*handler_loop, sock, jack_message, client_address);
+
+    // Check if the JACK message was sent successfully
+    if (sent_bytes != sizeof(jack_message))
     {
-        DEBUG("username %s\n", user.first.c_str());
-        if (strcmp(inet_ntoa(client_address.sin_addr), inet_ntoa(user.second->sin_addr)) == 0 &&
-            client_address.sin_port != user.second->sin_port)
-        {
-            auto m = chat::broadcast_msg(username, msg);
-            int len = sock.sendto(
-                reinterpret_cast<const char *>(&m), sizeof(chat::chat_message), 0,
-                (sockaddr *)user.second, sizeof(struct sockaddr_in));
-        }
-        else
+        LOG_WARN("Failed to send JACK message to new user: %s\n", username.c_str());
+
+        std::lock_guard<std::mutex> lock{state_mutex};
+        auto it = online_users.find(username);
+        if (it != online_users.end() &&
+            it->second->sin_addr.s_addr == client_address.sin_addr.s_addr &&
+            it->second->sin_port == client_address.sin_port)
         {
-            DEBUG("Not sending message to self: %s\n", msg.c_str());
+            session_pool.destroy(it->second); // free the session record
+            online_users.erase(it); // Remove the new user from the map
+            resume_tokens.erase(username);
+            roster_snapshot.update([&](roster &r)
+                                   { r.erase(username); });
+            announce_presence(username, false, sock);
         }
+        co_return;
     }
+
+    // broadcasts may come over multicast once the client joins the channel
+    offer_multicast({}, client_address, sock);
+
+    // Send a broadcast message to all other clients about the new join
+    chat::chat_message broadcast_msg = chat::broadcast_msg("Server", username + " has joined the chat.");
+    send_all(broadcast_msg, username, online_users, sock, false);
+    forward_to_peers(chat::as_span(broadcast_msg), sock);
+
+    // Get the current time
+    auto now = std::chrono::system_clock::now();
+    auto now_c = std::chrono::system_clock::to_time_t(now);
+    struct tm now_tm;
+    localtime_r(&now_c, &now_tm);
+
+    std::stringstream time_stream;
+    time_stream << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
+
+    // Send a private welcome message to the new user
+    std::string welcome_msg = "Welcome to the chat, " + username + "! It is now " + time_stream.str();
+    chat::chat_message priv_welcome_msg = chat::dm_msg("Server", welcome_msg);
+    sent_bytes = co_await chat::async_sendto(*handler_loop, sock, priv_welcome_msg, client_address);
+    if (sent_bytes != sizeof(priv_welcome_msg))
+    {
+        LOG_WARN("Failed to send private welcome message to new user\n");
+    }
+
+    bool exit_loop = false;
+    handle_list(online_users, "__ALL", "", client_address, sock, exit_loop);
 }
 
 /**
@@ -139,9 +717,10 @@ void handle_broadcast(online_users &online_users, std::string username, std::str
 
 ///////////////////////////////////// WORKSHEET IMPLEMENTATION  //////////////////////////////////////////////////////
 void handle_join(
-    online_users &online_users, std::string username, std::string, struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received join\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received join\n");
 
     // Check if user is already online
     if (online_users.find(username) != online_users.end())
@@ -153,62 +732,73 @@ void handle_join(
     // Check if the username is valid
     if (username.empty() || username.length() > MAX_USERNAME_LENGTH)
     {
-        DEBUG("Invalid username encountered: %s\n", username.c_str());
+        LOG_WARN("Invalid username encountered: %s\n", username);
         handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
         return; // Early return on invalid username
     }
 
-    // Allocate new sockaddr_in structure and copy the client address into it
-    sockaddr_in *client_addr = new sockaddr_in(client_address);
+    // Allocate a session record and copy the client address into it
+    sockaddr_in *client_addr = session_pool.create(client_address);
 
     // Add the new user to the map
-    online_users[username] = client_addr;
+    online_users.emplace(std::string{username}, client_addr);
+    roster_snapshot.update([&](roster &r)
+                           { r.insert(username, client_address); });
+    announce_presence(username, true, sock);
 
-    // Send back a JACK message to the client that has joined
-    auto jack_message = chat::jack_msg();
-    ssize_t sent_bytes = sock.sendto(reinterpret_cast<const char *>(&jack_message), sizeof(jack_message), 0,
-                                     (sockaddr *)&client_address, sizeof(client_address));
+    // the rest of the join talks to clients only, so it continues on the loop
+    handler_loop->spawn(join_sequence(online_users, std::string{username}, issue_resume_token(username), client_address, sock));
+}
 
-    // Check if the JACK message was sent successfully
-    if (sent_bytes != sizeof(jack_message))
-    {
-        DEBUG("Failed to send JACK message to new user: %s\n", username.c_str());
-        delete client_addr;           // free the allocated memory
-        online_users.erase(username); // Remove the new user from the map
-    }
-    else
-    {
-        // Send a broadcast message to all other clients about the new join
-        chat::chat_message broadcast_msg = chat::broadcast_msg("Server", username + " has joined the chat.");
-        for (const auto &[user, addr] : online_users)
-        {
-            if (user != username) // Avoid sending the message to the user who just joined
-            {
-                sent_bytes = sock.sendto(reinterpret_cast<const char *>(&broadcast_msg), sizeof(broadcast_msg), 0, (sockaddr *)addr, sizeof(struct sockaddr_in));
-                if (sent_bytes != sizeof(broadcast_msg))
-                {
-                    DEBUG("Failed to send broadcast message to user %s\n", user.c_str());
-                }
-            }
-        }
-
-        // Get the current time
-        auto now = std::chrono::system_clock::now();
-        auto now_c = std::chrono::system_clock::to_time_t(now);
+/**
+ * @brief handle resume message
+ *
+ * Moves the session of username, with its groups and subscriptions, to the address the
+ * RESUME came from, without telling anyone else. The token is replaced by a new one in the
+ * JACK sent back, so each token can be used once.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param token part of chat protocol packet, the token from the user's last JACK
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_resume(
+    online_users &online_users, std::string_view username, std::string_view token,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received resume for %s\n", username);
+
+    auto session = online_users.find(username);
+    auto held = resume_tokens.find(username);
+    uint64_t presented;
+    if (session == online_users.end() || held == resume_tokens.end() ||
+        token.size() != RESUME_TOKEN_LENGTH || !chat::parse_hex(token, presented) || presented != held->second)
+    {
+        handle_error(ERR_RESUME_REFUSED, client_address, sock, exit_loop);
+        return;
+    }
 
-        std::stringstream time_stream;
-        time_stream << std::put_time(std::localtime(&now_c), "%Y-%m-%d %H:%M:%S");
+    *session->second = client_address;
+    if (auto detached = detached_sessions.find(username); detached != detached_sessions.end())
+    {
+        detached_sessions.erase(detached);
+    }
+    roster_snapshot.update([&](roster &r)
+                           {
+                               r.insert(username, client_address);
+                               // the client may be a new process that has not joined the channels
+                               r.forget_multicast(username); });
 
-        // Send a private welcome message to the new user
-        std::string welcome_msg = "Welcome to the chat, " + username + "! It is now " + time_stream.str();
-        chat::chat_message priv_welcome_msg = chat::dm_msg("Server", welcome_msg);
-        sent_bytes = sock.sendto(reinterpret_cast<const char *>(&priv_welcome_msg), sizeof(priv_welcome_msg), 0, (sockaddr *)&client_address, sizeof(client_address));
-        if (sent_bytes != sizeof(priv_welcome_msg))
-        {
-            DEBUG("Failed to send private welcome message to new user\n");
-        }
+    auto jack_message = chat::jack_msg(issue_resume_token(username));
+    sock.sendto(reinterpret_cast<const char *>(&jack_message), sizeof(jack_message), 0, (sockaddr *)&client_address, sizeof(struct sockaddr_in));
 
-        handle_list(online_users, "__ALL", "", client_address, sock, exit_loop);
+    offer_multicast({}, client_address, sock);
+    if (auto group = user_groups.find(username); group != user_groups.end())
+    {
+        offer_multicast(group->second, client_address, sock);
     }
 }
 
@@ -223,10 +813,11 @@ void handle_join(
  * @parm exit_loop set to true if event loop is to terminate
  */
 void handle_jack(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received jack\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received jack\n");
     handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
 }
 
@@ -250,72 +841,168 @@ void handle_jack(
 // and if so send message with chat::dm_msg()
 
 void handle_directmessage(
-    online_users &online_users, std::string username, std::string message,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view message,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received directmessage to %s\n", username.c_str());
-    DEBUG("Raw Message Recieved for DM: %s\n", message.c_str());
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received directmessage to %s\n", username);
+    LOG_DEBUG("Raw Message Recieved for DM: %s\n", message);
 
     // Extract the recipient username and actual message
     std::size_t colon_pos = message.find(':');
-    if (colon_pos == std::string::npos)
+    if (colon_pos == std::string_view::npos)
     {
-        DEBUG("Invalid DM format, missing colon. Received: %s\n", message.c_str());
+        LOG_DEBUG("Invalid DM format, missing colon. Received: %s\n", message);
         return; // Invalid format, could log or handle error here
     }
 
-    std::string recipient_username = message.substr(0, colon_pos);
-    std::string actual_message = message.substr(colon_pos + 1);
-    DEBUG("Parsed DM: Recipient: %s, Message: %s\n", recipient_username.c_str(), actual_message.c_str());
+    std::string_view recipient_username = message.substr(0, colon_pos);
+    std::string_view actual_message = message.substr(colon_pos + 1);
+    LOG_DEBUG("Parsed DM: Recipient: %s, Message: %s\n", recipient_username, actual_message);
+
+    // another node passes on DMs from its users to ours, having checked the sender itself
+    bool from_peer = federation.is_peer(client_address);
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
 
     // Find the sender in the online_users map
-    auto sender_it = online_users.find(username);
-    if (sender_it == online_users.end() || sender_it->second->sin_addr.s_addr != client_address.sin_addr.s_addr)
+    const sockaddr_in *sender_addr = r->find(username);
+    if (!from_peer && (sender_addr == nullptr || sender_addr->sin_addr.s_addr != client_address.sin_addr.s_addr))
     {
-        DEBUG("Sender %s not found\n", username.c_str());
+        LOG_DEBUG("Sender %s not found\n", username);
         return;
     }
 
-    DEBUG("Parsed DM: To %s, Message %s\n", recipient_username.c_str(), actual_message.c_str());
+    LOG_DEBUG("Parsed DM: To %s, Message %s\n", recipient_username, actual_message);
 
     // Find the recipient in the online_users map
-    auto recipient_it = online_users.find(recipient_username);
-    if (recipient_it != online_users.end())
+    const sockaddr_in *recipient_addr = r->find(recipient_username);
+    if (recipient_addr != nullptr)
     {
-        DEBUG("Sending DM to %s\n", recipient_username.c_str());
+        LOG_DEBUG("Sending DM to %s\n", recipient_username);
 
         // Create DM message
-        chat::chat_message dm_msg = chat::dm_msg(username, actual_message);
+        chat::message_span dm_msg = send_slot();
+        chat::write_message(dm_msg, chat::DIRECTMESSAGE, username, {}, actual_message);
 
         // Send DM to the recipient
-        ssize_t sent_bytes = sock.sendto(reinterpret_cast<const char *>(&dm_msg), sizeof(dm_msg), 0, (sockaddr *)recipient_it->second, sizeof(struct sockaddr_in));
-        if (sent_bytes != sizeof(dm_msg))
+        ssize_t sent_bytes = send_relayed(sock, dm_msg, *recipient_addr);
+        if (sent_bytes != static_cast<ssize_t>(dm_msg.size()))
         {
-            DEBUG("Failed to send DM to %s\n", recipient_username.c_str());
+            LOG_WARN("Failed to send DM to %s\n", recipient_username);
         }
     }
+    else if (sockaddr_in node; !from_peer && federation.locate(recipient_username, node))
+    {
+        // the recipient's node delivers it
+        chat::message_span forward = send_slot();
+        chat::write_message(forward, chat::DIRECTMESSAGE, username, {}, message);
+        forward_to_node(forward, node, sock);
+    }
+    else if (from_peer)
+    {
+        LOG_DEBUG("Recipient %s has gone, DM from another node dropped\n", recipient_username);
+    }
     else
     {
-        DEBUG("Recipient %s not found\n", recipient_username.c_str());
-        chat::chat_message err_msg = chat::error_msg(ERR_UNKNOWN_USERNAME);
-        sock.sendto(reinterpret_cast<const char *>(&err_msg), sizeof(err_msg), 0, (sockaddr *)&client_address, sizeof(client_address));
+        LOG_DEBUG("Recipient %s not found\n", recipient_username);
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+    }
+}
+/**
+ * @brief send one page of the users whose names start with a prefix, in name order
+ *
+ * The names go in message separated by ':', and the name to continue after in groupname,
+ * which is empty on the last page. A page stops early rather than split a name. Users
+ * online on other nodes of the federation are merged in, as in the full list.
+ *
+ * @param query "limit:after:prefix", limit is capped at LIST_PAGE_MAX and after is the cursor from the previous page
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ */
+void handle_list_page(std::string_view query, struct sockaddr_in &client_address, chat_socket &sock)
+{
+    std::string_view limit_text = query.substr(0, query.find(':'));
+    query.remove_prefix(std::min(query.size(), limit_text.size() + 1));
+    std::string_view after = query.substr(0, query.find(':'));
+    query.remove_prefix(std::min(query.size(), after.size() + 1));
+    std::string_view prefix = query;
+
+    uint64_t limit = 0;
+    if (!chat::parse_number(limit_text, limit) || limit == 0 || limit > LIST_PAGE_MAX)
+    {
+        limit = LIST_PAGE_MAX;
+    }
+
+    char names[MAX_MESSAGE_LENGTH];
+    size_t used = 0;
+    std::string_view last;
+
+    // one more remote name than fits, so whether there are more is known
+    std::vector<std::string> remote = federation.remote_users(after, prefix, limit + 1);
+    auto remote_it = remote.cbegin();
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+    auto it = r->seek(after, prefix);
+    auto local_left = [&]()
+    { return it != r->users.end() && it->first.starts_with(prefix); };
+    for (uint64_t count = 0; count < limit && (local_left() || remote_it != remote.cend()); count++)
+    {
+        bool local = local_left() && (remote_it == remote.cend() || it->first <= *remote_it);
+        std::string_view name = local ? std::string_view{it->first} : std::string_view{*remote_it};
+        size_t separator = used > 0 ? 1 : 0;
+        if (used + separator + name.size() >= sizeof(names))
+        {
+            break;
+        }
+        if (separator)
+        {
+            names[used++] = ':';
+        }
+        memcpy(names + used, name.data(), name.size());
+        used += name.size();
+        last = name;
+        if (local)
+        {
+            ++it;
+        }
+        else
+        {
+            ++remote_it;
+        }
     }
+    bool more = local_left() || remote_it != remote.cend();
+
+    chat::message_span m = send_slot();
+    chat::write_message(m, chat::LIST, {}, more ? last : std::string_view{}, std::string_view{names, used});
+    sock.sendto(m.data(), m.size(), 0, (sockaddr *)&client_address, sizeof(struct sockaddr_in));
 }
+
 /**
  * @brief handle list message
  *
  * @param online_users map of usernames to their corresponding IP:PORT address
  * @param username part of chat protocol packet
- * @param msg part of chat protocol packet
+ * @param query part of chat protocol packet, "limit:after:prefix" for one page or empty for all users
  * @param client_address address of client to send message to
  * @param sock socket for communicting with client
  * @parm exit_loop set to true if event loop is to terminate
  */
 void handle_list(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view query,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received list\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received list\n");
+
+    // a query asks for one page rather than everyone
+    if (!query.empty())
+    {
+        handle_list_page(query, client_address, sock);
+        return;
+    }
 
     int username_size = MAX_USERNAME_LENGTH;
     int message_size = MAX_MESSAGE_LENGTH;
@@ -328,16 +1015,29 @@ void handle_list(
     bool using_username = true;
     bool full = false;
 
-    for (const auto user : online_users)
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+
+    // users online on other nodes of the federation are listed after this node's own
+    std::vector<std::string> remote_users = federation.remote_users();
+    std::vector<std::string_view> names;
+    names.reserve(r->users.size() + remote_users.size());
+    for (const auto &user : r->users)
+    {
+        names.push_back(user.first);
+    }
+    names.insert(names.end(), remote_users.begin(), remote_users.end());
+
+    for (std::string_view name : names)
     {
         if (using_username)
         {
-            if (username_size - (user.first.length() + 1) >= 0)
+            if (username_size - static_cast<int>(name.length() + 1) > 0)
             {
-                memcpy(username_ptr, user.first.c_str(), user.first.length());
-                *(username_ptr + user.first.length()) = ':';
-                username_ptr = username_ptr + user.first.length() + 1;
-                username_size = username_size - (user.first.length() + 1);
+                memcpy(username_ptr, name.data(), name.length());
+                *(username_ptr + name.length()) = ':';
+                username_ptr = username_ptr + name.length() + 1;
+                username_size = username_size - (name.length() + 1);
                 username_data[MAX_USERNAME_LENGTH - username_size] = '\0';
             }
             else
@@ -349,12 +1049,12 @@ void handle_list(
         // otherwise we fill the message field
         if (!using_username)
         {
-            if (message_size - (user.first.length() + 1) >= 0)
+            if (message_size - static_cast<int>(name.length() + 1) > 0)
             {
-                memcpy(message_ptr, user.first.c_str(), user.first.length());
-                *(message_ptr + user.first.length()) = ':';
-                message_ptr = message_ptr + user.first.length() + 1;
-                message_size = message_size - (user.first.length() + 1);
+                memcpy(message_ptr, name.data(), name.length());
+                *(message_ptr + name.length()) = ':';
+                message_ptr = message_ptr + name.length() + 1;
+                message_size = message_size - (name.length() + 1);
             }
             else
             {
@@ -390,7 +1090,7 @@ void handle_list(
 
     if (using_username)
     {
-        if (username_size >= 4)
+        if (username_size > 4)
         {
             // enough space to store end in username
             memcpy(&username_data[MAX_USERNAME_LENGTH - username_size], USER_END, strlen(USER_END));
@@ -409,7 +1109,7 @@ void handle_list(
 
     chat::chat_message msg{chat::LIST, '\0', '\0'};
     username_data[MAX_USERNAME_LENGTH - username_size] = '\0';
-    DEBUG("username_data = %s\n", username_data);
+    LOG_DEBUG("username_data = %s\n", username_data);
     memcpy(msg.username_, &username_data[0], MAX_USERNAME_LENGTH - username_size);
     message_data[MAX_MESSAGE_LENGTH - message_size] = '\0';
     memcpy(msg.message_, &message_data[0], MAX_MESSAGE_LENGTH - message_size);
@@ -426,6 +1126,47 @@ void handle_list(
     }
 }
 
+/**
+ * @brief end the session of an online user, telling everyone it has left. Called under state_mutex
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username user whose session ends, which must be in online_users
+ * @param sock socket for communicting with clients
+ */
+void drop_session(online_users &online_users, std::string username, chat_socket &sock)
+{
+    auto search = online_users.find(username);
+
+    // sned a broadcast message mentioing the user has left
+    std::string leave_message = username + " has left!";
+    chat::chat_message broadcast_msg = chat::broadcast_msg("Server", leave_message);
+    send_all(broadcast_msg, username, online_users, sock, false);
+    forward_to_peers(chat::as_span(broadcast_msg), sock);
+
+    // first free memory for sockaddr
+    struct sockaddr_in *addr = search->second;
+    session_pool.destroy(addr);
+
+    // drop the user's topic subscriptions
+    {
+        std::lock_guard<std::mutex> lock{topics_mutex};
+        topics.unsubscribe_all(username);
+    }
+
+    // now delete from username map
+    online_users.erase(search);
+    resume_tokens.erase(username);
+    detached_sessions.erase(username);
+    roster_snapshot.update([&](roster &r)
+                           { r.erase(username); });
+    announce_presence(username, false, sock);
+
+    // handle_broadcast(online_users, username, "has left the server", client_address, sock, exit_loop);
+    chat::chat_message msg = chat::chat_message{chat::LEAVE, '\0', '\0'};
+    memcpy(msg.username_, username.c_str(), username.length() + 1);
+    send_all(msg, username, online_users, sock, false);
+}
+
 /**
  * @brief handle leave message
  *
@@ -437,22 +1178,24 @@ void handle_list(
  * @parm exit_loop set to true if event loop is to terminate
  */
 void handle_leave(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view, std::string_view,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received leave\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received leave\n");
 
-    username = "";
-    // find username
-    for (const auto user : online_users)
+    std::string username = "";
+    // find username, comparing the address itself as every stream client of a transport has the same port
+    for (const auto &user : online_users)
     {
-        if (strcmp(inet_ntoa(client_address.sin_addr), inet_ntoa(user.second->sin_addr)) == 0 &&
+        if (client_address.sin_addr.s_addr == user.second->sin_addr.s_addr &&
             client_address.sin_port == user.second->sin_port)
         {
             username = user.first;
+            break;
         }
     }
-    DEBUG("%s is leaving the sever\n", username.c_str());
+    LOG_DEBUG("%s is leaving the sever\n", username.c_str());
 
     if (username.length() == 0)
     {
@@ -461,29 +1204,13 @@ void handle_leave(
     }
     else if (auto search = online_users.find(username); search != online_users.end())
     {
-
-        // sned a broadcast message mentioing the user has left
-        std::string leave_message = username + " has left!";
-        chat::chat_message broadcast_msg = chat::broadcast_msg("Server", leave_message);
-        send_all(broadcast_msg, username, online_users, sock, false);
-
-        // first free memory for sockaddr
-        struct sockaddr_in *addr = search->second;
-        delete addr;
-
-        // now delete from username map
-        online_users.erase(search);
+        drop_session(online_users, username, sock);
 
         // finally send back LACK
         auto msg = chat::lack_msg();
         int len = sock.sendto(
             reinterpret_cast<const char *>(&msg), sizeof(chat::chat_message), 0,
             (sockaddr *)&client_address, sizeof(struct sockaddr_in));
-
-        // handle_broadcast(online_users, username, "has left the server", client_address, sock, exit_loop);
-        msg = chat::chat_message{chat::LEAVE, '\0', '\0'};
-        memcpy(msg.username_, username.c_str(), username.length() + 1);
-        send_all(msg, username, online_users, sock, false);
     }
     else
     {
@@ -491,6 +1218,70 @@ void handle_leave(
     }
 }
 
+/**
+ * @brief coroutine dropping a detached session once its grace period is over, unless resumed
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username user whose stream connection was lost
+ * @param expiry end of the grace period the session was detached with
+ * @param sock socket for communicting with clients
+ */
+chat::task expire_session(online_users &online_users, std::string username, std::chrono::steady_clock::time_point expiry, chat_socket &sock)
+{
+    // checking every second, as the loop only stops once no coroutine is asleep and an EXIT
+    // clears the detached sessions
+    for (;;)
+    {
+        co_await handler_loop->sleep_for(std::min<std::chrono::steady_clock::duration>(
+            expiry - std::chrono::steady_clock::now(), std::chrono::seconds(1)));
+
+        std::lock_guard<std::mutex> lock{state_mutex};
+        auto detached = detached_sessions.find(username);
+        if (detached == detached_sessions.end() || detached->second != expiry)
+        {
+            // resumed, or left, in time
+            co_return;
+        }
+        if (std::chrono::steady_clock::now() < expiry)
+        {
+            continue;
+        }
+        detached_sessions.erase(detached);
+        if (online_users.find(username) != online_users.end())
+        {
+            LOG_DEBUG("%s did not resume in time\n", username.c_str());
+            drop_session(online_users, username, sock);
+        }
+        co_return;
+    }
+}
+
+/**
+ * @brief keep the session of a stream client whose connection closed, for it to RESUME
+ *
+ * The user stays online to everyone else for RESUME_GRACE_SECONDS, so a brief loss of the
+ * connection costs no presence broadcasts. Only if it has not resumed by then is it dropped
+ * as if it had left.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param address address of the closed connection
+ * @param sock socket for communicting with clients
+ */
+void detach_session(online_users &online_users, const sockaddr_in &address, chat_socket &sock)
+{
+    std::lock_guard<std::mutex> lock{state_mutex};
+    for (const auto &user : online_users)
+    {
+        if (user.second->sin_addr.s_addr == address.sin_addr.s_addr && user.second->sin_port == address.sin_port)
+        {
+            auto expiry = std::chrono::steady_clock::now() + std::chrono::seconds(RESUME_GRACE_SECONDS);
+            detached_sessions.insert_or_assign(user.first, expiry);
+            handler_loop->spawn(expire_session(online_users, user.first, expiry, sock));
+            return;
+        }
+    }
+}
+
 /**
  * @brief handle lack message
  *
@@ -502,10 +1293,11 @@ void handle_leave(
  * @parm exit_loop set to true if event loop is to terminate
  */
 void handle_lack(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received lack\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received lack\n");
     handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
 }
 
@@ -522,10 +1314,11 @@ void handle_lack(
 
 ///////////////////////////////////// WORKSHEET IMPLEMENTATION //////////////////////////////////////////////////////
 void handle_exit(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received exit\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received exit\n");
 
     // Create exit message
     chat::chat_message exit_message = chat::exit_msg();
@@ -536,16 +1329,28 @@ void handle_exit(
         ssize_t send_bytes = sock.sendto(reinterpret_cast<const char *>(&exit_message), sizeof(exit_message), 0, (sockaddr *)addr, sizeof(struct sockaddr_in));
         if (send_bytes != sizeof(exit_message))
         {
-            DEBUG("Failed to send exit message to user %s\n", user.c_str());
+            LOG_WARN("Failed to send exit message to user %s\n", user.c_str());
         }
     }
 
-    // Clear up memory for each user
+    // Clear up memory for each user, who the other nodes no longer find here
     for (const auto &user : online_users)
     {
-        delete user.second;
+        announce_presence(user.first, false, sock);
+        session_pool.destroy(user.second);
     }
     online_users.clear();
+    resume_tokens.clear();
+    detached_sessions.clear();
+    roster_snapshot.update([](roster &r)
+                           {
+                               r.users.clear();
+                               r.multicast_broadcasts.clear();
+                               r.multicast_groups.clear(); });
+    {
+        std::lock_guard<std::mutex> lock{topics_mutex};
+        topics.clear();
+    }
 
     // Leave this code as it is required for exiting
     exit_loop = true;
@@ -558,10 +1363,11 @@ void handle_exit(
     user_group_map &user_groups,
     const std::string &username,
     struct sockaddr_in &client_address,
-    uwe::socket &sock,
+    chat_socket &sock,
     bool &exit_loop)
 {
-    DEBUG("Handling client exit for username: %s\n", username.c_str());
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Handling client exit for username: %s\n", username.c_str());
 
     // Remove the user from the online_users map
     auto user_it = online_users.find(username);
@@ -590,7 +1396,7 @@ void handle_exit(
         }
     }
 
-        DEBUG("Exit handled for username: %s\n", username.c_str());
+        LOG_DEBUG("Exit handled for username: %s\n", username.c_str());
 }
 */
 
@@ -605,10 +1411,11 @@ void handle_exit(
  * @parm exit_loop set to true if event loop is to terminate
  */
 void handle_error(
-    online_users &online_users, std::string username, std::string,
-    struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+    online_users &online_users, std::string_view username, std::string_view,
+    struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received error\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received error\n");
 }
 
 /**
@@ -624,9 +1431,10 @@ void handle_error(
  * @param username The username of the user creating the group. This user is automatically added as a member of the new group.
  * @param group_name The name of the group being created. The function checks to ensure no group with this name already exists.
  */
-void handle_creategroup(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string username, std::string group_name, struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+void handle_creategroup(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string username, std::string group_name, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received creategroup\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received creategroup\n");
     if (groups.find(group_name) != groups.end())
     {
         handle_error(ERR_GROUP_ALREADY_EXISTS, client_address, sock, exit_loop);
@@ -635,19 +1443,18 @@ void handle_creategroup(online_users &online_users, group_members &groups, user_
     {
         groups[group_name].push_back(username);
         user_groups[username] = group_name;
+        roster_snapshot.update([&](roster &r)
+                               {
+                                   r.groups[group_name].push_back(username);
+                                   r.user_groups[username] = group_name;
+                                   r.multicast_groups.erase(username); });
+        offer_multicast(group_name, client_address, sock);
 
         std::string created_message = username + " created a new group: " + group_name;
-        // chat::chat_message custom_msg = chat::broadcast_msg("Server", created_message);
-        for (const auto &user : online_users)
-        {
-            // Send the message to all users except the one who created the group
-            if (user.first != username)
-            {
-                chat::chat_message custom_msg = chat::broadcast_msg("Server", created_message);
-                sock.sendto(reinterpret_cast<const char *>(&custom_msg), sizeof(custom_msg), 0, (sockaddr *)user.second, sizeof(struct sockaddr_in));
-            }
-        }
-        DEBUG("Username: %s, Group Name: %s\n", username.c_str(), group_name.c_str());
+        // Send the message to all users except the one who created the group
+        chat::chat_message custom_msg = chat::broadcast_msg("Server", created_message);
+        send_all(custom_msg, username, online_users, sock, false);
+        LOG_DEBUG("Username: %s, Group Name: %s\n", username.c_str(), group_name.c_str());
 
         // send a confirmation message to the user who created the group
         std::string confirmation_message = "You've created a new group " + group_name;
@@ -670,12 +1477,16 @@ void handle_creategroup(online_users &online_users, group_members &groups, user_
  * @param group_name The name of the group to which the user is to be added.
  */
 
-void handle_add_to_group(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string username, std::string group_name, struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+void handle_add_to_group(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string username, std::string group_name, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received addtogroup\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received addtogroup\n");
+
+    // another node passes on additions of our users to its groups, which are made here if new
+    bool from_peer = federation.is_peer(client_address);
 
     // Check if the group exists
-    if (groups.find(group_name) == groups.end())
+    if (!from_peer && groups.find(group_name) == groups.end())
     {
         handle_error(ERR_GROUP_NOT_FOUND, client_address, sock, exit_loop);
         return;
@@ -684,7 +1495,22 @@ void handle_add_to_group(online_users &online_users, group_members &groups, user
     // Check if the user exists in online users
     if (online_users.find(username) == online_users.end())
     {
-        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        sockaddr_in node;
+        if (from_peer)
+        {
+            LOG_DEBUG("User %s has gone, addition from another node dropped\n", username.c_str());
+        }
+        else if (federation.locate(username, node))
+        {
+            // the user's node adds them and tells the group's members there
+            chat::message_span forward = send_slot();
+            chat::write_message(forward, chat::ADD_TO_GROUP, username, group_name);
+            forward_to_node(forward, node, sock);
+        }
+        else
+        {
+            handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        }
         return;
     }
 
@@ -699,12 +1525,18 @@ void handle_add_to_group(online_users &online_users, group_members &groups, user
     // Add user to the group
     members.push_back(username);
     user_groups[username] = group_name;
+    roster_snapshot.update([&](roster &r)
+                           {
+                               r.groups[group_name].push_back(username);
+                               r.user_groups[username] = group_name;
+                               r.multicast_groups.erase(username); });
+    offer_multicast(group_name, *online_users.find(username)->second, sock);
 
     // Broadcast the message to all users in the group
     std::string message = "Server: " + username + " has joined the group [" + group_name + "]";
     for (const auto &member : members)
     {
-        DEBUG("Message before send to %s: %s\n", member.c_str(), message.c_str());
+        LOG_TRACE("Message before send to %s: %s\n", member.c_str(), message.c_str());
 
         auto member_it = online_users.find(member);
         if (member_it != online_users.end() && member_it->second != nullptr)
@@ -713,12 +1545,12 @@ void handle_add_to_group(online_users &online_users, group_members &groups, user
             ssize_t sent_bytes = sock.sendto(reinterpret_cast<const char *>(&msg), sizeof(msg), 0, (sockaddr *)member_it->second, sizeof(struct sockaddr_in));
             if (sent_bytes != sizeof(msg))
             {
-                DEBUG("Failed to send message to user %s\n", member.c_str());
+                LOG_WARN("Failed to send message to user %s\n", member.c_str());
             }
         }
         else
         {
-            DEBUG("Member %s not found online\n", member.c_str());
+            LOG_DEBUG("Member %s not found online\n", member.c_str());
         }
     }
 }
@@ -733,147 +1565,1077 @@ void handle_add_to_group(online_users &online_users, group_members &groups, user
  * @param message The content of the message to be sent to the group. This is the message that will be distributed to all online members of the group.
  *
  */
-void handle_group_message(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string username, std::string group_name, std::string message, struct sockaddr_in &client_address, uwe::socket &sock, bool &exit_loop)
+void handle_group_message(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string_view username, std::string_view group_name, std::string_view message, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    DEBUG("Received group message\n");
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received group message\n");
 
-    // Check if the group exists
-    if (groups.find(group_name) == groups.end())
+    // another node passes on its members' messages, to be sent to the members here only
+    bool from_peer = federation.is_peer(client_address);
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+
+    // Check if the group exists, a group with no members on this node doesn't
+    auto group_it = r->groups.find(group_name);
+    if (group_it == r->groups.end())
     {
-        handle_error(ERR_GROUP_NOT_FOUND, client_address, sock, exit_loop);
+        if (!from_peer)
+        {
+            handle_error(ERR_GROUP_NOT_FOUND, client_address, sock, exit_loop);
+        }
         return;
     }
 
     // Verify sender is a part of the group
-    if (user_groups.find(username) == user_groups.end() || user_groups[username] != group_name)
+    auto sender_it = r->user_groups.find(username);
+    if (!from_peer && (sender_it == r->user_groups.end() || sender_it->second != group_name))
     {
         handle_error(ERR_USER_NOT_IN_GROUP, client_address, sock, exit_loop);
         return;
     }
 
     // Retrieve group members
-    auto &members = groups[group_name];
+    const auto &members = group_it->second;
 
     // Send message to all group members
-    for (const auto &member : members)
+    chat::message_span group_msg = send_slot();
+    chat::write_message(group_msg, chat::GROUP_MESSAGE, username, group_name, message);
+
+    // members on the group's channel get the copy the network makes
+    bool multicasting = multicast.enabled() && !r->multicast_groups.empty();
+    if (multicasting)
     {
-        auto it = online_users.find(member);
-        if (it != online_users.end())
-        { // Member is online
-            chat::chat_message group_msg = chat::group_message(group_name, username, message);
-            sock.sendto(reinterpret_cast<const char *>(&group_msg), sizeof(chat::chat_message), 0, (sockaddr *)it->second, sizeof(struct sockaddr_in));
-            DEBUG("Group message sent to '%s' in group '%s'\n", member.c_str(), group_name.c_str());
-        }
+        multicast.send(group_msg.data(), group_msg.size(), multicast.group(group_name));
+    }
+
+    fan_out(members.size(), [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i++)
+                {
+                    const auto &member = members[i];
+                    if (multicasting && r->multicast_groups.count(member) > 0)
+                    {
+                        continue;
+                    }
+                    const sockaddr_in *addr = r->find(member);
+                    if (addr != nullptr)
+                    { // Member is online
+                        send_relayed(sock, group_msg, *addr);
+                        LOG_TRACE("Group message sent to '%s' in group '%s'\n", member.c_str(), group_name);
+                    }
+                } });
+
+    // members on other nodes are found by those nodes
+    if (!from_peer)
+    {
+        forward_to_peers(group_msg, sock);
     }
 }
 
 /**
- * @brief function table, mapping command type to handler.
+ * @brief check that username is online at the address a packet came from
  */
-void (*handle_messages[9])(online_users &, std::string, std::string, struct sockaddr_in &, uwe::socket &, bool &exit_loop) = {
-    handle_join,
-    handle_jack,
-    handle_broadcast,
-    handle_directmessage,
-    handle_list,
-    handle_leave,
-    handle_lack,
-    handle_exit,
-    handle_error,
-};
+bool is_sender(const roster *r, std::string_view username, const struct sockaddr_in &client_address)
+{
+    const sockaddr_in *addr = r->find(username);
+    return addr != nullptr && addr->sin_addr.s_addr == client_address.sin_addr.s_addr &&
+           addr->sin_port == client_address.sin_port;
+}
 
 /**
- * @brief server for chat protocol
+ * @brief handle multicast message, a client confirming it receives a channel it was offered
+ *
+ * From then on the user gets no unicast copies of what is sent on the channel. A
+ * confirmation for a group the user is no longer in is ignored.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param groups map of group names to their members
+ * @param user_groups map of usernames to their group
+ * @param username confirming user, must be online at client_address
+ * @param group_name group of the channel, empty for broadcasts
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
  */
-void server()
+void handle_multicast(online_users &online_users, group_members &groups, user_group_map &user_groups, std::string username, std::string group_name, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
 {
-    group_members groups;
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received multicast confirmation\n");
 
-    // keep track of online users
-    online_users online_users;
+    auto session = online_users.find(username);
+    if (!multicast.enabled() || session == online_users.end() ||
+        session->second->sin_addr.s_addr != client_address.sin_addr.s_addr || session->second->sin_port != client_address.sin_port)
+    {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
+    if (group_name.empty())
+    {
+        roster_snapshot.update([&](roster &r)
+                               { r.multicast_broadcasts.insert(username); });
+    }
+    else if (auto group = user_groups.find(username); group != user_groups.end() && group->second == group_name)
+    {
+        roster_snapshot.update([&](roster &r)
+                               { r.multicast_groups.insert(username); });
+    }
+}
 
-    // port to start the server on
+/**
+ * @brief handle presence message, which only other nodes of the federation may send
+ *
+ * "+" and "-" keep the summary of who is online on the sending node up to date. "?" comes
+ * from a node that has just started: what was known of its users is dropped, and it is
+ * sent a "+" for each user of this node.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username user of the sending node, empty with "?"
+ * @param state part of chat protocol packet, "+", "-" or "?"
+ * @param client_address address of the node to send message to
+ * @param sock socket for communicting with the node
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_presence(online_users &online_users, std::string_view username, std::string_view state, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received presence %s %s\n", state, username);
 
-    // socket address used for the server
-    struct sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
+    if (!federation.is_peer(client_address))
+    {
+        handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+        return;
+    }
+    if (state == "+" && !username.empty())
+    {
+        federation.online(username, client_address);
+    }
+    else if (state == "-")
+    {
+        federation.offline(username, client_address);
+    }
+    else if (state == "?")
+    {
+        federation.forget(client_address);
 
-    // htons: host to network short: transforms a value in host byte
-    // ordering format to a short value in network byte ordering format
-    server_address.sin_port = htons(SERVER_PORT);
+        chat::rcu_read_guard guard;
+        const roster *r = roster_snapshot.read();
+        for (const auto &user : r->users)
+        {
+            chat::chat_message presence = chat::presence_msg(user.first, "+");
+            forward_to_node(chat::as_span(presence), client_address, sock);
+        }
+    }
+}
 
-    // htons: host to network long: same as htons but to long
-    // server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    // creates binary representation of server name and stores it as sin_addr
-    inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &server_address.sin_addr);
+/**
+ * @brief handle subscribe message
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username subscribing user, must be online at client_address
+ * @param filter topic filter, levels separated by / with + matching one level and # any remaining levels
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_subscribe(online_users &online_users, std::string_view username, std::string_view filter, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received subscribe from %s to %s\n", username, filter);
 
-    // create a UDP socket
-    uwe::socket sock{AF_INET, SOCK_DGRAM, 0};
+    chat::rcu_read_guard guard;
+    if (!is_sender(roster_snapshot.read(), username, client_address))
+    {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
 
-    sock.bind((struct sockaddr *)&server_address, sizeof(server_address));
+    bool subscribed;
+    {
+        std::lock_guard<std::mutex> lock{topics_mutex};
+        subscribed = topics.subscribe(filter, std::string{username});
+    }
+    if (!subscribed)
+    {
+        handle_error(ERR_INVALID_TOPIC, client_address, sock, exit_loop);
+    }
+}
 
-    // socket address used to store client address
-    struct sockaddr_in client_address;
-    size_t client_address_len = 0;
+/**
+ * @brief handle unsubscribe message
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username unsubscribing user, must be online at client_address
+ * @param filter topic filter given to subscribe
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_unsubscribe(online_users &online_users, std::string_view username, std::string_view filter, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received unsubscribe from %s to %s\n", username, filter);
 
-    char buffer[sizeof(chat::chat_message)];
-    DEBUG("Entering server loop\n");
-    bool exit_loop = false;
-    for (; !exit_loop;)
+    chat::rcu_read_guard guard;
+    if (!is_sender(roster_snapshot.read(), username, client_address))
     {
-        int len = sock.recvfrom(
-            buffer, sizeof(buffer), 0, (struct sockaddr *)&client_address, &client_address_len);
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
 
-        // DEBUG("Received message:\n");
-        if (len == sizeof(chat::chat_message))
-        {
-            chat::chat_message *message = reinterpret_cast<chat::chat_message *>(buffer);
-            auto type = static_cast<chat::chat_type>(message->type_);
-            std::string username{(const char *)&message->username_[0]};
-            std::string msg{(const char *)&message->message_[0]};
-            std::string group_name{(const char *)&message->groupname_[0]};
+    bool unsubscribed;
+    {
+        std::lock_guard<std::mutex> lock{topics_mutex};
+        unsubscribed = topics.unsubscribe(filter, std::string{username});
+    }
+    if (!unsubscribed)
+    {
+        handle_error(ERR_INVALID_TOPIC, client_address, sock, exit_loop);
+    }
+}
+
+/**
+ * @brief handle publish message, forwarding it to every user subscribed to a matching filter
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username publishing user, must be online at client_address
+ * @param topic topic published to, must not contain wildcards
+ * @param message payload
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_publish(online_users &online_users, std::string_view username, std::string_view topic, std::string_view message, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received publish from %s to %s\n", username, topic);
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+    if (!is_sender(r, username, client_address))
+    {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
+    if (!chat::is_valid_topic(topic))
+    {
+        handle_error(ERR_INVALID_TOPIC, client_address, sock, exit_loop);
+        return;
+    }
 
-            if (type == chat::CREATE_GROUP)
+    chat::topic_tree<std::string>::match_result subscribers;
+    {
+        std::lock_guard<std::mutex> lock{topics_mutex};
+        subscribers = topics.match(topic);
+    }
+
+    chat::message_span m = send_slot();
+    chat::write_message(m, chat::PUBLISH, username, topic, message);
+    fan_out(subscribers->size(), [&](size_t begin, size_t end)
             {
-                DEBUG("Raw username: %s, Raw group name: %s\n", (const char *)&message->username_[0], (const char *)&message->groupname_[0]);
-                std::string username{(const char *)&message->username_[0]};
-                std::string group_name{(const char *)&message->groupname_[0]}; // Extract the group name from the message
-                handle_creategroup(online_users, groups, user_groups, username, group_name, client_address, sock, exit_loop);
-            }
-            else if (type == chat::ADD_TO_GROUP)
-            {
-                std::string group_name = {(const char *)&message->groupname_[0]};
-                std::string username = {(const char *)&message->username_[0]};
-                handle_add_to_group(online_users, groups, user_groups, username, group_name, client_address, sock, exit_loop);
-            }
-            else if (type == chat::GROUP_MESSAGE)
-            {
-                std::string group_name = {(const char *)&message->groupname_[0]};
-                std::string username = {(const char *)&message->username_[0]};
-                std::string msg = {(const char *)&message->message_[0]};
-                handle_group_message(online_users, groups, user_groups, username, group_name, msg, client_address, sock, exit_loop);
-            }
-            else if (type == chat::EXIT)
-            {
-                DEBUG("Received exit message from username: %s\n", username.c_str());
-                handle_exit(online_users, username, "", client_address, sock, exit_loop);
-            }
-            else if (type == chat::LEAVE)
+                for (size_t i = begin; i < end; i++)
+                {
+                    const sockaddr_in *addr = r->find((*subscribers)[i]);
+                    if (addr != nullptr)
+                    {
+                        send_relayed(sock, m, *addr);
+                        LOG_TRACE("Published to %s\n", (*subscribers)[i]);
+                    }
+                } });
+}
+
+/**
+ * @brief tell one side of an accepted transfer which token to connect to BLOB_PORT with
+ *
+ * @param transfer transfer as agreed
+ * @param token upload or download token of the side being told
+ * @param peer user at the other end of the transfer, empty for the server's store
+ * @param address where the side being told is
+ * @param sock socket for communicting with client
+ */
+void send_accept(const chat::blob_server::transfer &transfer, uint64_t token, std::string_view peer, const sockaddr_in &address, chat_socket &sock)
+{
+    char text[MAX_MESSAGE_LENGTH];
+    int len = snprintf(text, sizeof(text), "%u:%llu:%llu:%llu", transfer.id_, static_cast<unsigned long long>(token),
+                       static_cast<unsigned long long>(transfer.offset_), static_cast<unsigned long long>(transfer.size_));
+    chat::message_span m = send_slot();
+    chat::write_message(m, chat::ACCEPT, peer, transfer.name_, std::string_view{text, static_cast<size_t>(len)});
+    send_relayed(sock, m, address);
+}
+
+/**
+ * @brief handle offer message, offering a blob to another user or to the server's store
+ *
+ * An offer to a user is forwarded to them as "id:name:size" and waits for their ACCEPT. An
+ * offer to the store is accepted straight away, from the size of any part already stored.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username offering user, must be online at client_address
+ * @param recipient user offered the blob, empty for the server's store
+ * @param offer "name:size"
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_offer(online_users &online_users, std::string_view username, std::string_view recipient, std::string_view offer, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received offer from %s to %s: %s\n", username, recipient, offer);
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+    if (!is_sender(r, username, client_address))
+    {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
+
+    size_t colon_pos = offer.rfind(':');
+    uint64_t size;
+    if (blob_service == nullptr || colon_pos == std::string_view::npos ||
+        !chat::is_valid_blob_name(offer.substr(0, colon_pos)) || !chat::parse_number(offer.substr(colon_pos + 1), size))
+    {
+        handle_error(ERR_TRANSFER_REFUSED, client_address, sock, exit_loop);
+        return;
+    }
+    std::string_view name = offer.substr(0, colon_pos);
+
+    if (recipient.empty())
+    {
+        chat::blob_server::transfer transfer;
+        uint32_t id = blob_service->offer(username, {}, name, size);
+        blob_service->accept(id, username, 0, transfer);
+        send_accept(transfer, transfer.upload_token_, {}, client_address, sock);
+        return;
+    }
+
+    const sockaddr_in *recipient_addr = r->find(recipient);
+    if (recipient_addr == nullptr)
+    {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
+    uint32_t id = blob_service->offer(username, recipient, name, size);
+    char text[MAX_MESSAGE_LENGTH];
+    int len = snprintf(text, sizeof(text), "%u:%.*s", id, static_cast<int>(offer.size()), offer.data());
+    chat::message_span m = send_slot();
+    chat::write_message(m, chat::OFFER, username, {}, std::string_view{text, static_cast<size_t>(len)});
+    send_relayed(sock, m, *recipient_addr);
+}
+
+/**
+ * @brief handle accept message, starting a transfer offered to the user or a fetch from the store
+ *
+ * Each side of the transfer is sent an ACCEPT with its token, and the offset the transfer
+ * starts from, which a client resuming an interrupted download sets to the bytes it has.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param username accepting user, must be online at client_address
+ * @param name stored blob to fetch, empty when accepting an offer
+ * @param accept "id:offset" for an offer, "offset" for a fetch
+ * @param client_address address of client to send message to
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void handle_accept(online_users &online_users, std::string_view username, std::string_view name, std::string_view accept, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+    LOG_DEBUG("Received accept from %s: %s %s\n", username, name, accept);
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+    if (!is_sender(r, username, client_address))
+    {
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
+
+    chat::blob_server::transfer transfer;
+    uint64_t id = 0;
+    uint64_t offset;
+    if (blob_service == nullptr)
+    {
+        handle_error(ERR_TRANSFER_REFUSED, client_address, sock, exit_loop);
+        return;
+    }
+    if (!name.empty())
+    {
+        if (!chat::parse_number(accept, offset) || !blob_service->fetch(username, name, offset, transfer))
+        {
+            handle_error(ERR_TRANSFER_REFUSED, client_address, sock, exit_loop);
+            return;
+        }
+        send_accept(transfer, transfer.download_token_, {}, client_address, sock);
+        return;
+    }
+
+    size_t colon_pos = accept.find(':');
+    if (colon_pos == std::string_view::npos || !chat::parse_number(accept.substr(0, colon_pos), id) ||
+        !chat::parse_number(accept.substr(colon_pos + 1), offset) || id > UINT32_MAX ||
+        !blob_service->accept(static_cast<uint32_t>(id), username, offset, transfer))
+    {
+        handle_error(ERR_TRANSFER_REFUSED, client_address, sock, exit_loop);
+        return;
+    }
+    const sockaddr_in *sender_addr = r->find(transfer.sender_);
+    if (sender_addr == nullptr)
+    {
+        // the sender has left, its side will never connect and the transfer expires
+        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        return;
+    }
+    send_accept(transfer, transfer.upload_token_, transfer.recipient_, *sender_addr, sock);
+    send_accept(transfer, transfer.download_token_, transfer.sender_, client_address, sock);
+}
+
+/**
+ * @brief forward a fragment of a large message to the recipients the whole message would go to
+ *
+ * Fragments are relayed as they arrive, unchanged, and never reassembled by the server.
+ * Errors are only reported for the first fragment so a rejected message gets a single reply.
+ * Each fragment is passed between the nodes of a federation as the whole message would be,
+ * a fragment being no bigger than a message.
+ *
+ * @param msg received fragment
+ * @param client_address address of client the fragment was received from
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ */
+void forward_fragment(const chat::chat_message &msg, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop)
+{
+    PROFILE_FUNCTION();
+
+    chat::fragment_header header;
+    if (!chat::get_fragment_header(msg, header))
+    {
+        LOG_DEBUG("Dropping malformed fragment\n");
+        return;
+    }
+    bool first = header.index_ == 0;
+    std::string_view username = chat::field(msg.username_, MAX_USERNAME_LENGTH);
+    std::string_view groupname = chat::field(msg.groupname_, MAX_GROUPNAME_LENGTH);
+    bool from_peer = federation.is_peer(client_address);
+
+    chat::rcu_read_guard guard;
+    const roster *r = roster_snapshot.read();
+
+    chat::message_span m = send_slot();
+    memcpy(m.data(), &msg, m.size());
+
+    switch (chat::fragment_type(msg))
+    {
+    case chat::BROADCAST:
+    {
+        // decorated and multicast exactly as the whole broadcast would be
+        relay_broadcast(r, m, username, client_address, sock);
+        break;
+    }
+    case chat::DIRECTMESSAGE:
+    {
+        // the recipient is named in the group name field of a fragmented DM
+        const sockaddr_in *recipient_addr = r->find(groupname);
+        if (!from_peer && !is_sender(r, username, client_address))
+        {
+            LOG_DEBUG("Sender %s not found\n", username);
+        }
+        else if (recipient_addr != nullptr)
+        {
+            send_relayed(sock, m, *recipient_addr);
+        }
+        else if (sockaddr_in node; !from_peer && federation.locate(groupname, node))
+        {
+            // the recipient's node delivers it
+            forward_to_node(m, node, sock);
+        }
+        else if (from_peer)
+        {
+            LOG_DEBUG("Recipient %s has gone, fragment from another node dropped\n", groupname);
+        }
+        else if (first)
+        {
+            handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        }
+        break;
+    }
+    case chat::GROUP_MESSAGE:
+    {
+        // as for a whole group message, another node's fragments go to the members here only
+        auto group_it = r->groups.find(groupname);
+        auto sender_it = r->user_groups.find(username);
+        if (group_it == r->groups.end() ||
+            (!from_peer && (sender_it == r->user_groups.end() || sender_it->second != groupname)))
+        {
+            if (first && !from_peer)
             {
-                DEBUG("Received leave message from username: %s\n", username.c_str());
-                handle_leave(online_users, username, "", client_address, sock, exit_loop);
+                handle_error(group_it == r->groups.end() ? ERR_GROUP_NOT_FOUND : ERR_USER_NOT_IN_GROUP, client_address, sock, exit_loop);
             }
-            else if (chat::is_valid_type(type))
+            break;
+        }
+        const auto &members = group_it->second;
+        fan_out(members.size(), [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; i++)
+                    {
+                        const sockaddr_in *addr = r->find(members[i]);
+                        if (addr != nullptr)
+                        {
+                            send_relayed(sock, m, *addr);
+                        }
+                    } });
+        if (!from_peer)
+        {
+            forward_to_peers(m, sock);
+        }
+        break;
+    }
+    case chat::PUBLISH:
+    {
+        if (!is_sender(r, username, client_address) || !chat::is_valid_topic(groupname))
+        {
+            if (first)
             {
-                handle_messages[type](online_users, username, msg, client_address, sock, exit_loop);
+                handle_error(ERR_INVALID_TOPIC, client_address, sock, exit_loop);
             }
-            else
+            break;
+        }
+        chat::topic_tree<std::string>::match_result subscribers;
+        {
+            std::lock_guard<std::mutex> lock{topics_mutex};
+            subscribers = topics.match(groupname);
+        }
+        fan_out(subscribers->size(), [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; i++)
+                    {
+                        const sockaddr_in *addr = r->find((*subscribers)[i]);
+                        if (addr != nullptr)
+                        {
+                            send_relayed(sock, m, *addr);
+                        }
+                    } });
+        break;
+    }
+    default:
+    {
+        // only chat messages may be fragmented
+        if (first)
+        {
+            handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+        }
+    }
+    }
+}
+
+/**
+ * @brief state every handler runs against, passed through the protocol dispatcher
+ */
+struct handler_context
+{
+    online_users &online_users_;
+    group_members &groups_;
+    struct sockaddr_in &client_address_;
+    chat_socket &sock_;
+    bool &exit_loop_;
+};
+
+/**
+ * @brief adapt a handler taking the username and message fields to the dispatcher
+ */
+template <void (*Handler)(online_users &, std::string_view, std::string_view, struct sockaddr_in &, chat_socket &, bool &)>
+void user_handler(handler_context &ctx, const chat::decoded_message &msg)
+{
+    Handler(ctx.online_users_, msg.username_, msg.message_, ctx.client_address_, ctx.sock_, ctx.exit_loop_);
+}
+
+/**
+ * @brief adapt a group management handler taking the username and group name fields to the dispatcher
+ */
+template <void (*Handler)(online_users &, group_members &, user_group_map &, std::string, std::string, struct sockaddr_in &, chat_socket &, bool &)>
+void group_handler(handler_context &ctx, const chat::decoded_message &msg)
+{
+    Handler(ctx.online_users_, ctx.groups_, user_groups, std::string{msg.username_}, std::string{msg.groupname_}, ctx.client_address_, ctx.sock_, ctx.exit_loop_);
+}
+
+/**
+ * @brief dispatcher entry for GROUP_MESSAGE
+ */
+void group_message_handler(handler_context &ctx, const chat::decoded_message &msg)
+{
+    handle_group_message(ctx.online_users_, ctx.groups_, user_groups, msg.username_, msg.groupname_, msg.message_, ctx.client_address_, ctx.sock_, ctx.exit_loop_);
+}
+
+/**
+ * @brief adapt a topic handler taking the username and topic (carried in the group name field) to the dispatcher
+ */
+template <void (*Handler)(online_users &, std::string_view, std::string_view, struct sockaddr_in &, chat_socket &, bool &)>
+void topic_handler(handler_context &ctx, const chat::decoded_message &msg)
+{
+    Handler(ctx.online_users_, msg.username_, msg.groupname_, ctx.client_address_, ctx.sock_, ctx.exit_loop_);
+}
+
+/**
+ * @brief dispatcher entry for PUBLISH
+ */
+void publish_handler(handler_context &ctx, const chat::decoded_message &msg)
+{
+    handle_publish(ctx.online_users_, msg.username_, msg.groupname_, msg.message_, ctx.client_address_, ctx.sock_, ctx.exit_loop_);
+}
+
+/**
+ * @brief adapt a bulk transfer handler taking the username, group name and message fields to the dispatcher
+ */
+template <void (*Handler)(online_users &, std::string_view, std::string_view, std::string_view, struct sockaddr_in &, chat_socket &, bool &)>
+void blob_handler(handler_context &ctx, const chat::decoded_message &msg)
+{
+    Handler(ctx.online_users_, msg.username_, msg.groupname_, msg.message_, ctx.client_address_, ctx.sock_, ctx.exit_loop_);
+}
+
+/**
+ * @brief run a handler that modifies online_users, groups or user_groups under state_mutex
+ */
+template <void (*Handler)(handler_context &, const chat::decoded_message &)>
+void locked(handler_context &ctx, const chat::decoded_message &msg)
+{
+    std::lock_guard<std::mutex> lock{state_mutex};
+    Handler(ctx, msg);
+}
+
+/**
+ * @brief run a JOIN handler only for a JOIN echoing a valid cookie, answering any other with a COOKIE
+ *
+ * Runs before the handler takes state_mutex, so a flood of JOINs from spoofed addresses
+ * allocates nothing and never holds up other handlers.
+ */
+template <void (*Handler)(handler_context &, const chat::decoded_message &)>
+void cookie_checked(handler_context &ctx, const chat::decoded_message &msg)
+{
+    if (msg.message_.empty() || !cookies.check(ctx.client_address_, msg.username_, msg.message_))
+    {
+        chat::message_span m = send_slot();
+        chat::write_message(m, chat::COOKIE, {}, {}, cookies.issue(ctx.client_address_, msg.username_));
+        ctx.sock_.sendto(m.data(), m.size(), 0, (sockaddr *)&ctx.client_address_, sizeof(struct sockaddr_in));
+        return;
+    }
+    Handler(ctx, msg);
+}
+
+/**
+ * @brief run a JOIN or RESUME handler only for a username this node owns, redirecting any other to its owner
+ *
+ * Runs before the cookie check, so a client that asked the wrong node costs it one reply.
+ */
+template <void (*Handler)(handler_context &, const chat::decoded_message &)>
+void federated(handler_context &ctx, const chat::decoded_message &msg)
+{
+    if (!federation.owns(msg.username_))
+    {
+        federation_redirects.add();
+        chat::message_span m = send_slot();
+        chat::write_message(m, chat::REDIRECT, {}, {}, chat::format_node(federation.owner(msg.username_)));
+        ctx.sock_.sendto(m.data(), m.size(), 0, (sockaddr *)&ctx.client_address_, sizeof(struct sockaddr_in));
+        return;
+    }
+    Handler(ctx, msg);
+}
+
+/**
+ * @brief the chat protocol: for each message type the fields it carries, the fields it
+ * requires and its handler. Types without a row (REMOVE_FROM_GROUP) are ignored.
+ */
+typedef chat::dispatcher<
+    handler_context,
+    chat::route<chat::JOIN, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, chat::FIELD_NONE, federated<cookie_checked<locked<user_handler<handle_join>>>>>,
+    chat::route<chat::JACK, chat::FIELD_NONE, chat::FIELD_NONE, user_handler<handle_jack>>,
+    chat::route<chat::BROADCAST, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, chat::FIELD_NONE, user_handler<handle_broadcast>>,
+    chat::route<chat::DIRECTMESSAGE, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, chat::FIELD_MESSAGE, user_handler<handle_directmessage>>,
+    chat::route<chat::CREATE_GROUP, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, chat::FIELD_GROUPNAME, locked<group_handler<handle_creategroup>>>,
+    chat::route<chat::ADD_TO_GROUP, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, locked<group_handler<handle_add_to_group>>>,
+    chat::route<chat::GROUP_MESSAGE, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME | chat::FIELD_MESSAGE, chat::FIELD_GROUPNAME, group_message_handler>,
+    // the username is not decoded, so a client cannot ask for the list to be sent to __ALL
+    chat::route<chat::LIST, chat::FIELD_MESSAGE, chat::FIELD_NONE, user_handler<handle_list>>,
+    chat::route<chat::LEAVE, chat::FIELD_NONE, chat::FIELD_NONE, locked<user_handler<handle_leave>>>,
+    chat::route<chat::LACK, chat::FIELD_NONE, chat::FIELD_NONE, user_handler<handle_lack>>,
+    chat::route<chat::EXIT, chat::FIELD_USERNAME, chat::FIELD_NONE, locked<user_handler<handle_exit>>>,
+    chat::route<chat::ERROR, chat::FIELD_NONE, chat::FIELD_NONE, user_handler<handle_error>>,
+    chat::route<chat::SUBSCRIBE, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, topic_handler<handle_subscribe>>,
+    chat::route<chat::UNSUBSCRIBE, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, topic_handler<handle_unsubscribe>>,
+    chat::route<chat::PUBLISH, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME | chat::FIELD_MESSAGE, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, publish_handler>,
+    chat::route<chat::OFFER, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME | chat::FIELD_MESSAGE, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, blob_handler<handle_offer>>,
+    chat::route<chat::ACCEPT, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME | chat::FIELD_MESSAGE, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, blob_handler<handle_accept>>,
+    chat::route<chat::RESUME, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, federated<locked<user_handler<handle_resume>>>>,
+    chat::route<chat::MULTICAST, chat::FIELD_USERNAME | chat::FIELD_GROUPNAME, chat::FIELD_USERNAME, locked<group_handler<handle_multicast>>>,
+    chat::route<chat::PRESENCE, chat::FIELD_USERNAME | chat::FIELD_MESSAGE, chat::FIELD_MESSAGE, user_handler<handle_presence>>>
+    protocol;
+
+/**
+ * @brief decode a received message and run its handler
+ *
+ * Handlers that modify session or group state are serialised on state_mutex, all others
+ * only read the published roster and may run concurrently on the handler pool.
+ *
+ * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param groups map of group names to their members
+ * @param msg_in received chat protocol packet
+ * @param client_address address of client the packet was received from
+ * @param sock socket for communicting with client
+ * @parm exit_loop set to true if event loop is to terminate
+ * @param trace trace carried by the packet, copied onto messages it causes to be relayed
+ */
+void handle_message(online_users &online_users, group_members &groups, const chat::chat_message &msg_in, struct sockaddr_in &client_address, chat_socket &sock, bool &exit_loop, const chat::trace_extension *trace = nullptr)
+{
+    PROFILE_FUNCTION();
+    chat::trace_scope tracing{trace};
+
+    // fragments are routed on their own and never reach the protocol table
+    if (chat::is_fragment(msg_in))
+    {
+        forward_fragment(msg_in, client_address, sock, exit_loop);
+        return;
+    }
+
+    handler_context ctx{online_users, groups, client_address, sock, exit_loop};
+    if (protocol::dispatch(ctx, msg_in) == chat::dispatch_result::INVALID)
+    {
+        LOG_WARN("Message of type %d is missing a required field\n", msg_in.type_);
+        handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+    }
+    // unknown message types are ignored
+}
+
+/**
+ * @brief server for chat protocol
+ */
+void server()
+{
+    group_members groups;
+
+    // keep track of online users
+    online_users online_users;
+
+    // port to start the server on
+
+    // socket address used for the server
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+
+    // htons: host to network short: transforms a value in host byte
+    // ordering format to a short value in network byte ordering format. CHAT_PORT moves
+    // the server off SERVER_PORT, e.g. to run several nodes of a federation on one host
+    const char *port = getenv("CHAT_PORT");
+    server_address.sin_port = htons(port != nullptr && atoi(port) > 0 ? static_cast<uint16_t>(atoi(port)) : SERVER_PORT);
+
+    // htons: host to network long: same as htons but to long
+    // server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    // creates binary representation of server name and stores it as sin_addr
+    inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &server_address.sin_addr);
+
+    // create a UDP socket
+    uwe::socket udp{AF_INET, SOCK_DGRAM, 0};
+
+    // CHAT_OFFLOAD=gso serves UDP from a kernel socket with segmentation and receive offload,
+    // CHAT_OFFLOAD=none from one without them to compare against, otherwise from udp
+    udp_socket offload{udp};
+    const char *offload_mode = getenv("CHAT_OFFLOAD");
+    bool offloading = offload_mode != nullptr && offload.open(server_address, std::string_view{offload_mode} == "gso");
+    if (offloading)
+    {
+        LOG_INFO("Kernel UDP socket, GSO %s, GRO %s\n", offload.gso() ? "on" : "off", offload.gro() ? "on" : "off");
+    }
+    else
+    {
+        udp.bind((struct sockaddr *)&server_address, sizeof(server_address));
+    }
+
+    // clients sending reliable datagrams get acks, retransmits and in order delivery back
+    datagram_link link{offload};
+    link.start(false);
+
+    // replies go back over whichever transport the client is on
+    chat_socket sock{link};
+
+    // with CHAT_BUNDLE_US set, messages relayed to a client within that many microseconds
+    // of each other go in one datagram, of at most CHAT_BUNDLE_BYTES if that is set too. On
+    // the kernel socket they are kept whole and go in one segmented send instead
+    std::unique_ptr<chat::fanout_bundler<chat_socket>> bundling;
+    const char *bundle_window = getenv("CHAT_BUNDLE_US");
+    if (bundle_window != nullptr && atol(bundle_window) > 0)
+    {
+        const char *bundle_bytes = getenv("CHAT_BUNDLE_BYTES");
+        bundling = std::make_unique<chat::fanout_bundler<chat_socket>>(
+            sock, std::chrono::microseconds{atol(bundle_window)},
+            bundle_bytes != nullptr && atol(bundle_bytes) > 0 ? static_cast<size_t>(atol(bundle_bytes))
+            : offloading                                     ? chat::BUNDLE_SEGMENTED_MAX
+                                                             : chat::BUNDLE_MAX,
+            offloading);
+        bundler = bundling.get();
+        LOG_INFO("Bundling relayed messages over %ld us\n", atol(bundle_window));
+    }
+
+    // with CHAT_MULTICAST set to a base address, e.g. 239.192.0.0, broadcasts and group
+    // messages are sent once to a multicast channel for the clients that have joined it
+    const char *multicast_base = getenv("CHAT_MULTICAST");
+    if (multicast_base != nullptr)
+    {
+        if (multicast.open(multicast_base, server_address.sin_addr))
+        {
+            LOG_INFO("Multicasting on channels from %s\n", multicast_base);
+        }
+        else
+        {
+            LOG_WARN("Multicast disabled, could not use channels from %s\n", multicast_base);
+        }
+    }
+
+    // with CHAT_FEDERATION listing every node, this one included, e.g.
+    // "127.0.0.1:8867,127.0.0.1:8967", users are shared out among the nodes by consistent
+    // hashing and DMs, group messages and broadcasts are passed between them. The nodes
+    // seal what they send each other with the CHAT_FEDERATION_KEY they all share
+    const char *federation_nodes = getenv("CHAT_FEDERATION");
+    const char *federation_key = getenv("CHAT_FEDERATION_KEY");
+    if (federation_nodes != nullptr)
+    {
+        if (federation_key == nullptr)
+        {
+            LOG_WARN("Federation disabled, CHAT_FEDERATION_KEY is not set\n");
+        }
+        else if (federation.configure(federation_nodes, federation_key, server_address))
+        {
+            LOG_INFO("Federated with %s\n", federation_nodes);
+            // nodes already running tell us who is online on them
+            chat::chat_message ask = chat::presence_msg({}, "?");
+            forward_to_peers(chat::as_span(ask), sock);
+        }
+        else
+        {
+            LOG_WARN("Federation disabled, %s does not list this node or the key is not %d hex digits\n",
+                     federation_nodes, FEDERATION_KEY_LENGTH);
+        }
+    }
+
+    // socket address used to store client address
+    struct sockaddr_in client_address;
+    size_t client_address_len = 0;
+
+    // SIGUSR1 dumps all counters, SIGUSR2 makes logging one level more verbose, wrapping
+    // from trace back to error, and PROFILE_SIGNAL writes the profiler's spans to a Chrome
+    // trace file. All are taken by sigwait on a dedicated thread so they are blocked here
+    // before any other thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, PROFILE_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::atomic<bool> signals_done{false};
+    std::thread signal_thread{[&signals, &signals_done]()
+                              {
+                                  int sig;
+                                  while (sigwait(&signals, &sig) == 0 && !signals_done.load())
+                                  {
+                                      if (sig == SIGUSR2)
+                                      {
+                                          chat::logger &log = chat::logger::instance();
+                                          log.set_level(log.level() == chat::LOG_LEVEL_TRACE
+                                                            ? chat::LOG_LEVEL_ERROR
+                                                            : static_cast<chat::log_level>(std::min<int>(log.level(), chat::LOG_LEVEL_ERROR) - 1));
+                                          continue;
+                                      }
+                                      if (sig == PROFILE_SIGNAL)
+                                      {
+                                          std::string file = chat::profiler::instance().dump_to_file();
+                                          LOG_INFO("Profile written to %s\n", file);
+                                          continue;
+                                      }
+                                      chat::counter::dump_counters(stderr);
+                                  }
+                              }};
+
+    // records are formatted and written by the log thread, CHAT_LOG_LEVEL selects the level
+    chat::logger::instance().start(stderr);
+
+    // handlers run on the pool, leaving this thread to receive and enqueue. The workers
+    // leave the other readers RCU slots of their own
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    chat::work_pool pool{std::min(threads, static_cast<unsigned>(MAX_RCU_READERS - RCU_OTHER_READERS))};
+    handler_pool = &pool;
+
+    // multi-step handlers continue as coroutines on their own thread
+    chat::event_loop loop;
+    handler_loop = &loop;
+    std::thread loop_thread{[&loop]()
+                            { loop.run(); }};
+
+    // bulk transfers are made over TCP on BLOB_PORT, next to the chat port
+    chat::blob_server blobs;
+    if (blobs.start(server_address))
+    {
+        blob_service = &blobs;
+    }
+    else
+    {
+        LOG_WARN("Bulk transfers disabled, could not listen on port %d\n", BLOB_PORT);
+    }
+
+    // hand a received packet to the pool, or for EXIT run it here once in-flight handlers
+    // finish as it tears down all state. Messages the server makes up itself are not
+    // limited. Returns true if the server is to exit
+    auto receive = [&](inbound *in, ssize_t len, bool synthesised = false)
+    {
+        // what claims to come from another node of the federation must carry its seal, or it
+        // could be anyone's, and must not have been had before, or it is a replay. Handlers
+        // can then trust a peer address
+        bool from_peer = federation.is_peer(in->from_);
+        if (from_peer && !federation.unseal(in->from_, reinterpret_cast<const char *>(&in->packet_), len))
+        {
+            LOG_DEBUG("Dropped unsealed or replayed message from node port %d\n", ntohs(in->from_.sin_port));
+            inbound_pool.destroy(in);
+            return false;
+        }
+
+        uint64_t id;
+        bool has_id = !from_peer && chat::take_message_id(reinterpret_cast<const char *>(&in->packet_), len, id);
+        in->traced_ = chat::has_trace(in->packet_, len);
+        if (in->traced_)
+        {
+            in->trace_ = chat::get_trace(in->packet_);
+            in->trace_.server_receive_ = chat::trace_clock();
+            trace_uplink.record(chat::trace_hop(in->trace_.client_send_, in->trace_.server_receive_));
+        }
+        else if (len != sizeof(chat::chat_message))
+        {
+            inbound_pool.destroy(in);
+            return false;
+        }
+
+        // handlers for the same sender run in order on the same worker
+        uint64_t key = (static_cast<uint64_t>(in->from_.sin_addr.s_addr) << 16) | in->from_.sin_port;
+        auto type = static_cast<chat::chat_type>(in->packet_.message_.type_);
+
+        // a flooding sender is shed here, before it costs a handler or a fan-out. Another
+        // node of the federation speaks for all its users, so is neither limited nor, as
+        // its users may well repeat each other, checked for repeats
+        chat::traffic_class traffic = chat::classify(in->packet_.message_.type_);
+        if (!synthesised && !from_peer && (!rate_limits.admit(key, traffic) || !admission.admit(traffic, pool.backlog())))
+        {
+            inbound_pool.destroy(in);
+            return false;
+        }
+
+        if (has_id ? duplicates.seen_id(key, id)
+                   : !from_peer && dedup_by_contents(type) && duplicates.seen_contents(key, in->packet_.message_))
+        {
+            LOG_DEBUG("Dropped repeated message of type %d from port %d\n", static_cast<int>(type), ntohs(in->from_.sin_port));
+            inbound_pool.destroy(in);
+            return false;
+        }
+
+        if (type == chat::EXIT)
+        {
+            bool exit_now = false;
+            pool.wait_idle();
+            handle_message(online_users, groups, in->packet_.message_, in->from_, sock, exit_now);
+            inbound_pool.destroy(in);
+            return exit_now;
+        }
+
+        // control messages are handled ahead of direct ones and those ahead of fan-out, so
+        // joins and leaves stay prompt during a broadcast storm. A sender's own messages
+        // are still handled in the order sent, its LEAVE never overtakes its last DM
+        queue_depth[traffic].add();
+        in->queued_ = std::chrono::steady_clock::now();
+        pool.submit_ordered(key, [&online_users, &groups, &sock, in, traffic]()
+                            {
+                                queue_depth[traffic].sub();
+                                queue_wait[traffic].record(std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - in->queued_).count());
+                                bool exit_handler = false;
+                                handle_message(online_users, groups, in->packet_.message_, in->from_, sock, exit_handler,
+                                               in->traced_ ? &in->trace_ : nullptr);
+                                inbound_pool.destroy(in); },
+                            static_cast<unsigned>(traffic));
+        return false;
+    };
+
+    // TCP, Unix domain and shared memory clients share sessions and groups with UDP ones,
+    // their messages are received on the stream thread and handled exactly like datagrams
+    std::atomic<bool> stream_exit{false};
+    chat::stream_server streams;
+    if (!streams.listen_tcp(server_address))
+    {
+        LOG_WARN("TCP clients disabled, could not listen on port %d\n", STREAM_PORT);
+    }
+    if (!streams.listen_unix(UNIX_SOCKET_PATH))
+    {
+        LOG_WARN("Unix domain clients disabled, could not listen on %s\n", UNIX_SOCKET_PATH);
+    }
+    if (!streams.listen_shm(SHM_SOCKET_PATH))
+    {
+        LOG_WARN("Shared memory clients disabled, could not listen on %s\n", SHM_SOCKET_PATH);
+    }
+    streams.start(
+        [&](const char *data, size_t length, const sockaddr_in &from)
+        {
+            inbound *in = inbound_pool.create();
+            memcpy(&in->packet_, data, std::min(length, chat::MAX_CHAT_DATAGRAM));
+            in->from_ = from;
+            if (receive(in, static_cast<ssize_t>(length)) && !stream_exit.exchange(true))
             {
-                // uknown message type
+                // wake the receive loop so it sees the exit
+                offload.sendto(nullptr, 0, 0, (sockaddr *)&server_address, sizeof(server_address));
             }
+        },
+        [&](const sockaddr_in &from)
+        {
+            // a stream client that disconnects without leaving keeps its session a while to
+            // RESUME, detached after anything it sent is handled
+            uint64_t key = (static_cast<uint64_t>(from.sin_addr.s_addr) << 16) | from.sin_port;
+            pool.submit_ordered(key, [&online_users, &sock, from]()
+                                { detach_session(online_users, from, sock); });
+        });
+    sock.attach(&streams);
+
+    LOG_INFO("Entering server loop\n");
+    bool exit_loop = false;
+    for (; !exit_loop && !stream_exit;)
+    {
+        // receive straight into a pooled buffer, so handing it to a worker copies nothing
+        inbound *in = inbound_pool.create();
+        int len;
+        {
+            chat::profile_span span{"recvfrom"};
+            len = link.recvfrom(
+                reinterpret_cast<char *>(&in->packet_), chat::MAX_CHAT_DATAGRAM, 0, (struct sockaddr *)&client_address, &client_address_len);
         }
+        in->from_ = client_address;
+
+        // LOG_DEBUG("Received message:\n");
+        exit_loop = receive(in, len);
+    }
+
+    if (bundler != nullptr)
+    {
+        bundler->stop();
     }
+    streams.stop();
+    sock.attach(nullptr);
+    link.stop();
+
+    pool.stop();
+    loop.stop();
+    loop_thread.join();
+    handler_pool = nullptr;
+    bundler = nullptr;
+    handler_loop = nullptr;
+    blob_service = nullptr;
+    blobs.stop();
+
+    signals_done = true;
+    pthread_kill(signal_thread.native_handle(), SIGUSR1);
+    signal_thread.join();
+
+    chat::logger::instance().stop();
+    chat::counter::dump_counters(stderr);
 }
 
 /**
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "chat_dedup.hpp"
+
+// path of the Unix domain socket shared memory clients hand their segment over on
+#define SHM_SOCKET_PATH "/tmp/chat_server_shm.sock"
+// messages each ring of a shared memory segment holds, a power of two
+#define SHM_RING_SLOTS 256
+// polls of an empty ring before a reader sleeps on its eventfd
+#define SHM_SPIN_ITERATIONS 2000
+// identifies a chat shared memory segment
+#define SHM_MAGIC 0x43534d31u // "CSM1"
+
+namespace chat
+{
+
+    /**
+     * @brief one message in a shared memory ring
+     */
+    struct shm_slot
+    {
+        uint32_t length_;
+        char data_[MAX_CHAT_DATAGRAM];
+    };
+
+    /**
+     * @brief Single producer, single consumer ring of messages in shared memory.
+     *
+     * The indices only ever grow and are reduced modulo SHM_RING_SLOTS on access, so one
+     * side overwriting them can't make the other read or write outside the ring. A reader
+     * about to sleep sets waiting_, and a writer only signals the reader's eventfd when it
+     * is set, so a busy ring costs no system calls at all.
+     */
+    struct shm_ring
+    {
+        alignas(64) std::atomic<uint32_t> head_; // next slot to read, written by the consumer
+        alignas(64) std::atomic<uint32_t> tail_; // next slot to write, written by the producer
+        alignas(64) std::atomic<uint32_t> waiting_;
+        shm_slot slots_[SHM_RING_SLOTS];
+
+        /**
+         * @brief copy a message into the next slot
+         * @param notify_fd eventfd of the consumer, signalled if it is asleep
+         * @return false if the ring is full or the message too long, like a dropped datagram
+         */
+        bool push(const char *data, size_t length, int notify_fd)
+        {
+            uint32_t tail = tail_.load(std::memory_order_relaxed);
+            if (length > sizeof(shm_slot::data_) || tail - head_.load(std::memory_order_acquire) >= SHM_RING_SLOTS)
+            {
+                return false;
+            }
+            shm_slot &slot = slots_[tail % SHM_RING_SLOTS];
+            slot.length_ = static_cast<uint32_t>(length);
+            memcpy(slot.data_, data, length);
+            tail_.store(tail + 1, std::memory_order_release);
+
+            // pairs with the fence in sleep_ready, either we see waiting_ or the reader sees tail_
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiting_.load(std::memory_order_relaxed) != 0)
+            {
+                uint64_t one = 1;
+                ssize_t written = write(notify_fd, &one, sizeof(one));
+                (void)written;
+            }
+            return true;
+        }
+
+        /**
+         * @brief copy the next message out, truncated to length like a datagram
+         * @return size of the message, or -1 if the ring is empty
+         */
+        ssize_t pop(char *data, size_t length)
+        {
+            uint32_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire))
+            {
+                return -1;
+            }
+            const shm_slot &slot = slots_[head % SHM_RING_SLOTS];
+            size_t size = std::min<size_t>(slot.length_, sizeof(shm_slot::data_));
+            memcpy(data, slot.data_, std::min(length, size));
+            head_.store(head + 1, std::memory_order_release);
+            return static_cast<ssize_t>(size);
+        }
+
+        bool empty() const
+        {
+            return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @brief announce the consumer is going to sleep
+         * @return true if it may, false if a message arrived meanwhile
+         */
+        bool sleep_ready()
+        {
+            waiting_.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!empty())
+            {
+                waiting_.store(0, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        void awake()
+        {
+            waiting_.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    static_assert((SHM_RING_SLOTS & (SHM_RING_SLOTS - 1)) == 0, "SHM_RING_SLOTS must be a power of two");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory rings need lock free atomics");
+
+    /**
+     * @brief Shared memory segment of one client, created by the client in a memfd
+     */
+    struct shm_segment
+    {
+        uint32_t magic_;
+        uint32_t slots_;
+        shm_ring to_server_;
+        shm_ring to_client_;
+    };
+
+    /**
+     * @brief file descriptors a shared memory client passes to the server, in this order
+     */
+    enum shm_descriptor
+    {
+        SHM_FD_SEGMENT,
+        SHM_FD_TO_SERVER, // eventfd the server sleeps on
+        SHM_FD_TO_CLIENT, // eventfd the client sleeps on
+        SHM_FD_COUNT,
+    };
+
+    /**
+     * @brief map a segment received from a client, checking it is one
+     *
+     * The segment must be sealed against shrinking, or the client could truncate it and
+     * have the server's next access to it raise SIGBUS.
+     *
+     * @return the segment, or nullptr
+     */
+    inline shm_segment *map_segment(int fd)
+    {
+        int seals = fcntl(fd, F_GET_SEALS);
+        if (seals < 0 || (seals & F_SEAL_SHRINK) == 0)
+        {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != sizeof(shm_segment))
+        {
+            return nullptr;
+        }
+        void *p = mmap(nullptr, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        shm_segment *segment = static_cast<shm_segment *>(p);
+        if (segment->magic_ != SHM_MAGIC || segment->slots_ != SHM_RING_SLOTS)
+        {
+            munmap(p, sizeof(shm_segment));
+            return nullptr;
+        }
+        return segment;
+    }
+
+    /**
+     * @brief make an eventfd received from a client nonblocking, checking it is one
+     *
+     * Anything else, say a pipe, could block the stream thread reading it or a handler
+     * writing it.
+     *
+     * @return false if fd is not an eventfd
+     */
+    inline bool prepare_eventfd(int fd)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))
+        {
+            return false;
+        }
+        char path[32];
+        char target[sizeof("anon_inode:[eventfd]")];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        ssize_t n = readlink(path, target, sizeof(target));
+        if (n != static_cast<ssize_t>(sizeof(target) - 1) || memcmp(target, "anon_inode:[eventfd]", n) != 0)
+        {
+            return false;
+        }
+        int flags = fcntl(fd, F_GETFL);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    /**
+     * @brief receive the descriptors of a shared memory client over its control socket
+     * @param fds filled with SHM_FD_COUNT descriptors on success
+     * @return false if the client did not send them
+     */
+    inline bool receive_descriptors(int control, int (&fds)[SHM_FD_COUNT])
+    {
+        char byte;
+        iovec iov{&byte, 1};
+        alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(int) * SHM_FD_COUNT)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control_buffer;
+        msg.msg_controllen = sizeof(control_buffer);
+        if (recvmsg(control, &msg, MSG_CMSG_CLOEXEC) != 1)
+        {
+            return false;
+        }
+        cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (c == nullptr || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        {
+            return false;
+        }
+        size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(c), sizeof(int) * std::min<size_t>(count, SHM_FD_COUNT));
+        if (count != SHM_FD_COUNT)
+        {
+            for (size_t i = 0; i < std::min<size_t>(count, SHM_FD_COUNT); i++)
+            {
+                close(fds[i]);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Client end of the shared memory transport.
+     *
+     * Creates the segment and eventfds, hands them to the server over SHM_SOCKET_PATH and
+     * keeps that socket open; the server treats it closing as the client disconnecting.
+     * Receiving spins for SHM_SPIN_ITERATIONS before sleeping, so a client that is being
+     * answered promptly never enters the kernel.
+     */
+    class shm_client
+    {
+    public:
+        shm_client() = default;
+
+        ~shm_client()
+        {
+            if (segment_ != nullptr)
+            {
+                munmap(segment_, sizeof(shm_segment));
+            }
+            for (int fd : {control_, to_server_, to_client_})
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+        }
+
+        shm_client(const shm_client &) = delete;
+        shm_client &operator=(const shm_client &) = delete;
+
+        /**
+         * @brief create the segment and hand it to the server listening at path
+         * @return false if the server could not be reached
+         */
+        bool connect(const char *path)
+        {
+            // sealed at its size, the server maps only a segment that can't be truncated under it
+            int memory = memfd_create("chat_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (memory < 0 || ftruncate(memory, sizeof(shm_segment)) != 0 ||
+                fcntl(memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0)
+            {
+                if (memory >= 0)
+                {
+                    close(memory);
+                }
+                return false;
+            }
+            void *p = mmap(nullptr, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+            if (p == MAP_FAILED)
+            {
+                close(memory);
+                return false;
+            }
+            // a fresh memfd reads as zeros, which is an empty ring with nobody waiting
+            segment_ = static_cast<shm_segment *>(p);
+            segment_->magic_ = SHM_MAGIC;
+            segment_->slots_ = SHM_RING_SLOTS;
+            to_server_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            to_client_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+            sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+            control_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool sent = control_ >= 0 && to_server_ >= 0 && to_client_ >= 0 &&
+                        ::connect(control_, (sockaddr *)&address, sizeof(address)) == 0 && send_descriptors(memory);
+            // the server holds its own reference now
+            close(memory);
+            return sent;
+        }
+
+        /**
+         * @brief queue a message for the server
+         * @return length, or -1 if the ring is full
+         */
+        ssize_t send(const char *data, size_t length)
+        {
+            std::lock_guard<std::mutex> lock{write_mutex_};
+            return segment_->to_server_.push(data, length, to_server_) ? static_cast<ssize_t>(length) : -1;
+        }
+
+        /**
+         * @brief wait for the next message from the server
+         * @return size of the message, or -1 once the server has gone
+         */
+        ssize_t receive(char *data, size_t length)
+        {
+            shm_ring &ring = segment_->to_client_;
+            for (;;)
+            {
+                for (int i = 0; i < SHM_SPIN_ITERATIONS; i++)
+                {
+                    ssize_t n = ring.pop(data, length);
+                    if (n >= 0)
+                    {
+                        return n;
+                    }
+                }
+                if (!ring.sleep_ready())
+                {
+                    continue;
+                }
+                pollfd p[2] = {{to_client_, POLLIN, 0}, {control_, POLLIN, 0}};
+                poll(p, 2, -1);
+                ring.awake();
+                uint64_t count;
+                ssize_t drained = read(to_client_, &count, sizeof(count));
+                (void)drained;
+                if ((p[1].revents & (POLLIN | POLLHUP | POLLERR)) != 0 && ring.empty())
+                {
+                    // the server only ever closes the control socket
+                    closed_ = true;
+                    return -1;
+                }
+            }
+        }
+
+        bool closed() const
+        {
+            return closed_;
+        }
+
+    private:
+        bool send_descriptors(int memory)
+        {
+            int fds[SHM_FD_COUNT];
+            fds[SHM_FD_SEGMENT] = memory;
+            fds[SHM_FD_TO_SERVER] = to_server_;
+            fds[SHM_FD_TO_CLIENT] = to_client_;
+            char byte = 0;
+            iovec iov{&byte, 1};
+            alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(fds))];
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control_buffer;
+            msg.msg_controllen = sizeof(control_buffer);
+            cmsghdr *c = CMSG_FIRSTHDR(&msg);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(fds));
+            memcpy(CMSG_DATA(c), fds, sizeof(fds));
+            return sendmsg(control_, &msg, MSG_NOSIGNAL) == 1;
+        }
+
+        shm_segment *segment_ = nullptr;
+        int control_ = -1;
+        int to_server_ = -1;
+        int to_client_ = -1;
+        std::mutex write_mutex_;
+        std::atomic<bool> closed_{false};
+    };
+
+}; // namespace chat
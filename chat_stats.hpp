@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// buckets in a histogram, bounds are 1, 2, 4 ... 2^(HISTOGRAM_BUCKETS - 2) and infinity
+#define HISTOGRAM_BUCKETS 22
+
+namespace chat
+{
+
+    /**
+     * @brief Named, relaxed atomic counter.
+     *
+     * Counters add themselves to a process wide list when constructed and remove themselves
+     * when destroyed, so dump_counters() always prints every live counter.
+     */
+    class counter
+    {
+    public:
+        explicit counter(std::string name) : name_{std::move(name)}
+        {
+            std::lock_guard<std::mutex> lock{registry_mutex()};
+            next_ = head();
+            head() = this;
+        }
+
+        ~counter()
+        {
+            std::lock_guard<std::mutex> lock{registry_mutex()};
+            for (counter **c = &head(); *c != nullptr; c = &(*c)->next_)
+            {
+                if (*c == this)
+                {
+                    *c = next_;
+                    break;
+                }
+            }
+        }
+
+        counter(const counter &) = delete;
+        counter &operator=(const counter &) = delete;
+
+        void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+        void sub(uint64_t n = 1) { value_.fetch_sub(n, std::memory_order_relaxed); }
+        void set(uint64_t n) { value_.store(n, std::memory_order_relaxed); }
+
+        /**
+         * @brief raise the counter to n if it is currently lower, used for high water marks
+         */
+        void max(uint64_t n)
+        {
+            uint64_t current = value_.load(std::memory_order_relaxed);
+            while (current < n && !value_.compare_exchange_weak(current, n, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+        const std::string &name() const { return name_; }
+
+        /**
+         * @brief print every registered counter as "name value" lines
+         * @param out stream to print to
+         */
+        static void dump_counters(FILE *out)
+        {
+            std::lock_guard<std::mutex> lock{registry_mutex()};
+            for (counter *c = head(); c != nullptr; c = c->next_)
+            {
+                fprintf(out, "%s %llu\n", c->name_.c_str(), static_cast<unsigned long long>(c->value()));
+            }
+            fflush(out);
+        }
+
+    private:
+        static std::mutex &registry_mutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static counter *&head()
+        {
+            static counter *head = nullptr;
+            return head;
+        }
+
+        std::string name_;
+        std::atomic<uint64_t> value_{0};
+        counter *next_ = nullptr;
+    };
+
+    /**
+     * @brief Power of two bucketed distribution made of registered counters.
+     *
+     * Each recorded value lands in the first bucket whose bound it does not exceed, buckets
+     * are printed as name.le_<bound> by dump_counters() alongside name.count, name.sum and
+     * name.max. Values above the last bound are counted in name.le_inf.
+     */
+    class histogram
+    {
+    public:
+        static constexpr size_t BUCKETS = HISTOGRAM_BUCKETS;
+
+        explicit histogram(const std::string &name)
+            : count_{name + ".count"}, sum_{name + ".sum"}, max_{name + ".max"}
+        {
+            for (size_t i = 0; i < BUCKETS; i++)
+            {
+                std::string bound = i + 1 < BUCKETS ? std::to_string(uint64_t{1} << i) : "inf";
+                buckets_[i] = new counter{name + ".le_" + bound};
+            }
+        }
+
+        ~histogram()
+        {
+            for (auto b : buckets_)
+            {
+                delete b;
+            }
+        }
+
+        histogram(const histogram &) = delete;
+        histogram &operator=(const histogram &) = delete;
+
+        void record(uint64_t value)
+        {
+            size_t bucket = 0;
+            while (bucket + 1 < BUCKETS && value > (uint64_t{1} << bucket))
+            {
+                bucket++;
+            }
+            buckets_[bucket]->add();
+            count_.add();
+            sum_.add(value);
+            max_.max(value);
+        }
+
+    private:
+        counter count_;
+        counter sum_;
+        counter max_;
+        counter *buckets_[BUCKETS];
+    };
+
+}; // namespace chat
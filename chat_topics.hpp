@@ -0,0 +1,348 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_stats.hpp"
+
+// separates the levels of a topic, e.g. site/floor3/temp
+#define TOPIC_SEPARATOR '/'
+// matches exactly one level in a subscription filter
+#define TOPIC_WILDCARD_ONE "+"
+// matches any number of remaining levels, only allowed as the last level of a filter
+#define TOPIC_WILDCARD_ALL "#"
+// published topics whose subscriber lists are cached between subscription changes
+#define TOPIC_CACHE_SIZE 1024
+
+namespace chat
+{
+
+    /**
+     * @brief check a topic a message is published to, it must be non-empty and free of wildcards
+     */
+    inline bool is_valid_topic(std::string_view topic)
+    {
+        if (topic.empty())
+        {
+            return false;
+        }
+        size_t start = 0;
+        for (;;)
+        {
+            size_t end = topic.find(TOPIC_SEPARATOR, start);
+            std::string_view level = topic.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+            if (level == TOPIC_WILDCARD_ONE || level == TOPIC_WILDCARD_ALL)
+            {
+                return false;
+            }
+            if (end == std::string_view::npos)
+            {
+                return true;
+            }
+            start = end + 1;
+        }
+    }
+
+    /**
+     * @brief check a subscription filter, wildcards must fill a whole level and # must come last
+     */
+    inline bool is_valid_filter(std::string_view filter)
+    {
+        if (filter.empty())
+        {
+            return false;
+        }
+        size_t start = 0;
+        for (;;)
+        {
+            size_t end = filter.find(TOPIC_SEPARATOR, start);
+            std::string_view level = filter.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+            if (level != TOPIC_WILDCARD_ONE && level != TOPIC_WILDCARD_ALL &&
+                (level.find('+') != std::string_view::npos || level.find('#') != std::string_view::npos))
+            {
+                return false;
+            }
+            if (end == std::string_view::npos)
+            {
+                return true;
+            }
+            if (level == TOPIC_WILDCARD_ALL)
+            {
+                return false;
+            }
+            start = end + 1;
+        }
+    }
+
+    /**
+     * @brief Trie of subscription filters indexed by topic level.
+     *
+     * Matching a published topic walks one trie path per level, branching only into the +
+     * and # children that exist, so it costs O(topic depth + matching subscribers) however
+     * many subscriptions there are. Results are cached per topic until the next subscription
+     * change. Not thread safe.
+     *
+     * @tparam Subscriber identifies a subscriber, must be ordered and copyable
+     */
+    template <typename Subscriber>
+    class topic_tree
+    {
+    public:
+        typedef std::vector<Subscriber> subscriber_list;
+        typedef std::shared_ptr<const subscriber_list> match_result;
+
+        topic_tree() : root_{new node{}} {}
+
+        /**
+         * @brief subscribe to filter, does nothing if already subscribed
+         * @return false if filter is not valid
+         */
+        bool subscribe(std::string_view filter, const Subscriber &subscriber)
+        {
+            if (!is_valid_filter(filter))
+            {
+                return false;
+            }
+            node *n = root_.get();
+            for_each_level(filter, [&n](std::string_view level)
+                           {
+                               auto it = n->children_.find(level);
+                               if (it == n->children_.end())
+                               {
+                                   it = n->children_.emplace(std::string{level}, std::unique_ptr<node>{new node{}}).first;
+                               }
+                               n = it->second.get(); });
+            auto it = std::lower_bound(n->subscribers_.begin(), n->subscribers_.end(), subscriber);
+            if (it == n->subscribers_.end() || *it != subscriber)
+            {
+                n->subscribers_.insert(it, subscriber);
+                filters_[subscriber].emplace_back(filter);
+                subscriptions_++;
+                changed();
+            }
+            return true;
+        }
+
+        /**
+         * @brief drop one subscription
+         * @return false if subscriber was not subscribed to filter
+         */
+        bool unsubscribe(std::string_view filter, const Subscriber &subscriber)
+        {
+            auto f = filters_.find(subscriber);
+            if (f == filters_.end())
+            {
+                return false;
+            }
+            auto pos = std::find(f->second.begin(), f->second.end(), filter);
+            if (pos == f->second.end())
+            {
+                return false;
+            }
+            f->second.erase(pos);
+            if (f->second.empty())
+            {
+                filters_.erase(f);
+            }
+            remove(root_.get(), filter, subscriber);
+            subscriptions_--;
+            changed();
+            return true;
+        }
+
+        /**
+         * @brief drop every subscription of subscriber, e.g. when it leaves
+         */
+        void unsubscribe_all(const Subscriber &subscriber)
+        {
+            auto f = filters_.find(subscriber);
+            if (f == filters_.end())
+            {
+                return;
+            }
+            for (const auto &filter : f->second)
+            {
+                remove(root_.get(), filter, subscriber);
+                subscriptions_--;
+            }
+            filters_.erase(f);
+            changed();
+        }
+
+        /**
+         * @brief drop every subscription
+         */
+        void clear()
+        {
+            root_.reset(new node{});
+            filters_.clear();
+            subscriptions_ = 0;
+            changed();
+        }
+
+        /**
+         * @brief subscribers whose filters match topic, each listed once
+         *
+         * The result is shared with the cache and stays valid after later subscription changes.
+         */
+        match_result match(std::string_view topic)
+        {
+            auto cached = cache_.find(topic);
+            if (cached != cache_.end())
+            {
+                stats().hits_.add();
+                return cached->second;
+            }
+            stats().misses_.add();
+
+            auto result = std::make_shared<subscriber_list>();
+            collect(root_.get(), topic, 0, *result);
+            std::sort(result->begin(), result->end());
+            result->erase(std::unique(result->begin(), result->end()), result->end());
+
+            if (cache_.size() >= TOPIC_CACHE_SIZE)
+            {
+                cache_.clear();
+            }
+            match_result shared = std::move(result);
+            cache_.emplace(std::string{topic}, shared);
+            return shared;
+        }
+
+        /**
+         * @brief number of subscriptions held
+         */
+        size_t size() const
+        {
+            return subscriptions_;
+        }
+
+    private:
+        struct node
+        {
+            std::map<std::string, std::unique_ptr<node>, std::less<>> children_;
+            subscriber_list subscribers_; // sorted
+        };
+
+        struct topic_hash
+        {
+            typedef void is_transparent;
+
+            size_t operator()(std::string_view topic) const
+            {
+                return std::hash<std::string_view>{}(topic);
+            }
+        };
+
+        // shared by every tree
+        struct topic_stats
+        {
+            counter hits_{"topics.cache_hits"};
+            counter misses_{"topics.cache_misses"};
+        };
+
+        static topic_stats &stats()
+        {
+            static topic_stats stats;
+            return stats;
+        }
+
+        template <typename F>
+        static void for_each_level(std::string_view path, F &&f)
+        {
+            size_t start = 0;
+            for (;;)
+            {
+                size_t end = path.find(TOPIC_SEPARATOR, start);
+                if (end == std::string_view::npos)
+                {
+                    f(path.substr(start));
+                    return;
+                }
+                f(path.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+
+        /**
+         * @brief gather subscribers of filters under n matching the levels of topic from start on
+         */
+        static void collect(const node *n, std::string_view topic, size_t start, subscriber_list &out)
+        {
+            // # also matches its parent level, so site/# matches site
+            auto all = n->children_.find(std::string_view{TOPIC_WILDCARD_ALL});
+            if (all != n->children_.end())
+            {
+                out.insert(out.end(), all->second->subscribers_.begin(), all->second->subscribers_.end());
+            }
+
+            if (start > topic.size())
+            {
+                out.insert(out.end(), n->subscribers_.begin(), n->subscribers_.end());
+                return;
+            }
+
+            size_t end = topic.find(TOPIC_SEPARATOR, start);
+            size_t next = end == std::string_view::npos ? topic.size() + 1 : end + 1;
+            std::string_view level = topic.substr(start, next - 1 - start);
+
+            auto exact = n->children_.find(level);
+            if (exact != n->children_.end())
+            {
+                collect(exact->second.get(), topic, next, out);
+            }
+            auto one = n->children_.find(std::string_view{TOPIC_WILDCARD_ONE});
+            if (one != n->children_.end())
+            {
+                collect(one->second.get(), topic, next, out);
+            }
+        }
+
+        /**
+         * @brief remove subscriber from the node for filter and prune nodes left empty
+         * @return true if n itself is now empty
+         */
+        static bool remove(node *n, std::string_view filter, const Subscriber &subscriber)
+        {
+            if (filter.data() == nullptr)
+            {
+                auto it = std::lower_bound(n->subscribers_.begin(), n->subscribers_.end(), subscriber);
+                if (it != n->subscribers_.end() && *it == subscriber)
+                {
+                    n->subscribers_.erase(it);
+                }
+            }
+            else
+            {
+                size_t end = filter.find(TOPIC_SEPARATOR);
+                std::string_view level = filter.substr(0, end);
+                std::string_view rest = end == std::string_view::npos ? std::string_view{} : filter.substr(end + 1);
+                auto it = n->children_.find(level);
+                if (it != n->children_.end() && remove(it->second.get(), rest, subscriber))
+                {
+                    n->children_.erase(it);
+                }
+            }
+            return n->subscribers_.empty() && n->children_.empty();
+        }
+
+        void changed()
+        {
+            cache_.clear();
+        }
+
+        std::unique_ptr<node> root_;
+        std::map<Subscriber, std::vector<std::string>> filters_;
+        std::unordered_map<std::string, match_result, topic_hash, std::equal_to<>> cache_;
+        size_t subscriptions_ = 0;
+    };
+
+}; // namespace chat
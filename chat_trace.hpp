@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "chat_new.hpp"
+#include "chat_stats.hpp"
+
+// marks a datagram as carrying a trace_extension after its chat_message
+#define TRACE_MAGIC 0x43545231u // "CTR1"
+
+namespace chat
+{
+
+    /**
+     * @brief Optional latency trace carried after a chat_message.
+     *
+     * A traced datagram is sizeof(traced_message) bytes instead of sizeof(chat_message), so
+     * untraced traffic is unchanged on the wire. Timestamps are wall clock microseconds, so
+     * hops between hosts are only meaningful if their clocks are synchronised.
+     */
+    struct trace_extension
+    {
+        uint32_t magic_;
+        uint32_t reserved_;
+        uint64_t trace_id_;
+        uint64_t client_send_;
+        uint64_t server_receive_;
+        uint64_t server_send_;
+    };
+
+    /**
+     * @brief chat_message followed by its trace, laid out exactly as sent
+     *
+     * The trace is kept as raw bytes, chat_message is not padded so it may be unaligned;
+     * use get_trace() and set_trace() to access it.
+     */
+    struct traced_message
+    {
+        chat_message message_;
+        char trace_[sizeof(trace_extension)];
+    };
+
+    static_assert(sizeof(traced_message) == sizeof(chat_message) + sizeof(trace_extension),
+                  "traced_message must not be padded");
+
+    /**
+     * @brief wall clock time in microseconds, used for every trace timestamp
+     */
+    inline uint64_t trace_clock()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    inline trace_extension get_trace(const traced_message &msg)
+    {
+        trace_extension trace;
+        memcpy(&trace, msg.trace_, sizeof(trace));
+        return trace;
+    }
+
+    inline void set_trace(traced_message &msg, const trace_extension &trace)
+    {
+        memcpy(msg.trace_, &trace, sizeof(trace));
+    }
+
+    /**
+     * @brief true if a datagram of length bytes received into msg carries a valid trace
+     */
+    inline bool has_trace(const traced_message &msg, ssize_t length)
+    {
+        return length == static_cast<ssize_t>(sizeof(traced_message)) && get_trace(msg).magic_ == TRACE_MAGIC;
+    }
+
+    /**
+     * @brief start a trace for a message about to be sent by a client
+     */
+    inline trace_extension begin_trace(uint64_t trace_id)
+    {
+        return trace_extension{TRACE_MAGIC, 0, trace_id, trace_clock(), 0, 0};
+    }
+
+    /**
+     * @brief time between two trace timestamps, clamped to zero if the clocks disagree
+     */
+    inline uint64_t trace_hop(uint64_t from, uint64_t to)
+    {
+        return to > from ? to - from : 0;
+    }
+
+    /**
+     * @brief per hop latency distributions, in microseconds
+     *
+     * The server fills uplink_ and server_, a client receiving relayed traffic fills all four.
+     */
+    struct trace_hops
+    {
+        histogram uplink_{"trace.uplink_us"};     // client send -> server receive
+        histogram server_{"trace.server_us"};     // server receive -> server send
+        histogram downlink_{"trace.downlink_us"}; // server send -> client receive
+        histogram total_{"trace.total_us"};       // client send -> client receive
+
+        /**
+         * @brief record the hops of a trace received by a client at receive
+         */
+        void record(const trace_extension &trace, uint64_t receive)
+        {
+            uplink_.record(trace_hop(trace.client_send_, trace.server_receive_));
+            server_.record(trace_hop(trace.server_receive_, trace.server_send_));
+            downlink_.record(trace_hop(trace.server_send_, receive));
+            total_.record(trace_hop(trace.client_send_, receive));
+        }
+    };
+
+    /**
+     * @brief trace of the message the calling thread is currently handling, or nullptr
+     */
+    inline const trace_extension *&active_trace()
+    {
+        thread_local const trace_extension *trace = nullptr;
+        return trace;
+    }
+
+    /**
+     * @brief RAII scope making trace the calling thread's active trace
+     */
+    class trace_scope
+    {
+    public:
+        explicit trace_scope(const trace_extension *trace) : previous_{active_trace()}
+        {
+            active_trace() = trace;
+        }
+
+        ~trace_scope()
+        {
+            active_trace() = previous_;
+        }
+
+        trace_scope(const trace_scope &) = delete;
+        trace_scope &operator=(const trace_scope &) = delete;
+
+    private:
+        const trace_extension *previous_;
+    };
+
+}; // namespace chat
@@ -0,0 +1,891 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "chat_dedup.hpp"
+#include "chat_new.hpp"
+#include "chat_shm.hpp"
+#include "chat_stats.hpp"
+
+// TCP port stream clients connect to
+#define STREAM_PORT (SERVER_PORT + 2)
+// path of the Unix domain socket local clients connect to
+#define UNIX_SOCKET_PATH "/tmp/chat_server.sock"
+// largest frame accepted on a stream, a traced chat_message fits with room to spare
+#define STREAM_FRAME_MAX 4096
+// a stream client that cannot take a frame for this long is disconnected
+#define STREAM_SEND_TIMEOUT_MS 1000
+
+namespace chat
+{
+
+    /**
+     * @brief How a client reaches the server
+     * @var transport_kind::TRANSPORT_UDP
+     * One chat_message per datagram, the original transport
+     * @var transport_kind::TRANSPORT_TCP
+     * Length framed messages over a TCP connection to STREAM_PORT
+     * @var transport_kind::TRANSPORT_UNIX
+     * Length framed messages over a stream connection to UNIX_SOCKET_PATH
+     * @var transport_kind::TRANSPORT_SHM
+     * Rings in a shared memory segment handed over on SHM_SOCKET_PATH
+     */
+    enum transport_kind
+    {
+        TRANSPORT_UDP,
+        TRANSPORT_TCP,
+        TRANSPORT_UNIX,
+        TRANSPORT_SHM,
+    };
+
+    /**
+     * @brief transport named by CHAT_TRANSPORT ("udp", "tcp", "unix" or "shm"), UDP if unset or unknown
+     */
+    inline transport_kind transport_from_env()
+    {
+        const char *name = getenv("CHAT_TRANSPORT");
+        std::string_view kind = name == nullptr ? "" : name;
+        return kind == "tcp"    ? TRANSPORT_TCP
+               : kind == "unix" ? TRANSPORT_UNIX
+               : kind == "shm"  ? TRANSPORT_SHM
+                                : TRANSPORT_UDP;
+    }
+
+    /**
+     * @brief Address standing in for a stream connection wherever sessions are keyed by address.
+     *
+     * Stream connections are numbered in 0.0.0.0/8, which is never the source of a datagram,
+     * with the transport in the port, so they can't collide with UDP clients.
+     */
+    inline sockaddr_in stream_address(uint32_t connection, transport_kind kind)
+    {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(connection & 0x00ffffff);
+        address.sin_port = htons(static_cast<uint16_t>(kind));
+        return address;
+    }
+
+    inline bool is_stream_address(const sockaddr_in &address)
+    {
+        return (ntohl(address.sin_addr.s_addr) >> 24) == 0;
+    }
+
+    inline uint32_t stream_connection(const sockaddr_in &address)
+    {
+        return ntohl(address.sin_addr.s_addr);
+    }
+
+    /**
+     * @brief write a 2 byte big endian length and then data to a stream
+     *
+     * Waits up to STREAM_SEND_TIMEOUT_MS for room if the stream is full.
+     *
+     * @return false if the frame could not be written whole, the stream is then unusable
+     */
+    inline bool write_frame(int fd, const char *data, size_t length)
+    {
+        if (length == 0 || length > STREAM_FRAME_MAX)
+        {
+            return false;
+        }
+        char frame[2 + STREAM_FRAME_MAX];
+        frame[0] = static_cast<char>(length >> 8);
+        frame[1] = static_cast<char>(length & 0xff);
+        memcpy(frame + 2, data, length);
+
+        size_t sent = 0;
+        while (sent < length + 2)
+        {
+            ssize_t n = send(fd, frame + sent, length + 2 - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0)
+            {
+                sent += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            pollfd p{fd, POLLOUT, 0};
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || poll(&p, 1, STREAM_SEND_TIMEOUT_MS) <= 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Splits the bytes read from a stream back into frames.
+     */
+    class frame_reader
+    {
+    public:
+        /**
+         * @brief read whatever is available from fd
+         * @return bytes read, 0 at end of stream, -1 on error (EAGAIN if nothing was available)
+         */
+        ssize_t fill(int fd)
+        {
+            if (start_ > 0 && start_ == used_)
+            {
+                start_ = used_ = 0;
+            }
+            else if (used_ == sizeof(buffer_))
+            {
+                memmove(buffer_, buffer_ + start_, used_ - start_);
+                used_ -= start_;
+                start_ = 0;
+            }
+            ssize_t n = recv(fd, buffer_ + used_, sizeof(buffer_) - used_, 0);
+            if (n > 0)
+            {
+                used_ += static_cast<size_t>(n);
+            }
+            return n;
+        }
+
+        /**
+         * @brief take the next complete frame, valid until the next fill
+         * @return false if no complete frame has been read yet
+         */
+        bool next(std::string_view &frame)
+        {
+            if (used_ - start_ < 2)
+            {
+                return false;
+            }
+            size_t length = (static_cast<uint8_t>(buffer_[start_]) << 8) | static_cast<uint8_t>(buffer_[start_ + 1]);
+            if (used_ - start_ < 2 + length)
+            {
+                return false;
+            }
+            frame = std::string_view{buffer_ + start_ + 2, length};
+            start_ += 2 + length;
+            return true;
+        }
+
+        /**
+         * @brief true if the stream sent a frame length that can't be valid
+         */
+        bool corrupt() const
+        {
+            if (used_ - start_ < 2)
+            {
+                return false;
+            }
+            size_t length = (static_cast<uint8_t>(buffer_[start_]) << 8) | static_cast<uint8_t>(buffer_[start_ + 1]);
+            return length == 0 || length > STREAM_FRAME_MAX;
+        }
+
+    private:
+        char buffer_[2 * (2 + STREAM_FRAME_MAX)];
+        size_t start_ = 0;
+        size_t used_ = 0;
+    };
+
+    /**
+     * @brief Server side of the TCP, Unix domain and shared memory transports.
+     *
+     * One thread waits on every listener and connection with epoll, splits what arrives into
+     * frames and passes each to the server with the connection's stream_address, exactly as
+     * if it had been received as a datagram from there. Replies are framed and written
+     * straight from the handler that sends them.
+     *
+     * A shared memory client connects to its listener only to pass over its segment and
+     * eventfds, and keeps that control socket open until it goes. Its messages are popped
+     * from one ring when its eventfd fires, and replies, fan-out included, are copied
+     * straight into the other ring without a system call unless the client is asleep.
+     */
+    class stream_server
+    {
+    public:
+        /**
+         * @brief called with each frame received and the address of the connection it came on
+         */
+        typedef std::function<void(const char *, size_t, const sockaddr_in &)> deliver_function;
+        /**
+         * @brief called once a connection has closed, with its address
+         */
+        typedef std::function<void(const sockaddr_in &)> closed_function;
+
+        stream_server()
+            : connections_{"transport.stream_connections"}, disconnects_{"transport.stream_disconnects"},
+              shm_full_{"transport.shm_full"} {}
+
+        ~stream_server()
+        {
+            stop();
+        }
+
+        stream_server(const stream_server &) = delete;
+        stream_server &operator=(const stream_server &) = delete;
+
+        /**
+         * @brief accept TCP clients on address:STREAM_PORT
+         * @return false if the port could not be opened
+         */
+        bool listen_tcp(const sockaddr_in &address)
+        {
+            sockaddr_in bind_address = address;
+            bind_address.sin_port = htons(STREAM_PORT);
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            return add_listener(fd, (sockaddr *)&bind_address, sizeof(bind_address), TRANSPORT_TCP);
+        }
+
+        /**
+         * @brief accept local clients on the Unix domain socket at path, replacing any stale one
+         * @return false if the socket could not be created
+         */
+        bool listen_unix(const char *path)
+        {
+            sockaddr_un bind_address;
+            memset(&bind_address, 0, sizeof(bind_address));
+            bind_address.sun_family = AF_UNIX;
+            strncpy(bind_address.sun_path, path, sizeof(bind_address.sun_path) - 1);
+            unlink(path);
+            paths_.push_back(path);
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            return add_listener(fd, (sockaddr *)&bind_address, sizeof(bind_address), TRANSPORT_UNIX);
+        }
+
+        /**
+         * @brief accept shared memory clients handing over their segments on path
+         * @return false if the socket could not be created
+         */
+        bool listen_shm(const char *path)
+        {
+            if (!listen_unix(path))
+            {
+                return false;
+            }
+            listeners_.back().kind_ = TRANSPORT_SHM;
+            return true;
+        }
+
+        /**
+         * @brief start the receive thread
+         */
+        void start(deliver_function deliver, closed_function closed)
+        {
+            deliver_ = std::move(deliver);
+            closed_ = std::move(closed);
+            thread_ = std::thread{[this]()
+                                  { run(); }};
+        }
+
+        /**
+         * @brief stop receiving and close every listener and connection
+         */
+        void stop()
+        {
+            if (thread_.joinable())
+            {
+                uint64_t one = 1;
+                ssize_t written = write(wake_fd_, &one, sizeof(one));
+                (void)written;
+                thread_.join();
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            for (auto &[id, c] : open_)
+            {
+                release(*c);
+            }
+            open_.clear();
+            for (auto &l : listeners_)
+            {
+                close(l.fd_);
+            }
+            listeners_.clear();
+            for (auto &path : paths_)
+            {
+                unlink(path.c_str());
+            }
+            paths_.clear();
+            if (epoll_fd_ >= 0)
+            {
+                close(epoll_fd_);
+                close(wake_fd_);
+                epoll_fd_ = wake_fd_ = -1;
+            }
+        }
+
+        /**
+         * @brief frame and send data to the connection behind address
+         * @return length on success, -1 with errno EAGAIN if a shared memory ring is full, or
+         *         EPIPE if the connection is gone or could not take the frame
+         */
+        ssize_t send(const sockaddr_in &address, const char *data, size_t length)
+        {
+            std::shared_ptr<connection> c;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                auto it = open_.find(stream_connection(address));
+                if (it == open_.end())
+                {
+                    errno = EPIPE;
+                    return -1;
+                }
+                c = it->second;
+            }
+            std::lock_guard<std::mutex> lock{c->write_mutex_};
+            if (c->shm_ != nullptr)
+            {
+                if (!c->writable_)
+                {
+                    errno = EPIPE;
+                    return -1;
+                }
+                if (!c->shm_->to_client_.push(data, length, c->to_client_))
+                {
+                    // a full ring drops the message, as a full socket buffer drops a datagram,
+                    // and like one it is worth retrying
+                    shm_full_.add();
+                    errno = EAGAIN;
+                    return -1;
+                }
+                return static_cast<ssize_t>(length);
+            }
+            if (!c->writable_ || !write_frame(c->fd_, data, length))
+            {
+                // a client too slow to keep up is cut off rather than stalling the handlers,
+                // the receive thread sees the shutdown and cleans up
+                c->writable_ = false;
+                shutdown(c->fd_, SHUT_RDWR);
+                errno = EPIPE;
+                return -1;
+            }
+            return static_cast<ssize_t>(length);
+        }
+
+    private:
+        struct listener
+        {
+            int fd_;
+            transport_kind kind_;
+        };
+
+        struct connection
+        {
+            int fd_; // the stream, or the control socket of a shared memory client
+            transport_kind kind_;
+            sockaddr_in address_;
+            frame_reader reader_;
+            std::mutex write_mutex_;
+            bool writable_ = true;
+            shm_segment *shm_ = nullptr;
+            int to_server_ = -1;
+            int to_client_ = -1;
+        };
+
+        // epoll data of listeners and the wake up event, connections use their number
+        static constexpr uint64_t LISTENER_TAG = uint64_t{1} << 32;
+        static constexpr uint64_t WAKE_TAG = uint64_t{1} << 33;
+        // epoll data of the eventfd a shared memory client signals, with its number
+        static constexpr uint64_t RING_TAG = uint64_t{1} << 34;
+
+        bool add_listener(int fd, const sockaddr *address, socklen_t length, transport_kind kind)
+        {
+            if (fd < 0 || bind(fd, address, length) != 0 || ::listen(fd, 64) != 0 || !ensure_epoll())
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return false;
+            }
+            std::lock_guard<std::mutex> lock{mutex_};
+            epoll_event event{EPOLLIN, {.u64 = LISTENER_TAG | listeners_.size()}};
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+            listeners_.push_back({fd, kind});
+            return true;
+        }
+
+        bool ensure_epoll()
+        {
+            if (epoll_fd_ >= 0)
+            {
+                return true;
+            }
+            epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+            wake_fd_ = eventfd(0, EFD_CLOEXEC);
+            epoll_event event{EPOLLIN, {.u64 = WAKE_TAG}};
+            return epoll_fd_ >= 0 && wake_fd_ >= 0 && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) == 0;
+        }
+
+        void run()
+        {
+            epoll_event events[64];
+            for (;;)
+            {
+                int n = epoll_wait(epoll_fd_, events, 64, -1);
+                if (n < 0 && errno != EINTR)
+                {
+                    return;
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    uint64_t tag = events[i].data.u64;
+                    if (tag == WAKE_TAG)
+                    {
+                        return;
+                    }
+                    if (tag & LISTENER_TAG)
+                    {
+                        accept_all(listeners_[tag & ~LISTENER_TAG]);
+                    }
+                    else if (tag & RING_TAG)
+                    {
+                        drain(static_cast<uint32_t>(tag));
+                    }
+                    else
+                    {
+                        receive(static_cast<uint32_t>(tag));
+                    }
+                }
+            }
+        }
+
+        void accept_all(const listener &l)
+        {
+            for (;;)
+            {
+                int fd = accept4(l.fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                {
+                    return;
+                }
+                if (l.kind_ == TRANSPORT_TCP)
+                {
+                    // chat messages are small and latency matters more than packing them
+                    int on = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                }
+                auto c = std::make_shared<connection>();
+                c->fd_ = fd;
+                c->kind_ = l.kind_;
+                uint32_t id;
+                {
+                    std::lock_guard<std::mutex> lock{mutex_};
+                    do
+                    {
+                        next_id_ = (next_id_ + 1) & 0x00ffffff;
+                    } while (next_id_ == 0 || open_.count(next_id_) != 0);
+                    id = next_id_;
+                    c->address_ = stream_address(id, l.kind_);
+                    open_[id] = c;
+                }
+                epoll_event event{EPOLLIN, {.u64 = id}};
+                epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+                connections_.add();
+            }
+        }
+
+        void receive(uint32_t id)
+        {
+            std::shared_ptr<connection> c;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                auto it = open_.find(id);
+                if (it == open_.end())
+                {
+                    return;
+                }
+                c = it->second;
+            }
+            if (c->kind_ == TRANSPORT_SHM)
+            {
+                control(c);
+                return;
+            }
+            for (;;)
+            {
+                ssize_t n = c->reader_.fill(c->fd_);
+                std::string_view frame;
+                while (c->reader_.next(frame))
+                {
+                    deliver_(frame.data(), frame.size(), c->address_);
+                }
+                if (n == 0 || c->reader_.corrupt() || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                    drop(c);
+                    return;
+                }
+                if (n < 0 && errno != EINTR)
+                {
+                    return;
+                }
+            }
+        }
+
+        /**
+         * @brief activity on the control socket of a shared memory client: its descriptors
+         * arriving, or it closing
+         */
+        void control(const std::shared_ptr<connection> &c)
+        {
+            if (c->shm_ == nullptr)
+            {
+                int fds[SHM_FD_COUNT];
+                if (!receive_descriptors(c->fd_, fds))
+                {
+                    drop(c);
+                    return;
+                }
+                c->to_server_ = fds[SHM_FD_TO_SERVER];
+                c->to_client_ = fds[SHM_FD_TO_CLIENT];
+                if (!prepare_eventfd(c->to_server_) || !prepare_eventfd(c->to_client_))
+                {
+                    close(fds[SHM_FD_SEGMENT]);
+                    drop(c);
+                    return;
+                }
+                shm_segment *segment = map_segment(fds[SHM_FD_SEGMENT]);
+                close(fds[SHM_FD_SEGMENT]);
+                if (segment == nullptr)
+                {
+                    drop(c);
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock{c->write_mutex_};
+                    c->shm_ = segment;
+                }
+                epoll_event event{EPOLLIN, {.u64 = RING_TAG | stream_connection(c->address_)}};
+                epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, c->to_server_, &event);
+                // anything queued before we were listening
+                drain(stream_connection(c->address_));
+                return;
+            }
+            char byte;
+            ssize_t n = recv(c->fd_, &byte, 1, 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                drop(c);
+            }
+        }
+
+        /**
+         * @brief deliver the messages waiting in a shared memory client's ring
+         *
+         * The ring is in memory the client can write, so at most a ring's worth is taken per
+         * call before coming back round, however the client sets its indices.
+         */
+        void drain(uint32_t id)
+        {
+            std::shared_ptr<connection> c;
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                auto it = open_.find(id);
+                if (it == open_.end() || it->second->shm_ == nullptr)
+                {
+                    return;
+                }
+                c = it->second;
+            }
+            uint64_t count;
+            ssize_t drained = read(c->to_server_, &count, sizeof(count));
+            (void)drained;
+
+            shm_ring &ring = c->shm_->to_server_;
+            ring.awake();
+            char data[MAX_CHAT_DATAGRAM];
+            for (int i = 0; i < SHM_RING_SLOTS; i++)
+            {
+                ssize_t n = ring.pop(data, sizeof(data));
+                if (n < 0)
+                {
+                    if (ring.sleep_ready())
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                deliver_(data, static_cast<size_t>(n), c->address_);
+            }
+            // more than a ring's worth, go round the other connections first
+            uint64_t one = 1;
+            ssize_t written = write(c->to_server_, &one, sizeof(one));
+            (void)written;
+        }
+
+        /**
+         * @brief close a connection's descriptors and unmap its segment, write_mutex_ held or unshared
+         */
+        static void release(connection &c)
+        {
+            c.writable_ = false;
+            close(c.fd_);
+            if (c.shm_ != nullptr)
+            {
+                munmap(c.shm_, sizeof(shm_segment));
+                c.shm_ = nullptr;
+            }
+            for (int fd : {c.to_server_, c.to_client_})
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+            c.to_server_ = c.to_client_ = -1;
+        }
+
+        void drop(const std::shared_ptr<connection> &c)
+        {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd_, nullptr);
+            if (c->to_server_ >= 0)
+            {
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->to_server_, nullptr);
+            }
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                open_.erase(stream_connection(c->address_));
+            }
+            {
+                // wait out any handler still writing before the descriptors can be reused
+                std::lock_guard<std::mutex> lock{c->write_mutex_};
+                release(*c);
+            }
+            disconnects_.add();
+            closed_(c->address_);
+        }
+
+        int epoll_fd_ = -1;
+        int wake_fd_ = -1;
+        std::thread thread_;
+        std::vector<std::string> paths_;
+        deliver_function deliver_;
+        closed_function closed_;
+
+        std::mutex mutex_;
+        std::vector<listener> listeners_;
+        std::map<uint32_t, std::shared_ptr<connection>> open_;
+        uint32_t next_id_ = 0;
+
+        counter connections_;
+        counter disconnects_;
+        counter shm_full_;
+    };
+
+    /**
+     * @brief The server's outgoing side, sending to each address over the transport it is on.
+     *
+     * Has the sendto of the datagram socket it wraps, so handlers and async_sendto use it
+     * unchanged whichever transport a client is on.
+     *
+     * @tparam Datagram datagram socket providing sendto(const char *, size_t, int, const sockaddr *, socklen_t)
+     */
+    template <typename Datagram>
+    class transport_hub
+    {
+    public:
+        explicit transport_hub(Datagram &datagram) : datagram_{datagram} {}
+
+        /**
+         * @brief also reach clients of streams, pass nullptr once it stops
+         */
+        void attach(stream_server *streams)
+        {
+            streams_.store(streams, std::memory_order_release);
+        }
+
+        ssize_t sendto(const char *data, size_t length, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            const sockaddr_in &address = *reinterpret_cast<const sockaddr_in *>(to);
+            if (is_stream_address(address))
+            {
+                stream_server *streams = streams_.load(std::memory_order_acquire);
+                return streams != nullptr ? streams->send(address, data, length) : -1;
+            }
+            return datagram_.sendto(data, length, flags, to, to_length);
+        }
+
+        /**
+         * @brief send count messages of segment bytes each to one address, in one go where the transport can
+         */
+        ssize_t send_segments(const char *data, size_t segment, size_t count, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            const sockaddr_in &address = *reinterpret_cast<const sockaddr_in *>(to);
+            if (!is_stream_address(address))
+            {
+                return datagram_.send_segments(data, segment, count, flags, to, to_length);
+            }
+            ssize_t sent = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (sendto(data + i * segment, segment, flags, to, to_length) > 0)
+                {
+                    sent += static_cast<ssize_t>(segment);
+                }
+            }
+            return sent > 0 ? sent : -1;
+        }
+
+        Datagram &datagram()
+        {
+            return datagram_;
+        }
+
+    private:
+        Datagram &datagram_;
+        std::atomic<stream_server *> streams_{nullptr};
+    };
+
+    /**
+     * @brief A client's connection to the server over whichever transport it chose.
+     *
+     * Has the sendto and recvfrom of the datagram socket it wraps; over a stream every call
+     * moves one framed message and the addresses passed are ignored.
+     *
+     * @tparam Datagram datagram socket providing sendto and recvfrom
+     */
+    template <typename Datagram>
+    class client_transport
+    {
+    public:
+        explicit client_transport(Datagram &datagram) : datagram_{datagram} {}
+
+        ~client_transport()
+        {
+            if (fd_ >= 0)
+            {
+                close(fd_);
+            }
+        }
+
+        client_transport(const client_transport &) = delete;
+        client_transport &operator=(const client_transport &) = delete;
+
+        /**
+         * @brief switch to a stream transport to the server, does nothing for TRANSPORT_UDP
+         * @param server address of the server, TCP connects to STREAM_PORT on its host
+         * @return false if the connection failed
+         */
+        bool connect(transport_kind kind, const sockaddr_in &server)
+        {
+            if (kind == TRANSPORT_UDP)
+            {
+                return true;
+            }
+            if (kind == TRANSPORT_SHM)
+            {
+                shm_.reset(new shm_client{});
+                return shm_->connect(SHM_SOCKET_PATH);
+            }
+            int fd;
+            if (kind == TRANSPORT_TCP)
+            {
+                sockaddr_in address = server;
+                address.sin_port = htons(STREAM_PORT);
+                fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                if (fd >= 0 && ::connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            else
+            {
+                sockaddr_un address;
+                memset(&address, 0, sizeof(address));
+                address.sun_family = AF_UNIX;
+                strncpy(address.sun_path, UNIX_SOCKET_PATH, sizeof(address.sun_path) - 1);
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd >= 0 && ::connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            fd_ = fd;
+            return fd_ >= 0;
+        }
+
+        ssize_t sendto(const char *data, size_t length, int flags, const sockaddr *to, socklen_t to_length)
+        {
+            if (shm_ != nullptr)
+            {
+                return shm_->send(data, length);
+            }
+            if (fd_ < 0)
+            {
+                return datagram_.sendto(data, length, flags, to, to_length);
+            }
+            std::lock_guard<std::mutex> lock{write_mutex_};
+            return write_frame(fd_, data, length) ? static_cast<ssize_t>(length) : -1;
+        }
+
+        /**
+         * @brief receive one message, truncated to length like a datagram
+         * @return size of the message, or -1 once a stream has closed
+         */
+        ssize_t recvfrom(char *data, size_t length, int flags, sockaddr *from, size_t *from_length)
+        {
+            if (shm_ != nullptr)
+            {
+                return shm_->receive(data, length);
+            }
+            if (fd_ < 0)
+            {
+                return datagram_.recvfrom(data, length, flags, from, from_length);
+            }
+            std::string_view frame;
+            while (!reader_.next(frame))
+            {
+                ssize_t n = reader_.fill(fd_);
+                if (n == 0 || reader_.corrupt() || (n < 0 && errno != EINTR))
+                {
+                    closed_ = true;
+                    return -1;
+                }
+            }
+            memcpy(data, frame.data(), std::min(length, frame.size()));
+            return static_cast<ssize_t>(frame.size());
+        }
+
+        /**
+         * @brief true once the stream to the server has closed
+         */
+        bool closed() const
+        {
+            return closed_ || (shm_ != nullptr && shm_->closed());
+        }
+
+    private:
+        Datagram &datagram_;
+        std::unique_ptr<shm_client> shm_;
+        int fd_ = -1;
+        frame_reader reader_;
+        std::mutex write_mutex_;
+        std::atomic<bool> closed_{false};
+    };
+
+}; // namespace chat